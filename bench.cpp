@@ -0,0 +1,278 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "fat.h"
+#include "fat_file.h"
+#include "fat_dedup.h"
+#include "fat_tier.h"
+#include "fat_memory.h"
+
+// Benchmarks, run with `make bench`. Each prints one line per variant.
+
+static double seconds_since(const std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Fill buffer with bytes that do not repeat across calls.
+static void fill_unique(std::vector<char> &buffer, unsigned &seed) {
+	for (size_t i = 0; i < buffer.size(); i += 4) {
+		seed = seed * 1103515245 + 12345;
+		memcpy(&buffer[i], &seed, std::min((size_t)4, buffer.size() - i));
+	}
+}
+
+/**
+ * Write files that share half of their blocks (a common template) and
+ * are unique otherwise, with dedup off and on.
+ */
+static void bench_dedup() {
+	const int BLOCK_SIZE = 4096;
+	const int FILES = 32;
+	const int FILE_BLOCKS = 1024; // 4 MB per file
+	const int CHUNK_BLOCKS = 16;
+	std::vector<char> template_chunk(CHUNK_BLOCKS * BLOCK_SIZE), unique_chunk(CHUNK_BLOCKS * BLOCK_SIZE);
+	unsigned seed = 1;
+	fill_unique(template_chunk, seed);
+
+	for (int dedup = 0; dedup < 2; dedup++) {
+		FAT_FILESYSTEM * fs = mini_fat_create("bench.fat", BLOCK_SIZE, (fat_block_t)FILES * FILE_BLOCKS + 1024);
+		if (dedup) mini_fat_dedup_enable(fs);
+		seed = 2;
+		double elapsed = 0;
+		char name[32];
+		for (int f = 0; f < FILES; f++) {
+			snprintf(name, sizeof(name), "file%d", f);
+			FAT_OPEN_FILE * fd = mini_file_open(fs, name, true);
+			for (int c = 0; c < FILE_BLOCKS / CHUNK_BLOCKS; c++) {
+				bool shared = c % 2 == 0;
+				if (!shared) fill_unique(unique_chunk, seed);
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				mini_file_write(fs, fd, unique_chunk.size(), shared ? template_chunk.data() : unique_chunk.data());
+				elapsed += seconds_since(start);
+			}
+			mini_file_close(fs, fd);
+		}
+		fat_block_t used = 0;
+		for (fat_block_t i = 0; i < fs->block_count; i++) used += fs->block_map[i] == FILE_DATA_BLOCK;
+		double mb = (double)FILES * FILE_BLOCKS * BLOCK_SIZE / (1 << 20);
+		printf("dedup %-3s  %6.0f MB written in %6.3f s = %7.1f MB/s, %7lld data blocks used",
+			dedup ? "on" : "off", mb, elapsed, mb / elapsed, (long long)used);
+		if (dedup) {
+			printf(", ratio %.2f", mini_fat_dedup_stats(fs).ratio);
+		}
+		printf("\n");
+		unlink("bench.fat");
+	}
+}
+
+// Write count files of blocks blocks each, named prefix<n>.
+static void write_files(FAT_FILESYSTEM *fs, const char *prefix, const int count, const int blocks, unsigned &seed) {
+	std::vector<char> chunk(blocks * fs->block_size);
+	char name[32];
+	for (int f = 0; f < count; f++) {
+		fill_unique(chunk, seed);
+		snprintf(name, sizeof(name), "%s%d", prefix, f);
+		FAT_OPEN_FILE * fd = mini_file_open(fs, name, true);
+		mini_file_write(fs, fd, chunk.size(), chunk.data());
+		mini_file_close(fs, fd);
+	}
+}
+
+/**
+ * One pass of random block reads over the hot files, with the capacity
+ * image dropped from the host page cache first, as if it were on a disk
+ * that is not cached.
+ * @return mean microseconds per read
+ */
+static double hot_pass(FAT_FILESYSTEM *fs, const int files, const int blocks, unsigned &seed) {
+	fdatasync(fs->image_fd);
+	posix_fadvise(fs->image_fd, 0, 0, POSIX_FADV_DONTNEED);
+	std::vector<FAT_OPEN_FILE *> handles(files);
+	char name[32];
+	for (int f = 0; f < files; f++) {
+		snprintf(name, sizeof(name), "hot%d", f);
+		handles[f] = mini_file_open(fs, name, false);
+	}
+	std::vector<char> buffer(fs->block_size);
+	const int reads = files * blocks;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < reads; i++) {
+		seed = seed * 1103515245 + 12345;
+		int f = (seed >> 8) % files;
+		mini_file_seek(fs, handles[f], (fat_off_t)((seed >> 16) % blocks) * fs->block_size, true);
+		mini_file_read(fs, handles[f], buffer.size(), buffer.data());
+	}
+	double elapsed = seconds_since(start);
+	for (int f = 0; f < files; f++) mini_file_close(fs, handles[f]);
+	return elapsed * 1e6 / reads;
+}
+
+/**
+ * A small fast tier (on tmpfs) in front of a capacity image. A cold
+ * archive fills the fast tier, so the hot set written after it lands on
+ * the capacity tier. Hot reads are timed before and after migration, and
+ * against a volume where the hot set was written to the fast tier.
+ */
+static void bench_tier() {
+	const int BLOCK_SIZE = 4096;
+	const int CAPACITY_BLOCKS = 16384; // 64 MB
+	const int FAST_BLOCKS = 2048; // 8 MB
+	const int COLD_FILES = 40, HOT_FILES = 16, FILE_BLOCKS = 64; // 256 KB per file
+	const char * fast_image = access("/dev/shm", W_OK) == 0 ? "/dev/shm/bench_fast.fat" : "bench_fast.fat";
+
+	for (int variant = 0; variant < 2; variant++) {
+		bool hot_first = variant == 1;
+		FAT_FILESYSTEM * fs = mini_fat_create("bench.fat", BLOCK_SIZE, CAPACITY_BLOCKS);
+		mini_fat_tier_attach(fs, fast_image, FAST_BLOCKS);
+		unsigned seed = 3;
+		if (hot_first) write_files(fs, "hot", HOT_FILES, FILE_BLOCKS, seed);
+		write_files(fs, "cold", COLD_FILES, FILE_BLOCKS, seed);
+		if (!hot_first) write_files(fs, "hot", HOT_FILES, FILE_BLOCKS, seed);
+
+		if (hot_first) {
+			hot_pass(fs, HOT_FILES, FILE_BLOCKS, seed);
+			printf("tier fast only       hot read %7.1f us\n", hot_pass(fs, HOT_FILES, FILE_BLOCKS, seed));
+		} else {
+			double before = hot_pass(fs, HOT_FILES, FILE_BLOCKS, seed);
+			for (int i = 1; i < FAT_TIER_PROMOTE_HEAT; i++) hot_pass(fs, HOT_FILES, FILE_BLOCKS, seed);
+			//every round moves one batch, and the counts must build up again in between
+			int rounds = 0;
+			while (mini_fat_tier_migrate(fs) > 0) {
+				rounds++;
+				for (int i = 0; i < FAT_TIER_PROMOTE_HEAT; i++) hot_pass(fs, HOT_FILES, FILE_BLOCKS, seed);
+			}
+			double after = hot_pass(fs, HOT_FILES, FILE_BLOCKS, seed);
+			FAT_TIER_STATS stats = mini_fat_tier_stats(fs);
+			printf("tier before migrate  hot read %7.1f us\n", before);
+			printf("tier after %2d rounds hot read %7.1f us, %lld blocks promoted, %lld demoted\n",
+				rounds, after, (long long)stats.promoted, (long long)stats.demoted);
+			printf("tier capacity        %lld MB = %d MB capacity + %d MB fast\n",
+				(long long)fs->block_count * BLOCK_SIZE >> 20, CAPACITY_BLOCKS * BLOCK_SIZE >> 20, FAST_BLOCKS * BLOCK_SIZE >> 20);
+		}
+		unlink("bench.fat");
+		unlink(fast_image);
+	}
+}
+
+/**
+ * One pass of random one-block reads or overwrites over the files written
+ * by write_files(fs, "data", ...).
+ * @return mean microseconds per call
+ */
+static double block_pass(FAT_FILESYSTEM *fs, const bool is_write, const int files, const int blocks, unsigned &seed) {
+	std::vector<FAT_OPEN_FILE *> handles(files);
+	char name[32];
+	for (int f = 0; f < files; f++) {
+		snprintf(name, sizeof(name), "data%d", f);
+		handles[f] = mini_file_open(fs, name, is_write);
+	}
+	std::vector<char> buffer(fs->block_size, 'x');
+	const int calls = files * blocks;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < calls; i++) {
+		seed = seed * 1103515245 + 12345;
+		int f = (seed >> 8) % files;
+		mini_file_seek(fs, handles[f], (fat_off_t)((seed >> 16) % blocks) * fs->block_size, true);
+		if (is_write) {
+			mini_file_write(fs, handles[f], buffer.size(), buffer.data());
+		} else {
+			mini_file_read(fs, handles[f], buffer.size(), buffer.data());
+		}
+	}
+	double elapsed = seconds_since(start);
+	for (int f = 0; f < files; f++) mini_file_close(fs, handles[f]);
+	return elapsed * 1e6 / calls;
+}
+
+/**
+ * Block reads and overwrites on an image file (cached by the host) and on
+ * a memory volume, then overwrites of the memory volume while a snapshot
+ * of it is written.
+ */
+static void bench_memory() {
+	const int BLOCK_SIZE = 4096;
+	const int BLOCKS = 32768; // 128 MB
+	const int FILES = 64, FILE_BLOCKS = 256; // 1 MB per file
+	const char * names[] = {"bench.fat", "mem:bench"};
+	for (int variant = 0; variant < 2; variant++) {
+		FAT_FILESYSTEM * fs = mini_fat_create(names[variant], BLOCK_SIZE, BLOCKS);
+		unsigned seed = 5;
+		write_files(fs, "data", FILES, FILE_BLOCKS, seed);
+		block_pass(fs, false, FILES, FILE_BLOCKS, seed);
+		double read = block_pass(fs, false, FILES, FILE_BLOCKS, seed);
+		double write = block_pass(fs, true, FILES, FILE_BLOCKS, seed);
+		printf("memory %-6s        read %5.2f us  write %5.2f us\n", variant == 0 ? "file" : "volume", read, write);
+		if (fs->memory != NULL) {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			mini_fat_memory_snapshot(fs, "bench_snap.fat", 0);
+			write = block_pass(fs, true, FILES, FILE_BLOCKS, seed);
+			mini_fat_memory_wait(fs);
+			FAT_MEMORY_STATS stats = mini_fat_memory_stats(fs);
+			printf("memory snapshot     write %5.2f us, %.3f s for %d MB, %lld blocks preserved, huge pages %s\n", write,
+				seconds_since(start), FILES * FILE_BLOCKS * BLOCK_SIZE >> 20, (long long)stats.preserved, stats.huge_pages ? "yes" : "no");
+			unlink("bench_snap.fat");
+		}
+		unlink("bench.fat");
+	}
+}
+
+/**
+ * Stream a large file in 1 MB calls while small files are written next to
+ * it, then read it back in 1 MB calls, on a volume of 4 KB blocks and on
+ * one of 64 KB blocks. Also shows the space the small files take.
+ */
+static void bench_large_blocks() {
+	const fat_off_t VOLUME = (fat_off_t)512 << 20;
+	const int CHUNK = 1 << 20, CHUNKS = 128; // 128 MB file
+	const int SMALL_PER_CHUNK = 8, SMALL_SIZE = 1000;
+	const int block_sizes[] = {4096, 65536};
+	for (int variant = 0; variant < 2; variant++) {
+		FAT_FILESYSTEM * fs = mini_fat_create("bench.fat", block_sizes[variant], VOLUME / block_sizes[variant]);
+		unsigned seed = 7;
+		std::vector<char> chunk(CHUNK);
+		fill_unique(chunk, seed);
+		char name[32];
+		double write_seconds = 0;
+		FAT_OPEN_FILE * stream = mini_file_open(fs, "stream.bin", true);
+		for (int c = 0; c < CHUNKS; c++) {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			mini_file_write(fs, stream, chunk.size(), chunk.data());
+			write_seconds += seconds_since(start);
+			for (int f = 0; f < SMALL_PER_CHUNK; f++) {
+				snprintf(name, sizeof(name), "small%d", c * SMALL_PER_CHUNK + f);
+				FAT_OPEN_FILE * fd = mini_file_open(fs, name, true);
+				mini_file_write(fs, fd, SMALL_SIZE, chunk.data());
+				mini_file_close(fs, fd);
+			}
+		}
+		mini_file_close(fs, stream);
+		stream = mini_file_open(fs, "stream.bin", false);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int c = 0; c < CHUNKS; c++) {
+			mini_file_read(fs, stream, chunk.size(), chunk.data());
+		}
+		double read_seconds = seconds_since(start);
+		mini_file_close(fs, stream);
+		fat_off_t small_bytes = 0;
+		for (size_t i = 0; i < fs->files.size(); i++) {
+			if (strncmp(fs->files[i]->name, "small", 5) == 0) small_bytes += fs->files[i]->block_ids.size() * fs->block_size;
+		}
+		printf("blocks %2d KB  stream write %6.0f MB/s  read %6.0f MB/s  %d small files take %5.1f MB\n", fs->block_size >> 10,
+			CHUNKS / write_seconds, CHUNKS / read_seconds, CHUNKS * SMALL_PER_CHUNK, small_bytes / 1048576.0);
+		unlink("bench.fat");
+	}
+}
+
+int main()
+{
+	bench_dedup();
+	bench_tier();
+	bench_memory();
+	bench_large_blocks();
+	return 0;
+}
@@ -3,12 +3,108 @@
 #include <stddef.h>
 #include <unistd.h>
 #include <list>
+#include <algorithm>
 #include <cassert>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "fat.h"
 #include "fat_file.h"
+#include "fat_trim.h"
+#include "fat_dedup.h"
+#include "fat_direct.h"
+#include "fat_share.h"
+#include "fat_tier.h"
+#include "fat_memory.h"
+#include "fat_trace.h"
 
+// Bytes of block 0 used by the superblock, see mini_fat_save.
+const int FAT_SUPERBLOCK_SIZE = 48;
+
+
+/**
+ * Open the virtual disk for block I/O. The descriptor stays open for the
+ * lifetime of the filesystem, pread/pwrite on it are safe to use from
+ * several threads at once.
+ * @return false if the real file cannot be opened
+ */
+static bool mini_fat_open_image(FAT_FILESYSTEM *fs) {
+    fs->image_fd = open(fs->filename, O_RDWR);
+    if (fs->image_fd == -1) {
+        perror("Cannot open virtual disk");
+        return false;
+    }
+    return true;
+}
+
+// The volume this thread has entered, and how often, so nested file
+// operations (e.g. a batch delete that saves) take the lock only once.
+static thread_local const FAT_FILESYSTEM * busy_held = NULL;
+static thread_local int busy_depth = 0;
+
+// Only volumes whose blocks can move or be snapshotted need the lock.
+static bool mini_fat_pausable(const FAT_FILESYSTEM *fs) {
+    return fs->tier != NULL || fs->memory != NULL;
+}
+
+void mini_fat_enter(const FAT_FILESYSTEM *fs) {
+    if (!mini_fat_pausable(fs)) return;
+    if (busy_held == fs) {
+        busy_depth++;
+        return;
+    }
+    fs->busy.lock_shared();
+    if (busy_held == NULL) {
+        busy_held = fs;
+        busy_depth = 1;
+    }
+}
+
+void mini_fat_leave(const FAT_FILESYSTEM *fs) {
+    if (!mini_fat_pausable(fs)) return;
+    if (busy_held == fs) {
+        if (--busy_depth > 0) return;
+        busy_held = NULL;
+    }
+    fs->busy.unlock_shared();
+}
+
+void mini_fat_pause(const FAT_FILESYSTEM *fs) {
+    if (!mini_fat_pausable(fs)) return;
+    assert(busy_held != fs);
+    fs->busy.lock();
+    //so the operations the pausing thread runs itself do not wait for it
+    if (busy_held == NULL) {
+        busy_held = fs;
+        busy_depth = 1;
+    }
+}
+
+void mini_fat_resume(const FAT_FILESYSTEM *fs) {
+    if (!mini_fat_pausable(fs)) return;
+    if (busy_held == fs) {
+        busy_held = NULL;
+        busy_depth = 0;
+    }
+    fs->busy.unlock();
+}
+
+/**
+ * Find a block on the host: blocks from fs->tier_boundary on are in the
+ * fast tier image, all others in the main image.
+ * @param  offset receives the byte offset of the block in its image
+ * @return        descriptor of the image
+ */
+int mini_fat_block_location(const FAT_FILESYSTEM *fs, const fat_block_t block_id, fat_off_t &offset) {
+    if (fs->tier_boundary > 0 && block_id >= fs->tier_boundary) {
+        offset = (block_id - fs->tier_boundary) * fs->block_size;
+        return fs->tier_fd;
+    }
+    offset = block_id * fs->block_size;
+    return fs->image_fd;
+}
 
 /**
  * Write inside one block in the filesystem.
@@ -19,25 +115,25 @@
  * @param  buffer       data buffer
  * @return              written byte count
  */
-int mini_fat_write_in_block(FAT_FILESYSTEM *fs, const int block_id, const int block_offset, const int size, const void * buffer) {
+int mini_fat_write_in_block(FAT_FILESYSTEM *fs, const fat_block_t block_id, const int block_offset, const int size, const void * buffer) {
 	assert(block_offset >= 0);
 	assert(block_offset < fs->block_size);
 	assert(size + block_offset <= fs->block_size);
 
-	int written = 0;
-    FILE* fat = fopen(fs->filename, "rb+");
-    if (fat == NULL){
-        fprintf(stderr, "An error occured during opening the file for write in block\n");
-        return -1;
-    }
-	// TODO: write in the real file.
     //writing starting point
-    int write_start= block_id * fs->block_size + block_offset;
-    //get our file pointer to starting point
-    fseek(fat, write_start, SEEK_SET);
-    //fwrite to write buffer of size-bytes to file
-    written = fwrite(buffer, 1, size, fat);
-    fclose(fat);
+    fat_off_t write_start;
+    int fd = mini_fat_block_location(fs, block_id, write_start);
+    write_start += block_offset;
+    if (fs->memory != NULL) {
+        return (int)mini_fat_memory_write(fs, write_start, size, buffer);
+    }
+    if (fs->direct != NULL) {
+        return (int)mini_fat_direct_write(fs, write_start, size, buffer);
+    }
+    int written = pwrite(fd, buffer, size, write_start);
+    if (written == -1) {
+        perror("An error occured during write in block");
+    }
 	return written;
 }
 
@@ -50,39 +146,107 @@ int mini_fat_write_in_block(FAT_FILESYSTEM *fs, const int block_id, const int bl
  * @param  buffer       buffer to write the read stuff to
  * @return              read byte count
  */
-int mini_fat_read_in_block(FAT_FILESYSTEM *fs, const int block_id, const int block_offset, const int size, void * buffer) {
+int mini_fat_read_in_block(FAT_FILESYSTEM *fs, const fat_block_t block_id, const int block_offset, const int size, void * buffer) {
 	assert(block_offset >= 0);
 	assert(block_offset < fs->block_size);
 	assert(size + block_offset <= fs->block_size);
-    
-	int read = 0;
-    //open file
-    FILE* fat = fopen(fs->filename, "rb");
-    if (fat == NULL){
-        fprintf(stderr, "An error occured during opening the file for read in block\n");
-        return -1;
-    }
-    // TODO: read from the real file.
+
     //reading starting point
-    int read_start= block_id * fs->block_size + block_offset;
-    //get our file pointer to starting point
-    fseek(fat, read_start, SEEK_SET);
-    //fread to read into buffer size-bytes
-    read = fread(buffer, 1, size, fat);
-    fclose(fat);
+    fat_off_t read_start;
+    int fd = mini_fat_block_location(fs, block_id, read_start);
+    read_start += block_offset;
+    if (fs->memory != NULL) {
+        return (int)mini_fat_memory_read(fs, read_start, size, buffer);
+    }
+    if (fs->direct != NULL) {
+        return (int)mini_fat_direct_read(fs, read_start, size, buffer);
+    }
+    int read = pread(fd, buffer, size, read_start);
+    if (read == -1) {
+        perror("An error occured during read in block");
+    }
 	return read;
 }
 
+/**
+ * Write a run of physically consecutive blocks with a single request.
+ * @param  block_id first block of the run
+ * @param  size     bytes to write from the start of block_id, may span blocks
+ * @return          written byte count
+ */
+fat_off_t mini_fat_write_in_blocks(FAT_FILESYSTEM *fs, const fat_block_t block_id, const fat_off_t size, const void * buffer) {
+	assert(block_id + (size - 1) / fs->block_size < fs->block_count);
+
+    //the tiers are separate images, so a run across the boundary takes two requests
+    if (block_id < fs->tier_boundary && block_id + (size - 1) / fs->block_size >= fs->tier_boundary) {
+        fat_off_t head = (fs->tier_boundary - block_id) * fs->block_size;
+        fat_off_t done = mini_fat_write_in_blocks(fs, block_id, head, buffer);
+        return done < head ? done : done + mini_fat_write_in_blocks(fs, fs->tier_boundary, size - head, (const char *)buffer + head);
+    }
+    if (fs->memory != NULL) {
+        return mini_fat_memory_write(fs, block_id * fs->block_size, size, buffer);
+    }
+    if (fs->direct != NULL) {
+        return mini_fat_direct_write(fs, block_id * fs->block_size, size, buffer);
+    }
+    fat_off_t start;
+    int fd = mini_fat_block_location(fs, block_id, start);
+    fat_off_t done = 0;
+    while (done < size) {
+        fat_off_t written = pwrite(fd, (const char *)buffer + done, size - done, start + done);
+        if (written <= 0) {
+            perror("An error occured during write in blocks");
+            break;
+        }
+        done += written;
+    }
+    return done;
+}
+
+/**
+ * Read a run of physically consecutive blocks with a single request.
+ * @param  block_id first block of the run
+ * @param  size     bytes to read from the start of block_id, may span blocks
+ * @return          read byte count
+ */
+fat_off_t mini_fat_read_in_blocks(FAT_FILESYSTEM *fs, const fat_block_t block_id, const fat_off_t size, void * buffer) {
+	assert(block_id + (size - 1) / fs->block_size < fs->block_count);
+
+    if (block_id < fs->tier_boundary && block_id + (size - 1) / fs->block_size >= fs->tier_boundary) {
+        fat_off_t head = (fs->tier_boundary - block_id) * fs->block_size;
+        fat_off_t done = mini_fat_read_in_blocks(fs, block_id, head, buffer);
+        return done < head ? done : done + mini_fat_read_in_blocks(fs, fs->tier_boundary, size - head, (char *)buffer + head);
+    }
+    if (fs->memory != NULL) {
+        return mini_fat_memory_read(fs, block_id * fs->block_size, size, buffer);
+    }
+    if (fs->direct != NULL) {
+        return mini_fat_direct_read(fs, block_id * fs->block_size, size, buffer);
+    }
+    fat_off_t start;
+    int fd = mini_fat_block_location(fs, block_id, start);
+    fat_off_t done = 0;
+    while (done < size) {
+        fat_off_t read = pread(fd, (char *)buffer + done, size - done, start + done);
+        if (read <= 0) {
+            if (read == -1) perror("An error occured during read in blocks");
+            break;
+        }
+        done += read;
+    }
+    return done;
+}
+
 
 /**
  * Find the first empty block in filesystem.
  * @return -1 on failure, index of block on success
  */
-int mini_fat_find_empty_block(const FAT_FILESYSTEM *fat) {
+fat_block_t mini_fat_find_empty_block(const FAT_FILESYSTEM *fat) {
 	// TODO: find an empty block in fat and return its index.
-    int block_count = fat->block_count;
+    fat_block_t block_count = fat->block_count;
     //for each block in block map check if type is EMPTY_BLOCK
-    for (int i = 0; i < block_count ; i++){
+    for (fat_block_t i = 0; i < block_count ; i++){
         if (fat->block_map[i] == EMPTY_BLOCK){
             return i;
         }
@@ -90,25 +254,287 @@ int mini_fat_find_empty_block(const FAT_FILESYSTEM *fat) {
 	return -1;
 }
 
+/**
+ * (Re)build the allocation groups and count their empty blocks. Needed
+ * once block_map is filled, and after block_map was edited directly.
+ */
+void mini_fat_build_groups(FAT_FILESYSTEM *fs) {
+    fs->group_blocks = std::min(FAT_GROUP_MAX_BLOCKS, std::max(FAT_GROUP_MIN_BLOCKS, fs->block_count / 64));
+    size_t count = (fs->block_count + fs->group_blocks - 1) / fs->group_blocks;
+    while (fs->groups.size() > count) {
+        delete fs->groups.back();
+        fs->groups.pop_back();
+    }
+    while (fs->groups.size() < count) {
+        fs->groups.push_back(new FAT_ALLOC_GROUP);
+    }
+    for (size_t g = 0; g < count; g++) {
+        FAT_ALLOC_GROUP * group = fs->groups[g];
+        group->begin = g * fs->group_blocks;
+        group->end = std::min(fs->block_count, group->begin + fs->group_blocks);
+        group->free_blocks = std::count(fs->block_map.begin() + group->begin, fs->block_map.begin() + group->end, EMPTY_BLOCK);
+    }
+}
+
+static FAT_ALLOC_GROUP * mini_fat_group_of(const FAT_FILESYSTEM *fs, const fat_block_t block_id) {
+    return fs->groups[block_id / fs->group_blocks];
+}
+
+/**
+ * Change the type of a block, keeping the free count of its group. Safe
+ * to call from several threads for different blocks.
+ */
+void mini_fat_set_block_type(FAT_FILESYSTEM *fs, const fat_block_t block_id, const unsigned char block_type) {
+    FAT_ALLOC_GROUP * group = mini_fat_group_of(fs, block_id);
+    std::lock_guard<std::mutex> guard(group->lock);
+    group->free_blocks += (block_type == EMPTY_BLOCK) - (fs->block_map[block_id] == EMPTY_BLOCK);
+    fs->block_map[block_id] = block_type;
+}
+
+/**
+ * Change the type of a block only if it still has type expected, checked
+ * under the lock of its group, so no allocator takes it in between.
+ * @return false if the block had another type and was left alone
+ */
+bool mini_fat_change_block_type(FAT_FILESYSTEM *fs, const fat_block_t block_id, const unsigned char expected, const unsigned char block_type) {
+    FAT_ALLOC_GROUP * group = mini_fat_group_of(fs, block_id);
+    std::lock_guard<std::mutex> guard(group->lock);
+    if (fs->block_map[block_id] != expected) {
+        return false;
+    }
+    group->free_blocks += (block_type == EMPTY_BLOCK) - (expected == EMPTY_BLOCK);
+    fs->block_map[block_id] = block_type;
+    return true;
+}
+
+// Take the first empty block of a group at or after goal, wrapping around
+// to the start of the group. Called with the group locked.
+static fat_block_t mini_fat_group_take(FAT_FILESYSTEM *fs, FAT_ALLOC_GROUP *group, fat_block_t goal, const unsigned char block_type) {
+    if (group->free_blocks <= 0) return -1;
+    if (goal < group->begin || goal >= group->end) goal = group->begin;
+    const unsigned char * map = fs->block_map.data();
+    const unsigned char * found = std::find(map + goal, map + group->end, EMPTY_BLOCK);
+    if (found == map + group->end) {
+        found = std::find(map + group->begin, map + goal, EMPTY_BLOCK);
+        if (found == map + goal) {
+            group->free_blocks = 0; // block_map was edited behind our back
+            return -1;
+        }
+    }
+    fat_block_t block_id = found - map;
+    fs->block_map[block_id] = block_type;
+    group->free_blocks--;
+    return block_id;
+}
+
+/**
+ * Allocate an empty block to a type, as close after goal as possible:
+ * first in the group of goal, and only when that group is full in the
+ * following groups. Only the groups visited are locked, so threads
+ * allocating in different groups run in parallel.
+ * @param  goal preferred block, e.g. the block before it in the file
+ * @return      -1 on failure, new block id on success
+ */
+fat_block_t mini_fat_allocate_block_near(FAT_FILESYSTEM *fs, const unsigned char block_type, const fat_block_t goal) {
+    mini_fat_trim_collect(fs);
+    size_t first = goal > 0 && goal < fs->block_count ? goal / fs->group_blocks : 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t k = 0; k < fs->groups.size(); k++) {
+            FAT_ALLOC_GROUP * group = fs->groups[(first + k) % fs->groups.size()];
+            std::lock_guard<std::mutex> guard(group->lock);
+            fat_block_t block_id = mini_fat_group_take(fs, group, k == 0 ? goal : group->begin, block_type);
+            if (block_id != -1) return block_id;
+        }
+        if (pass > 0 || !mini_fat_trim_reclaim(fs)) break;
+    }
+    fprintf(stderr, "Cannot allocate block: filesystem is full.\n");
+    return -1;
+}
+
+/**
+ * Allocate an aligned run of count empty blocks, as close after goal as
+ * possible. The first block gets block_type, the others RESERVED_BLOCK,
+ * so only the caller takes them (with mini_fat_set_block_type). Runs never
+ * cross allocation groups.
+ * @param  count run length, runs start at multiples of it
+ * @return       -1 if no group has a free run, first block id otherwise
+ */
+fat_block_t mini_fat_allocate_run(FAT_FILESYSTEM *fs, const unsigned char block_type, const fat_block_t count, const fat_block_t goal) {
+    mini_fat_trim_collect(fs);
+    size_t first = goal > 0 && goal < fs->block_count ? goal / fs->group_blocks : 0;
+    for (size_t k = 0; k < fs->groups.size(); k++) {
+        FAT_ALLOC_GROUP * group = fs->groups[(first + k) % fs->groups.size()];
+        std::lock_guard<std::mutex> guard(group->lock);
+        fat_block_t begin = (group->begin + count - 1) / count * count;
+        fat_block_t runs = (group->end - begin) / count;
+        if (group->free_blocks < count || runs <= 0) continue;
+        fat_block_t start = k == 0 && goal > begin ? (goal - begin + count - 1) / count : 0;
+        for (fat_block_t r = 0; r < runs; r++) {
+            fat_block_t run = begin + (start + r) % runs * count;
+            unsigned char * map = fs->block_map.data() + run;
+            if (std::find_if(map, map + count, [](unsigned char type) { return type != EMPTY_BLOCK; }) != map + count) continue;
+            map[0] = block_type;
+            std::fill(map + 1, map + count, RESERVED_BLOCK);
+            group->free_blocks -= count;
+            return run;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Goal for the entry block of a new file: the start of the next group in
+ * round robin order. The data blocks of the file follow its entry block,
+ * so files created for different writers grow in different groups.
+ */
+fat_block_t mini_fat_next_group_goal(FAT_FILESYSTEM *fs) {
+    return (fs->next_group++ % fs->groups.size()) * fs->group_blocks;
+}
+
 /**
  * Find the first empty block in filesystem, and allocate it to a type,
  * i.e., set block_map[new_block_index] to the specified type.
  * @return -1 on failure, new_block_index on success
  */
-int mini_fat_allocate_new_block(FAT_FILESYSTEM *fs, const unsigned char block_type) {
-	int new_block_index = mini_fat_find_empty_block(fs);
-	if (new_block_index == -1)
-	{
-		fprintf(stderr, "Cannot allocate block: filesystem is full.\n");
-		return -1;
-	}
-	fs->block_map[new_block_index] = block_type;
-	return new_block_index;
+fat_block_t mini_fat_allocate_new_block(FAT_FILESYSTEM *fs, const unsigned char block_type) {
+	return mini_fat_allocate_block_near(fs, block_type, 0);
+}
+
+/**
+ * Allocate up to count empty blocks to a type in a single pass over the
+ * block map, from the start of the group of goal on, wrapping around.
+ * @param  goal   e.g. mini_fat_next_group_goal, like a single new file
+ * @param  blocks receives the ids of the allocated blocks
+ * @return        number of blocks allocated, less than count if full
+ */
+fat_block_t mini_fat_allocate_blocks(FAT_FILESYSTEM *fs, const unsigned char block_type, const fat_block_t count, const fat_block_t goal,
+                                     std::vector<fat_block_t> &blocks) {
+    mini_fat_trim_collect(fs);
+    fat_block_t allocated = 0;
+    size_t first = goal > 0 && goal < fs->block_count ? goal / fs->group_blocks : 0;
+    for (size_t k = 0; k < fs->groups.size() && allocated < count; k++) {
+        FAT_ALLOC_GROUP * group = fs->groups[(first + k) % fs->groups.size()];
+        std::lock_guard<std::mutex> guard(group->lock);
+        for (fat_block_t i = group->begin; i < group->end && group->free_blocks > 0 && allocated < count; i++) {
+            if (fs->block_map[i] == EMPTY_BLOCK) {
+                fs->block_map[i] = block_type;
+                group->free_blocks--;
+                blocks.push_back(i);
+                allocated++;
+            }
+        }
+    }
+    return allocated;
+}
+
+/**
+ * Mark a block as empty again, or hand it to the trimmer if it runs.
+ * A deduplicated block is only freed with its last reference.
+ * If the block is pinned by a read view, it stays allocated until the last
+ * view holding it is released, so the view keeps seeing the old contents.
+ */
+void mini_fat_free_block(FAT_FILESYSTEM *fs, const fat_block_t block_id) {
+    if (mini_fat_dedup_release(fs, block_id)) {
+        return;
+    }
+    if (fs->pinned_blocks.load(std::memory_order_acquire) > 0) {
+        std::lock_guard<std::mutex> guard(fs->pin_lock);
+        if (fs->block_pins.count(block_id) > 0) {
+            fs->deferred_free.insert(block_id);
+            return;
+        }
+    }
+    if (!mini_fat_trim_queue(fs, block_id)) {
+        mini_fat_set_block_type(fs, block_id, EMPTY_BLOCK);
+    }
+}
+
+/**
+ * Map the virtual disk read-only into memory. The mapping shares pages with
+ * the host page cache, so data written through the block helpers is visible
+ * in it without any copy. Maps once and reuses the mapping afterwards.
+ * The fast tier image of a tiered volume is mapped right after the blocks
+ * of the main image, so block ids still index the mapping.
+ * @return start of block 0 in memory, NULL on failure
+ */
+const unsigned char * mini_fat_map_image(FAT_FILESYSTEM *fs) {
+    if (fs->image_map != NULL) {
+        return fs->image_map;
+    }
+    fat_off_t image_size = fs->block_count * fs->block_size;
+    fat_off_t main_size = (fs->tier != NULL ? fs->tier_boundary : fs->block_count) * fs->block_size;
+    int fd = open(fs->filename, O_RDWR);
+    if (fd == -1) {
+        perror("Cannot open virtual disk for mapping");
+        return NULL;
+    }
+    //touching pages past the end of the real file raises SIGBUS, so grow it first
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size < main_size && ftruncate(fd, main_size) != 0) {
+        perror("Cannot extend virtual disk for mapping");
+        close(fd);
+        return NULL;
+    }
+    void * map = mmap(NULL, image_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED && fs->tier != NULL
+            && mmap((char *)map + main_size, image_size - main_size, PROT_READ, MAP_SHARED | MAP_FIXED, fs->tier_fd, 0) == MAP_FAILED) {
+        munmap(map, image_size);
+        map = MAP_FAILED;
+    }
+    //the mapping stays valid after the descriptor is closed
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Cannot map virtual disk");
+        return NULL;
+    }
+    fs->image_map = (const unsigned char *)map;
+    fs->image_map_size = image_size;
+    return fs->image_map;
+}
+
+/**
+ * Pin a block so it is neither reused nor overwritten in place.
+ */
+void mini_fat_pin_block(FAT_FILESYSTEM *fs, const fat_block_t block_id) {
+    std::lock_guard<std::mutex> guard(fs->pin_lock);
+    if (fs->block_pins[block_id]++ == 0) {
+        fs->pinned_blocks++;
+    }
+}
+
+/**
+ * Drop one pin of a block. Frees the block if it was freed while pinned.
+ */
+void mini_fat_unpin_block(FAT_FILESYSTEM *fs, const fat_block_t block_id) {
+    {
+        std::lock_guard<std::mutex> guard(fs->pin_lock);
+        std::map<fat_block_t, int>::iterator it = fs->block_pins.find(block_id);
+        assert(it != fs->block_pins.end());
+        if (--it->second > 0) {
+            return;
+        }
+        fs->block_pins.erase(it);
+        fs->pinned_blocks--;
+        if (fs->deferred_free.erase(block_id) == 0) {
+            return;
+        }
+    }
+    //no file points at the block any more, so nobody pins it again meanwhile
+    mini_fat_free_block(fs, block_id);
+}
+
+bool mini_fat_block_is_pinned(const FAT_FILESYSTEM *fs, const fat_block_t block_id) {
+    //no read view out: the common case of writers, without the lock
+    if (fs->pinned_blocks.load(std::memory_order_acquire) == 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(fs->pin_lock);
+    return fs->block_pins.count(block_id) > 0;
 }
 
 void mini_fat_dump(const FAT_FILESYSTEM *fat) {
-	printf("Dumping fat with %d blocks of size %d:\n", fat->block_count, fat->block_size);
-	for (int i=0; i<fat->block_count;++i) {
+	printf("Dumping fat with %lld blocks of size %d:\n", (long long)fat->block_count, fat->block_size);
+	for (fat_block_t i=0; i<fat->block_count;++i) {
 		printf("%d ", (int)fat->block_map[i]);
 	}
 	printf("\n");
@@ -118,13 +544,15 @@ void mini_fat_dump(const FAT_FILESYSTEM *fat) {
 	}
 }
 
-static FAT_FILESYSTEM * mini_fat_create_internal(const char * filename, const int block_size, const int block_count) {
+static FAT_FILESYSTEM * mini_fat_create_internal(const char * filename, const int block_size, const fat_block_t block_count) {
 	FAT_FILESYSTEM * fat = new FAT_FILESYSTEM;
 	fat->filename = filename;
 	fat->block_size = block_size;
 	fat->block_count = block_count;
+	mini_file_select_kernels(fat);
 	fat->block_map.resize(fat->block_count, EMPTY_BLOCK); // Set all blocks to empty.
 	fat->block_map[0] = METADATA_BLOCK;
+	mini_fat_build_groups(fat);
 	return fat;
 }
 
@@ -132,128 +560,430 @@ static FAT_FILESYSTEM * mini_fat_create_internal(const char * filename, const in
  * Create a new virtual disk file.
  * The file should be of the exact size block_size * block_count bytes.
  * Overwrites existing files. Resizes block_map to block_count size.
+ * Names starting with FAT_MEMORY_PREFIX create a memory volume instead.
  * @param  filename    name of the file on real disk
  * @param  block_size  size of each block
  * @param  block_count number of blocks
  * @return             FAT_FILESYSTEM pointer with parameters set.
  */
-FAT_FILESYSTEM * mini_fat_create(const char * filename, const int block_size, const int block_count) {
+FAT_FILESYSTEM * mini_fat_create(const char * filename, const int block_size, const fat_block_t block_count) {
+    if (block_size < FAT_SUPERBLOCK_SIZE || block_count < 1) {
+        fprintf(stderr, "Block size must be at least %d bytes.\n", FAT_SUPERBLOCK_SIZE);
+        return NULL;
+    }
 
 	FAT_FILESYSTEM * fat = mini_fat_create_internal(filename, block_size, block_count);
+	if (mini_fat_is_memory_name(filename)) {
+		if (!mini_fat_memory_attach(fat)) {
+			mini_fat_destroy(fat);
+			return NULL;
+		}
+		return fat;
+	}
 	// TODO: create the corresponding virtual disk file with appropriate size.
-    //create a binary file (open with wb)
-    FILE * virtual_disk_file = fopen(filename,"wb");
+    //create (or truncate) the real file
+    fat->image_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
     //if some error occured raise error
-    if (virtual_disk_file == NULL){
-        fprintf(stderr, "An error occured during creating virtual disk file\n");
-    }
-    /*if (ftruncate(fileno(virtual_disk_file), block_size*block_count) != 0){
-        fprintf(stderr, "An error occured during setting file size\n");
-    }*/
-    //use fseek here too
-    //set the file size
-    fseek(virtual_disk_file, block_size*block_count, SEEK_SET);
-    fclose(virtual_disk_file);
+    if (fat->image_fd == -1){
+        perror("An error occured during creating virtual disk file");
+        mini_fat_destroy(fat);
+        return NULL;
+    }
+    //set the file size; ftruncate only records the size, so the file stays
+    //sparse and takes no space on the host until blocks are written
+    if (ftruncate(fat->image_fd, block_count * block_size) != 0){
+        perror("An error occured during setting file size");
+        mini_fat_destroy(fat);
+        return NULL;
+    }
 	return fat;
 }
 
+/**
+ * Stop the background threads of a filesystem and free it with its files,
+ * open handles and descriptors. Nothing is saved.
+ */
+void mini_fat_destroy(FAT_FILESYSTEM *fs) {
+    if (fs == NULL) {
+        return;
+    }
+    mini_fat_trace_stop(fs);
+    mini_fat_trim_stop(fs);
+    mini_fat_tier_close(fs);
+    mini_fat_share_unmount(fs);
+    mini_fat_direct_disable(fs);
+    mini_fat_memory_detach(fs);
+    mini_fat_dedup_free(fs);
+    if (fs->image_map != NULL) {
+        munmap((void *)fs->image_map, fs->image_map_size);
+    }
+    if (fs->image_fd != -1) {
+        close(fs->image_fd);
+    }
+    for (size_t i = 0; i < fs->files.size(); i++) {
+        FAT_FILE * file = fs->files[i];
+        for (size_t j = 0; j < file->open_handles.size(); j++) {
+            delete file->open_handles[j];
+        }
+        mini_file_free(file);
+    }
+    for (size_t i = 0; i < fs->groups.size(); i++) {
+        delete fs->groups[i];
+    }
+    delete fs;
+}
+
+// Append the raw bytes of value to a metadata buffer.
+template<typename T>
+static void put(std::vector<unsigned char> &buffer, const T value) {
+    const unsigned char * bytes = (const unsigned char *)&value;
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+}
+
+// Take the next value out of a metadata buffer; zero once past its end.
+template<typename T>
+static T get(const std::vector<unsigned char> &buffer, size_t &pos) {
+    T value = 0;
+    if (pos + sizeof(T) <= buffer.size()) {
+        memcpy(&value, &buffer[pos], sizeof(T));
+    }
+    pos += sizeof(T);
+    return value;
+}
+
+static bool write_all(const int fd, const std::vector<unsigned char> &buffer, const fat_off_t offset) {
+    size_t done = 0;
+    while (done < buffer.size()) {
+        ssize_t written = pwrite(fd, buffer.data() + done, buffer.size() - done, offset + done);
+        if (written <= 0) return false;
+        done += written;
+    }
+    return true;
+}
+
+static bool read_all(const int fd, std::vector<unsigned char> &buffer, const fat_off_t offset) {
+    size_t done = 0;
+    while (done < buffer.size()) {
+        ssize_t read = pread(fd, buffer.data() + done, buffer.size() - done, offset + done);
+        if (read <= 0) return false;
+        done += read;
+    }
+    return true;
+}
+
+/**
+ * Build the superblock and file table of fat, in the format described at
+ * mini_fat_save.
+ * @return byte offset of the table in the image
+ */
+fat_off_t mini_fat_serialize(const FAT_FILESYSTEM *fat, std::vector<unsigned char> &super, std::vector<unsigned char> &table) {
+    mini_fat_enter(fat);
+    table.assign(fat->block_map.begin(), fat->block_map.end());
+    //blocks still waiting for the trimmer are free for whoever loads the image
+    std::replace(table.begin(), table.end(), TRIM_PENDING_BLOCK, EMPTY_BLOCK);
+    std::replace(table.begin(), table.end(), RESERVED_BLOCK, EMPTY_BLOCK);
+    put<uint64_t>(table, fat->files.size());
+    //each file save name,size,metadatablocid, number of blocks allocated and block id of them
+    for (size_t i = 0; i < fat->files.size(); i++) {
+        const FAT_FILE * file = fat->files[i];
+        table.insert(table.end(), file->name, file->name + MAX_FILENAME_LENGTH);
+        put<int64_t>(table, file->size);
+        put<int64_t>(table, file->metadata_block_id);
+        put<uint64_t>(table, file->block_ids.size());
+        for (size_t j = 0; j < file->block_ids.size(); j++) {
+            put<int64_t>(table, file->block_ids[j]);
+        }
+    }
+    if (fat->dedup != NULL) {
+        std::vector<FAT_DEDUP_ENTRY> entries;
+        mini_fat_dedup_entries(fat, entries);
+        put<uint64_t>(table, entries.size());
+        for (size_t i = 0; i < entries.size(); i++) {
+            put<int64_t>(table, entries[i].block_id);
+            put<uint32_t>(table, entries[i].refs);
+            put<uint64_t>(table, entries[i].hash.low);
+            put<uint64_t>(table, entries[i].hash.high);
+        }
+    }
+    const char * tier_filename = mini_fat_tier_filename(fat);
+    if (tier_filename != NULL) {
+        put<int64_t>(table, fat->tier_boundary);
+        put<uint32_t>(table, strlen(tier_filename));
+        table.insert(table.end(), tier_filename, tier_filename + strlen(tier_filename));
+    }
+    mini_fat_leave(fat);
+
+    fat_off_t table_offset = (tier_filename != NULL ? fat->tier_boundary : fat->block_count) * fat->block_size;
+    super.assign(FAT_MAGIC, FAT_MAGIC + sizeof(FAT_MAGIC));
+    put<uint32_t>(super, FAT_FORMAT_VERSION);
+    put<uint32_t>(super, (fat->dedup != NULL ? FAT_FLAG_DEDUP : 0) | (tier_filename != NULL ? FAT_FLAG_TIERED : 0));
+    put<uint32_t>(super, fat->block_size);
+    put<uint32_t>(super, 0);
+    put<int64_t>(super, fat->block_count);
+    put<int64_t>(super, table_offset);
+    put<int64_t>(super, table.size());
+    return table_offset;
+}
+
 /**
  * Save a virtual disk (filesystem) to file on real disk.
- * Stores filesystem metadata (e.g., block_size, block_count, block_map, etc.)
- * in block 0.
- * Stores file metadata (name, size, block map) in their corresponding blocks.
+ * Block 0 holds the superblock:
+ *   magic[8], u32 version, u32 flags, u32 block_size, u32 unused,
+ *   i64 block_count, i64 table_offset, i64 table_size
+ * The block map and file table grow with the volume, so they go after the
+ * last block of the main image (table_offset = block_count * block_size,
+ * or tier_boundary * block_size with a fast tier):
+ *   u8 block_map[block_count], u64 file_count, and for each file
+ *   name[MAX_FILENAME_LENGTH], i64 size, i64 metadata_block_id,
+ *   u64 block_count, i64 block_ids[block_count]
+ * With dedup (flag FAT_FLAG_DEDUP) the hash index follows:
+ *   u64 entry_count, and for each entry
+ *   i64 block_id, u32 refs, u64 hash_low, u64 hash_high
+ * With a fast tier (flag FAT_FLAG_TIERED) its image follows:
+ *   i64 tier_boundary, u32 name_length, name[name_length]
  * Does not store file data (they are written directly via write API).
+ * A memory volume has no image to save to, its table stays in memory;
+ * see mini_fat_memory_snapshot.
  * @param  fat virtual disk filesystem
  * @return     true on success
  */
 bool mini_fat_save(const FAT_FILESYSTEM *fat) {
-	FILE * fat_fd = fopen(fat->filename, "r+");
-	if (fat_fd == NULL) {
-		perror("Cannot save fat to file");
-		return false;
-	}
-	// TODO: save all metadata (filesystem metadata, file metadata).
-    //first save block size, block count and block map:
-    fseek(fat_fd, 0, SEEK_SET);
-    fwrite(&(fat->block_size), sizeof(fat->block_size), 1, fat_fd);
-    fwrite(&(fat->block_count), sizeof(fat->block_count), 1, fat_fd);
-    fwrite(&(fat->block_map), sizeof(fat->block_map[0]), fat->block_count, fat_fd);
-    int block_count = fat->block_count;
-    for (int i = 0; i < block_count ; i++){
-        //find blocks with metadata
-        //if (fat->block_map[i] == FILE_DATA_BLOCK){
-            fwrite(&(fat->block_map[i]), sizeof(fat->block_map[i]), 1, fat_fd);
-        //}
-    }
-
-    size_t size = fat->files.size();
-    //save file size
-    fwrite(&size, sizeof(size_t), 1, fat_fd);
-    //each file save name,size,metadatablocid, number of blocks allocated and block id of them
-    for(int i = 0; i < fat->files.size(); i++) {
-        fwrite(&(fat->files[i]->name), MAX_FILENAME_LENGTH, 1, fat_fd);
-        fwrite(&(fat->files[i]->size), sizeof(int), 1, fat_fd);
-        fwrite(&(fat->files[i]->metadata_block_id), sizeof(int), 1, fat_fd);
-        size_t num_blocks = fat->files[i]->block_ids.size();
-        fwrite(&(num_blocks), sizeof(size_t), 1, fat_fd);
-        for(int j = 0; j < num_blocks; j++) {
-            fwrite(&(fat->files[i]->block_ids[j]), sizeof(int), 1, fat_fd);
-        }
+    if (fat->memory != NULL) {
+        return true;
+    }
+    std::vector<unsigned char> super, table;
+    fat_off_t table_offset = mini_fat_serialize(fat, super, table);
+
+    //table first, so the superblock never points at a partly written one;
+    //other mounts of a shared image reload it once the save is done
+    if (fat->share != NULL) {
+        mini_fat_share_lock(fat);
     }
-    
-    fclose(fat_fd);
-	return true;
+    bool saved = write_all(fat->image_fd, table, table_offset) && write_all(fat->image_fd, super, 0);
+    if (!saved) {
+        perror("Cannot save fat to file");
+    }
+    if (fat->share != NULL) {
+        mini_fat_share_unlock(fat, saved);
+    }
+	return saved;
 }
 
-FAT_FILESYSTEM * mini_fat_load(const char *filename) {
-	FILE * fat_fd = fopen(filename, "r+");
-	if (fat_fd == NULL) {
-		perror("Cannot load fat from file");
-		exit(-1);
-	}
-	// TODO: load all metadata (filesystem metadata, file metadata) and create filesystem.
+// Sections after the file table, see mini_fat_save.
+typedef struct t_FAT_TABLE_EXTRAS {
+    std::vector<FAT_DEDUP_ENTRY> dedup_entries;
+    fat_block_t tier_boundary = 0;
+    std::string tier_filename;
+} FAT_TABLE_EXTRAS;
 
-	//int block_size = 1024, block_count = 10;
-	//FAT_FILESYSTEM * fat = mini_fat_create_internal(filename, block_size, block_count);
-    //create new filesystem
-    FAT_FILESYSTEM * fat = new FAT_FILESYSTEM;
-    //set filename to given parameter
-    fat->filename = filename;
-    fseek(fat_fd, 0, SEEK_SET);
-    //read initial metadata block information
-    fread(&(fat->block_size), sizeof(fat->block_size), 1, fat_fd);
-    fread(&(fat->block_count), sizeof(fat->block_count), 1, fat_fd);
-    fread(&(fat->block_map), sizeof(unsigned char), fat->block_count, fat_fd);
-    //iterate over all blocs and read them
-    for(int i = 0; i < fat->block_count; i++) {
-        //if(fat->block_map[i] == FILE_DATA_BLOCK) {
-            fread(&(fat->block_map[i]), sizeof(fat->block_map[i]), 1, fat_fd);
-        //}
-    }
-
-    size_t size;
-    //then read size
-    fread(&size, sizeof(size_t), 1, fat_fd);
-    printf("Number of files: %d\n", size);
+/**
+ * Parse the file table that follows the block map. The hash index and fast
+ * tier go to extras, fat->dedup and fat->tier are left alone.
+ * Version 1 images used 32-bit sizes and block ids (and size_t counts).
+ */
+static void mini_fat_load_files(FAT_FILESYSTEM *fat, const std::vector<unsigned char> &table, const uint32_t version, const uint32_t flags,
+                                FAT_TABLE_EXTRAS &extras) {
+    size_t pos = fat->block_count;
+    fat->block_map.assign(table.begin(), table.begin() + std::min((size_t)fat->block_count, table.size()));
+    fat->block_map.resize(fat->block_count, EMPTY_BLOCK);
+    uint64_t size = get<uint64_t>(table, pos);
     //create fat_files using saved information
-    for(int i = 0; i < size; i++) {
+    for (uint64_t i = 0; i < size && pos < table.size(); i++) {
         FAT_FILE* f_file = new FAT_FILE;
-        fread(&(f_file->name), MAX_FILENAME_LENGTH, 1, fat_fd);
-        fread(&(f_file->size), sizeof(int), 1, fat_fd);
-        fread(&(f_file->metadata_block_id), sizeof(int), 1, fat_fd);
-        size_t num_blocks;
-        fread(&(num_blocks), sizeof(size_t), 1, fat_fd);
-        for(int j = 0; j < num_blocks; j++) {
-            int block_num;
-            fread(&(block_num), sizeof(int), 1, fat_fd);
-            f_file->block_ids.push_back(block_num);
+        memcpy(f_file->name, &table[std::min(pos, table.size())], std::min((size_t)MAX_FILENAME_LENGTH, table.size() - pos));
+        f_file->name[MAX_FILENAME_LENGTH - 1] = 0;
+        pos += MAX_FILENAME_LENGTH;
+        if (version == 1) {
+            f_file->size = get<int32_t>(table, pos);
+            f_file->metadata_block_id = get<int32_t>(table, pos);
+        } else {
+            f_file->size = get<int64_t>(table, pos);
+            f_file->metadata_block_id = get<int64_t>(table, pos);
+        }
+        uint64_t num_blocks = get<uint64_t>(table, pos);
+        f_file->block_ids.reserve(std::min(num_blocks, (uint64_t)fat->block_count));
+        for (uint64_t j = 0; j < num_blocks && pos < table.size(); j++) {
+            f_file->block_ids.push_back(version == 1 ? get<int32_t>(table, pos) : get<int64_t>(table, pos));
         }
-        //printf("Pushing file %d\n", i);
         fat->files.push_back(f_file);
+        fat->file_index[f_file->name] = f_file;
+    }
+    if (flags & FAT_FLAG_DEDUP) {
+        std::vector<FAT_DEDUP_ENTRY> &entries = extras.dedup_entries;
+        entries.resize(std::min(get<uint64_t>(table, pos), (uint64_t)fat->block_count));
+        for (size_t i = 0; i < entries.size() && pos < table.size(); i++) {
+            entries[i].block_id = get<int64_t>(table, pos);
+            entries[i].refs = get<uint32_t>(table, pos);
+            entries[i].hash.low = get<uint64_t>(table, pos);
+            entries[i].hash.high = get<uint64_t>(table, pos);
+        }
+    }
+    if (flags & FAT_FLAG_TIERED) {
+        extras.tier_boundary = get<int64_t>(table, pos);
+        uint32_t length = get<uint32_t>(table, pos);
+        if (pos + length <= table.size()) {
+            extras.tier_filename.assign((const char *)&table[pos], length);
+        }
+        pos += length;
     }
+}
 
-    //mini_fat_dump(fat);
+/**
+ * Read the superblock and file table of fat->image_fd into fat.
+ * @param  flags   receives the superblock flags
+ * @param  extras  receives the hash index and fast tier, if the image has them
+ * @return         false if the image is not a readable virtual disk
+ */
+static bool mini_fat_read_table(FAT_FILESYSTEM *fat, uint32_t &flags, FAT_TABLE_EXTRAS &extras) {
+    const char * filename = fat->filename;
+    std::vector<unsigned char> super(FAT_SUPERBLOCK_SIZE);
+    if (!read_all(fat->image_fd, super, 0)) {
+        fprintf(stderr, "Cannot load fat from file: '%s' is too short.\n", filename);
+        return false;
+    }
+    size_t pos = 0;
+    uint32_t version = 1;
+    flags = 0;
+    fat_off_t table_offset, table_size;
+    if (memcmp(super.data(), FAT_MAGIC, sizeof(FAT_MAGIC)) == 0) {
+        pos = sizeof(FAT_MAGIC);
+        version = get<uint32_t>(super, pos);
+        flags = get<uint32_t>(super, pos);
+        if (version != FAT_FORMAT_VERSION || (flags & ~(FAT_FLAG_DEDUP | FAT_FLAG_TIERED)) != 0) {
+            fprintf(stderr, "Cannot load fat from file: unsupported format version %u (flags %x).\n", version, flags);
+            return false;
+        }
+        fat->block_size = get<uint32_t>(super, pos);
+        get<uint32_t>(super, pos);
+        fat->block_count = get<int64_t>(super, pos);
+        table_offset = get<int64_t>(super, pos);
+        table_size = get<int64_t>(super, pos);
+    } else {
+        //version 1: int block_size and int block_count, table up to the end of the file
+        fat->block_size = get<int32_t>(super, pos);
+        fat->block_count = get<int32_t>(super, pos);
+        struct stat st;
+        fstat(fat->image_fd, &st);
+        table_offset = fat->block_count * fat->block_size;
+        table_size = std::max((fat_off_t)0, (fat_off_t)st.st_size - table_offset);
+    }
+    if (fat->block_size < FAT_SUPERBLOCK_SIZE || fat->block_count < 1) {
+        fprintf(stderr, "Cannot load fat from file: '%s' is not a virtual disk.\n", filename);
+        return false;
+    }
+    //the sizes come from the image, so check them against the file before allocating
+    struct stat st;
+    if (fstat(fat->image_fd, &st) != 0 || table_offset < 0 || table_size < 0 || table_offset > st.st_size
+            || table_size > st.st_size - table_offset || fat->block_count > table_size
+            || (!(flags & FAT_FLAG_TIERED) && fat->block_count > table_offset / fat->block_size)) {
+        fprintf(stderr, "Cannot load fat from file: superblock of '%s' does not match the file.\n", filename);
+        return false;
+    }
+
+    std::vector<unsigned char> table(table_size);
+    if (!read_all(fat->image_fd, table, table_offset)) {
+        fprintf(stderr, "Cannot load fat from file: file table of '%s' is truncated.\n", filename);
+        return false;
+    }
+    mini_fat_load_files(fat, table, version, flags, extras);
+    return true;
+}
 
-    fclose(fat_fd);
+/**
+ * Load a virtual disk. With a name starting with FAT_MEMORY_PREFIX, the
+ * image after the prefix is read into a memory volume and closed again.
+ */
+FAT_FILESYSTEM * mini_fat_load(const char *filename) {
+    //create new filesystem
+    FAT_FILESYSTEM * fat = new FAT_FILESYSTEM;
+    const bool in_memory = mini_fat_is_memory_name(filename);
+    //set filename to given parameter
+    fat->filename = in_memory ? filename + strlen(FAT_MEMORY_PREFIX) : filename;
+    if (!mini_fat_open_image(fat)) {
+        exit(-1);
+    }
+    uint32_t flags;
+    FAT_TABLE_EXTRAS extras;
+    if (!mini_fat_read_table(fat, flags, extras)) {
+        exit(-1);
+    }
+    if (in_memory) {
+        if (flags & FAT_FLAG_TIERED) {
+            fprintf(stderr, "Cannot load a tiered volume into memory.\n");
+            exit(-1);
+        }
+        if (!mini_fat_memory_attach(fat) || !mini_fat_memory_fill(fat, fat->image_fd)) {
+            exit(-1);
+        }
+        close(fat->image_fd);
+        fat->image_fd = -1;
+        fat->filename = filename;
+    }
+    if ((flags & FAT_FLAG_TIERED) && !mini_fat_tier_open(fat, extras.tier_filename.c_str(), extras.tier_boundary)) {
+        exit(-1);
+    }
+    mini_file_select_kernels(fat);
+    mini_fat_build_groups(fat);
+    if (flags & FAT_FLAG_DEDUP) {
+        mini_fat_dedup_restore(fat, extras.dedup_entries);
+    }
 	return fat;
 }
+
+/**
+ * Read the block map and file table of the image again, e.g. after another
+ * mount saved it. Files are matched by entry block and updated in place, so
+ * open handles stay valid, also across renames. Files deleted meanwhile
+ * leave the namespace; their structures live on while they are open.
+ * @return false if the image cannot be read or has another geometry
+ */
+bool mini_fat_reload(FAT_FILESYSTEM *fs) {
+    FAT_FILESYSTEM * disk = new FAT_FILESYSTEM;
+    disk->filename = fs->filename;
+    disk->image_fd = fs->image_fd;
+    uint32_t flags;
+    FAT_TABLE_EXTRAS extras;
+    bool ok = mini_fat_read_table(disk, flags, extras) && disk->block_size == fs->block_size && disk->block_count == fs->block_count;
+    if (ok) {
+        std::unordered_map<fat_block_t, FAT_FILE*> known;
+        for (size_t i = 0; i < fs->files.size(); i++) {
+            known[fs->files[i]->metadata_block_id] = fs->files[i];
+        }
+        fs->file_index.clear();
+        for (size_t i = 0; i < disk->files.size(); i++) {
+            FAT_FILE * loaded = disk->files[i];
+            std::unordered_map<fat_block_t, FAT_FILE*>::iterator it = known.find(loaded->metadata_block_id);
+            if (it != known.end()) {
+                FAT_FILE * file = it->second;
+                strcpy(file->name, loaded->name);
+                file->size = loaded->size;
+                file->block_ids.swap(loaded->block_ids);
+                file->block_changes++;
+                known.erase(it);
+                delete loaded;
+                disk->files[i] = file;
+            }
+            fs->file_index[disk->files[i]->name] = disk->files[i];
+        }
+        //deleted by another mount; files still open here are freed at their last close
+        for (std::unordered_map<fat_block_t, FAT_FILE*>::iterator it = known.begin(); it != known.end(); ++it) {
+            if (it->second->open_handles.empty()) {
+                mini_file_free(it->second);
+            } else {
+                it->second->deleted = true;
+            }
+        }
+        fs->files.swap(disk->files);
+        fs->block_map.swap(disk->block_map);
+        mini_fat_build_groups(fs);
+        if (flags & FAT_FLAG_DEDUP) {
+            mini_fat_dedup_restore(fs, extras.dedup_entries);
+        }
+    } else {
+        for (size_t i = 0; i < disk->files.size(); i++) {
+            delete disk->files[i];
+        }
+    }
+    delete disk;
+    return ok;
+}
@@ -0,0 +1,499 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fat.h"
+#include "fat_file.h"
+#include "fat_bulk.h"
+#include "fat_direct.h"
+#include "fat_share.h"
+#include "fat_trim.h"
+
+// Bytes moved per pipeline step, rounded down to whole blocks.
+const fat_off_t BULK_CHUNK_SIZE = 1 << 20;
+
+// Blocking FIFO between two pipeline stages.
+// pop returns false once the queue is closed and drained.
+template<typename T>
+class bulk_queue {
+public:
+    void push(const T &item) {
+        std::lock_guard<std::mutex> guard(lock);
+        items.push_back(item);
+        ready.notify_one();
+    }
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> guard(lock);
+        ready.wait(guard, [this] { return !items.empty() || closed; });
+        if (items.empty()) return false;
+        item = items.front();
+        items.pop_front();
+        return true;
+    }
+    void close() {
+        std::lock_guard<std::mutex> guard(lock);
+        closed = true;
+        ready.notify_all();
+    }
+private:
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<T> items;
+    bool closed = false;
+};
+
+typedef struct t_BULK_TASK {
+    std::string host_path;
+    std::string image_name;
+    int host_fd; // Opened by begin, closed by end once its last chunk is done.
+    FAT_FILE * file;
+    fat_off_t size;
+} BULK_TASK;
+
+typedef struct t_BULK_CHUNK {
+    int task;
+    fat_off_t offset;
+    fat_off_t size;
+    char * data;
+} BULK_CHUNK;
+
+typedef struct t_BULK_PIPELINE BULK_PIPELINE;
+typedef bool (*bulk_step)(BULK_PIPELINE *p, BULK_TASK &task, const fat_off_t offset, const fat_off_t size, char *data);
+
+struct t_BULK_PIPELINE {
+    FAT_FILESYSTEM * fs;
+    std::vector<BULK_TASK> tasks;
+    std::vector<std::atomic<char> > failed;
+    // Chunks of a task not yet written, plus one while its reader is still at it.
+    std::vector<std::atomic<int> > pending;
+    fat_off_t chunk_size;
+
+    bulk_step begin; // Called by a reader before the first chunk of a task.
+    bulk_step read; // Fills a chunk from the source.
+    bulk_step write; // Drains a chunk to the destination.
+    bulk_step end; // Called once the last chunk of a task is done.
+
+    std::atomic<int> next_task{0};
+    // Tasks below ready_tasks have their metadata in place and may be copied.
+    int ready_tasks = 0;
+    std::mutex ready_lock;
+    std::condition_variable ready_cond;
+
+    bulk_queue<char *> free_buffers;
+    bulk_queue<BULK_CHUNK> chunks;
+    std::atomic<fat_off_t> bytes{0};
+};
+
+/**
+ * Copy size bytes between a file of the virtual disk at a block aligned
+ * offset and memory, with one request per physically contiguous run.
+ */
+static bool bulk_transfer(FAT_FILESYSTEM *fs, const FAT_FILE *file, const fat_off_t offset, const fat_off_t size, char *data, const bool is_write)
+{
+    fat_off_t done = 0;
+    while (done < size) {
+        fat_block_t index = (offset + done) / fs->block_size;
+        fat_block_t first = file->block_ids[index];
+        fat_off_t run_bytes = fs->block_size;
+        //grow the run while the next block of the file follows physically
+        while (run_bytes < size - done && index + run_bytes / fs->block_size < (fat_off_t)file->block_ids.size()
+                && file->block_ids[index + run_bytes / fs->block_size] == first + run_bytes / fs->block_size) {
+            run_bytes += fs->block_size;
+        }
+        run_bytes = std::min(run_bytes, size - done);
+        fat_off_t moved = is_write ? mini_fat_write_in_blocks(fs, first, run_bytes, data + done)
+                                   : mini_fat_read_in_blocks(fs, first, run_bytes, data + done);
+        if (moved != run_bytes) {
+            return false;
+        }
+        done += run_bytes;
+    }
+    return true;
+}
+
+// Open the host file once per task; its chunks share the descriptor.
+static bool host_open(BULK_PIPELINE *p, BULK_TASK &task, const fat_off_t offset, const fat_off_t size, char *data)
+{
+    task.host_fd = open(task.host_path.c_str(), O_RDONLY);
+    if (task.host_fd == -1) {
+        perror(task.host_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+static bool host_close(BULK_PIPELINE *p, BULK_TASK &task, const fat_off_t offset, const fat_off_t size, char *data)
+{
+    if (task.host_fd != -1) {
+        close(task.host_fd);
+        task.host_fd = -1;
+    }
+    return true;
+}
+
+static bool host_read(BULK_PIPELINE *p, BULK_TASK &task, const fat_off_t offset, const fat_off_t size, char *data)
+{
+    fat_off_t done = 0;
+    while (done < size) {
+        fat_off_t read = pread(task.host_fd, data + done, size - done, offset + done);
+        if (read <= 0) break;
+        done += read;
+    }
+    if (done != size) {
+        fprintf(stderr, "'%s' changed while copying it.\n", task.host_path.c_str());
+    }
+    return done == size;
+}
+
+static bool host_write(BULK_PIPELINE *p, BULK_TASK &task, const fat_off_t offset, const fat_off_t size, char *data)
+{
+    fat_off_t done = 0;
+    while (done < size) {
+        fat_off_t written = pwrite(task.host_fd, data + done, size - done, offset + done);
+        if (written <= 0) break;
+        done += written;
+    }
+    return done == size;
+}
+
+// Create (or truncate) the host file up front, so chunks can land in any order.
+static bool host_create(BULK_PIPELINE *p, BULK_TASK &task, const fat_off_t offset, const fat_off_t size, char *data)
+{
+    task.host_fd = open(task.host_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (task.host_fd == -1) {
+        perror(task.host_path.c_str());
+        return false;
+    }
+    return ftruncate(task.host_fd, task.size) == 0;
+}
+
+static bool image_read(BULK_PIPELINE *p, BULK_TASK &task, const fat_off_t offset, const fat_off_t size, char *data)
+{
+    return bulk_transfer(p->fs, task.file, offset, size, data, false);
+}
+
+static bool image_write(BULK_PIPELINE *p, BULK_TASK &task, const fat_off_t offset, const fat_off_t size, char *data)
+{
+    return bulk_transfer(p->fs, task.file, offset, size, data, true);
+}
+
+// Drop one reference to a task; the last one ends it.
+static void bulk_finish(BULK_PIPELINE *p, const int t)
+{
+    if (--p->pending[t] == 0) {
+        p->end(p, p->tasks[t], 0, 0, NULL);
+    }
+}
+
+// First pipeline stage: fill chunks from the source, a task at a time.
+static void bulk_reader(BULK_PIPELINE *p)
+{
+    for (;;) {
+        int t = p->next_task++;
+        if (t >= (int)p->tasks.size()) break;
+        {
+            std::unique_lock<std::mutex> guard(p->ready_lock);
+            p->ready_cond.wait(guard, [p, t] { return p->ready_tasks > t; });
+        }
+        BULK_TASK &task = p->tasks[t];
+        if (p->failed[t]) continue;
+        p->pending[t] = 1;
+        if (!p->begin(p, task, 0, 0, NULL)) {
+            p->failed[t] = 1;
+        }
+        for (fat_off_t offset = 0; offset < task.size && !p->failed[t]; offset += p->chunk_size) {
+            BULK_CHUNK chunk;
+            chunk.task = t;
+            chunk.offset = offset;
+            chunk.size = std::min(p->chunk_size, task.size - offset);
+            //blocks while all buffers are in flight
+            p->free_buffers.pop(chunk.data);
+            if (!p->read(p, task, chunk.offset, chunk.size, chunk.data)) {
+                p->failed[t] = 1;
+                p->free_buffers.push(chunk.data);
+                break;
+            }
+            p->pending[t]++;
+            p->chunks.push(chunk);
+        }
+        bulk_finish(p, t);
+    }
+}
+
+// Second pipeline stage: drain chunks to the destination.
+static void bulk_writer(BULK_PIPELINE *p)
+{
+    BULK_CHUNK chunk;
+    while (p->chunks.pop(chunk)) {
+        if (!p->failed[chunk.task]) {
+            if (p->write(p, p->tasks[chunk.task], chunk.offset, chunk.size, chunk.data)) {
+                p->bytes += chunk.size;
+            } else {
+                p->failed[chunk.task] = 1;
+            }
+        }
+        p->free_buffers.push(chunk.data);
+        bulk_finish(p, chunk.task);
+    }
+}
+
+/**
+ * Run the reader and writer pools over p->tasks while metadata() publishes
+ * tasks through p->ready_tasks on the calling thread.
+ */
+template<typename F>
+static void bulk_run(BULK_PIPELINE *p, int workers, F metadata)
+{
+    if (workers < 1) workers = 1;
+    p->failed = std::vector<std::atomic<char> >(p->tasks.size());
+    p->pending = std::vector<std::atomic<int> >(p->tasks.size());
+    p->chunk_size = std::max((fat_off_t)p->fs->block_size, BULK_CHUNK_SIZE / p->fs->block_size * p->fs->block_size);
+    //two buffers per reader: one being filled while the other is being written;
+    //aligned, so direct I/O moves whole runs without a bounce buffer
+    std::vector<char> buffers(2 * workers * p->chunk_size + FAT_DIRECT_ALIGN);
+    char * first = buffers.data() + (FAT_DIRECT_ALIGN - (uintptr_t)buffers.data() % FAT_DIRECT_ALIGN) % FAT_DIRECT_ALIGN;
+    for (int i = 0; i < 2 * workers; i++) {
+        p->free_buffers.push(first + i * p->chunk_size);
+    }
+
+    std::vector<std::thread> readers, writers;
+    for (int i = 0; i < workers; i++) {
+        readers.push_back(std::thread(bulk_reader, p));
+        writers.push_back(std::thread(bulk_writer, p));
+    }
+    metadata();
+    for (int i = 0; i < workers; i++) readers[i].join();
+    p->chunks.close();
+    for (int i = 0; i < workers; i++) writers[i].join();
+}
+
+static void bulk_publish(BULK_PIPELINE *p, const int ready_tasks)
+{
+    std::lock_guard<std::mutex> guard(p->ready_lock);
+    p->ready_tasks = ready_tasks;
+    p->ready_cond.notify_all();
+}
+
+// Collect all regular files below dir, named relative to it.
+static void bulk_walk(const std::string &dir, const std::string &prefix, std::vector<BULK_TASK> &tasks)
+{
+    DIR * d = opendir(dir.c_str());
+    if (d == NULL) {
+        perror(dir.c_str());
+        return;
+    }
+    struct dirent * entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        std::string path = dir + "/" + entry->d_name;
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            bulk_walk(path, prefix + entry->d_name + "/", tasks);
+        } else if (S_ISREG(st.st_mode)) {
+            BULK_TASK task;
+            task.host_path = path;
+            task.image_name = prefix + entry->d_name;
+            task.host_fd = -1;
+            task.file = NULL;
+            task.size = st.st_size;
+            tasks.push_back(task);
+        }
+    }
+    closedir(d);
+}
+
+// Next empty block at or after cursor; one forward pass over the block map,
+// plus one more over blocks still queued for trimming if the volume is full.
+static fat_block_t bulk_allocate(FAT_FILESYSTEM *fs, fat_block_t &cursor, const unsigned char block_type)
+{
+    for (int pass = 0; pass < 2; pass++) {
+        for (; cursor < fs->block_count; cursor++) {
+            if (fs->block_map[cursor] == EMPTY_BLOCK) {
+                mini_fat_set_block_type(fs, cursor, block_type);
+                return cursor++;
+            }
+        }
+        if (pass > 0 || !mini_fat_trim_reclaim(fs)) break;
+        cursor = 0;
+    }
+    return -1;
+}
+
+static void bulk_fill_stats(BULK_PIPELINE *p, FAT_BULK_STATS *stats)
+{
+    if (stats == NULL) return;
+    stats->files = 0;
+    stats->failed = 0;
+    for (int i = 0; i < (int)p->tasks.size(); i++) {
+        if (p->failed[i]) stats->failed++;
+        else stats->files++;
+    }
+    stats->bytes = p->bytes;
+}
+
+/**
+ * Copy a host file, or a host directory tree, into the virtual disk.
+ * Files of a tree are named by their path relative to host_path, prefixed
+ * with image_name/ if given. Existing names are skipped.
+ * The filesystem is saved once at the end.
+ * @return true if every file was copied
+ */
+bool mini_bulk_import(FAT_FILESYSTEM *fs, const char *host_path, const char *image_name, const int workers, FAT_BULK_STATS *stats)
+{
+    BULK_PIPELINE p;
+    p.fs = fs;
+    p.begin = host_open;
+    p.read = host_read;
+    p.write = image_write;
+    p.end = host_close;
+
+    struct stat st;
+    if (stat(host_path, &st) != 0) {
+        perror(host_path);
+        return false;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        std::string prefix = image_name != NULL ? image_name : "";
+        if (!prefix.empty() && prefix[prefix.size() - 1] != '/') prefix += "/";
+        bulk_walk(host_path, prefix, p.tasks);
+    } else {
+        BULK_TASK task;
+        task.host_path = host_path;
+        const char * base = strrchr(host_path, '/');
+        task.image_name = image_name != NULL ? image_name : (base != NULL ? base + 1 : host_path);
+        task.host_fd = -1;
+        task.file = NULL;
+        task.size = st.st_size;
+        p.tasks.push_back(task);
+    }
+
+    //on a shared mount the whole import is one metadata change
+    if (fs->share != NULL) mini_fat_share_begin(fs);
+    mini_fat_enter(fs);
+    bulk_run(&p, workers, [&p, fs] {
+        mini_fat_trim_collect(fs);
+        fat_block_t cursor = 0;
+        bool full = false;
+        for (int t = 0; t < (int)p.tasks.size(); t++) {
+            BULK_TASK &task = p.tasks[t];
+            if (full || task.image_name.size() >= (size_t)MAX_FILENAME_LENGTH || mini_file_find(fs, task.image_name.c_str()) != NULL) {
+                if (!full) fprintf(stderr, "Skipping '%s': name too long or already exists.\n", task.image_name.c_str());
+                p.failed[t] = 1;
+            } else {
+                //entry block and all data blocks up front, so copies can start right away
+                FAT_FILE * file = mini_file_create(task.image_name.c_str());
+                file->metadata_block_id = bulk_allocate(fs, cursor, FILE_ENTRY_BLOCK);
+                fat_off_t blocks = (task.size + fs->block_size - 1) / fs->block_size;
+                for (fat_off_t b = 0; b < blocks && file->metadata_block_id != -1; b++) {
+                    fat_block_t block_id = bulk_allocate(fs, cursor, FILE_DATA_BLOCK);
+                    if (block_id == -1) break;
+                    file->block_ids.push_back(block_id);
+                }
+                if (file->metadata_block_id == -1 || (fat_off_t)file->block_ids.size() != blocks) {
+                    fprintf(stderr, "Cannot import '%s': filesystem is full.\n", task.image_name.c_str());
+                    if (file->metadata_block_id != -1) mini_fat_set_block_type(fs, file->metadata_block_id, EMPTY_BLOCK);
+                    for (int b = 0; b < (int)file->block_ids.size(); b++) {
+                        mini_fat_set_block_type(fs, file->block_ids[b], EMPTY_BLOCK);
+                    }
+                    delete file;
+                    p.failed[t] = 1;
+                    full = true;
+                } else {
+                    file->size = task.size;
+                    fs->files.push_back(file);
+                    fs->file_index[file->name] = file;
+                    task.file = file;
+                }
+            }
+            bulk_publish(&p, t + 1);
+        }
+        bulk_publish(&p, p.tasks.size());
+    });
+
+    //drop files whose contents did not make it
+    for (int t = 0; t < (int)p.tasks.size(); t++) {
+        if (p.failed[t] && p.tasks[t].file != NULL) {
+            mini_file_delete(fs, p.tasks[t].image_name.c_str());
+        }
+    }
+    bulk_fill_stats(&p, stats);
+    bool saved = mini_fat_save(fs);
+    mini_fat_leave(fs);
+    if (fs->share != NULL) {
+        mini_fat_share_end(fs);
+    }
+    return saved && (stats == NULL || stats->failed == 0);
+}
+
+// mkdir -p for the parent directories of path.
+static void bulk_make_parents(const std::string &path)
+{
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        mkdir(path.substr(0, slash).c_str(), 0755);
+    }
+}
+
+/**
+ * Copy files out of the virtual disk.
+ * If image_name names a file, it is copied to host_path (or into it, if it
+ * is a directory). Otherwise every file below the image_name/ prefix is
+ * copied to host_path/<rest of its name>; an empty prefix copies everything.
+ * @return true if every file was copied
+ */
+bool mini_bulk_export(FAT_FILESYSTEM *fs, const char *image_name, const char *host_path, const int workers, FAT_BULK_STATS *stats)
+{
+    BULK_PIPELINE p;
+    p.fs = fs;
+    p.begin = host_create;
+    p.read = image_read;
+    p.write = host_write;
+    p.end = host_close;
+
+    mini_fat_share_refresh(fs);
+    FAT_FILE * single = mini_file_find(fs, image_name);
+    struct stat st;
+    bool host_is_dir = stat(host_path, &st) == 0 && S_ISDIR(st.st_mode);
+    std::string prefix = image_name;
+    if (!prefix.empty() && prefix[prefix.size() - 1] != '/') prefix += "/";
+    for (int i = 0; i < (int)fs->files.size(); i++) {
+        FAT_FILE * file = fs->files[i];
+        BULK_TASK task;
+        if (single != NULL) {
+            if (file != single) continue;
+            const char * base = strrchr(file->name, '/');
+            task.host_path = host_is_dir ? std::string(host_path) + "/" + (base != NULL ? base + 1 : file->name) : host_path;
+        } else {
+            if (strncmp(file->name, prefix.c_str(), prefix.size()) != 0) continue;
+            task.host_path = std::string(host_path) + "/" + (file->name + prefix.size());
+        }
+        task.image_name = file->name;
+        task.host_fd = -1;
+        task.file = file;
+        task.size = file->size;
+        bulk_make_parents(task.host_path);
+        p.tasks.push_back(task);
+    }
+    if (p.tasks.empty()) {
+        fprintf(stderr, "No file matches '%s'.\n", image_name);
+        return false;
+    }
+
+    //metadata is already in place, every task can start at once
+    mini_fat_enter(fs);
+    bulk_run(&p, workers, [&p] { bulk_publish(&p, p.tasks.size()); });
+    mini_fat_leave(fs);
+    bulk_fill_stats(&p, stats);
+    return stats == NULL || stats->failed == 0;
+}
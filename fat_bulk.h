@@ -0,0 +1,25 @@
+#ifndef FAT_BULK_H
+#define FAT_BULK_H
+
+#include <stdint.h>
+
+typedef struct t_FAT_FILESYSTEM FAT_FILESYSTEM; // Forward definition.
+
+// Totals reported by the bulk copy functions.
+typedef struct t_FAT_BULK_STATS {
+	int files; // Files copied completely.
+	int failed; // Files skipped or copied partially.
+	int64_t bytes; // Bytes copied.
+} FAT_BULK_STATS;
+
+
+/// Bulk copy between the real disk and a virtual disk.
+// Host reads, image writes and metadata updates run in overlapping stages:
+// the calling thread creates files and allocates their blocks, a pool of
+// readers fills double-buffered chunks, a pool of writers drains them.
+// The filesystem must not be used by other threads meanwhile.
+bool mini_bulk_import(FAT_FILESYSTEM *fs, const char *host_path, const char *image_name, const int workers, FAT_BULK_STATS *stats);
+bool mini_bulk_export(FAT_FILESYSTEM *fs, const char *image_name, const char *host_path, const int workers, FAT_BULK_STATS *stats);
+
+
+#endif // FAT_BULK_H
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "fat.h"
+#include "fat_file.h"
+#include "fat_check.h"
+#include "fat_dedup.h"
+#include <unordered_map>
+
+// Reference bits collected per block while walking the files.
+const unsigned char REF_ENTRY = 1;
+const unsigned char REF_DATA = 2;
+const unsigned char REF_SHARED = 4;
+
+const int CHECK_MAX_MESSAGES = 32;
+
+typedef std::vector<std::atomic<unsigned char> > CHECK_REFS;
+
+// Deduplicated blocks may be owned many times; their references are
+// counted and compared with the saved reference counts.
+typedef struct t_CHECK_DEDUP {
+    std::vector<FAT_DEDUP_ENTRY> entries;
+    std::unordered_map<fat_block_t, size_t> slots; // Block to index in entries.
+    std::vector<std::atomic<uint32_t> > counts;
+} CHECK_DEDUP;
+
+static void check_note(FAT_CHECK_REPORT &part, const char * fmt, ...) {
+    if ((int)part.messages.size() >= CHECK_MAX_MESSAGES) return;
+    char message[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+    part.messages.push_back(message);
+}
+
+static void check_reference(const FAT_FILESYSTEM *fs, CHECK_REFS &refs, CHECK_DEDUP &dedup, const FAT_FILE *file, const fat_block_t block_id, const unsigned char bit, FAT_CHECK_REPORT &part) {
+    //block 0 holds the superblock and never belongs to a file
+    if (block_id <= 0 || block_id >= fs->block_count) {
+        part.invalid++;
+        check_note(part, "'%s' refers to block %lld outside the volume", file->name, (long long)block_id);
+        return;
+    }
+    unsigned char seen = refs[block_id].fetch_or(bit);
+    if (bit == REF_DATA && !dedup.slots.empty()) {
+        auto slot = dedup.slots.find(block_id);
+        if (slot != dedup.slots.end()) {
+            dedup.counts[slot->second]++;
+            if (!(seen & REF_ENTRY)) return;
+        }
+    }
+    if (seen & (REF_ENTRY | REF_DATA)) {
+        refs[block_id].fetch_or(REF_SHARED);
+    }
+}
+
+// Phase 1: mark the blocks owned by files [begin, end).
+static void check_files(const FAT_FILESYSTEM *fs, CHECK_REFS &refs, CHECK_DEDUP &dedup, const size_t begin, const size_t end, FAT_CHECK_REPORT *part) {
+    for (size_t i = begin; i < end; i++) {
+        const FAT_FILE * file = fs->files[i];
+        check_reference(fs, refs, dedup, file, file->metadata_block_id, REF_ENTRY, *part);
+        for (size_t j = 0; j < file->block_ids.size(); j++) {
+            check_reference(fs, refs, dedup, file, file->block_ids[j], REF_DATA, *part);
+        }
+        fat_off_t needed = (file->size + fs->block_size - 1) / fs->block_size;
+        if (file->size < 0 || needed != (fat_off_t)file->block_ids.size()) {
+            part->bad_sizes++;
+            check_note(*part, "'%s' has size %lld but %d blocks", file->name, (long long)file->size, (int)file->block_ids.size());
+        }
+    }
+}
+
+// Phase 2: compare block_map with the collected references for blocks [begin, end).
+static void check_blocks(FAT_FILESYSTEM *fs, const CHECK_REFS &refs, const std::set<fat_block_t> &deferred, const bool repair, const fat_block_t begin, const fat_block_t end, FAT_CHECK_REPORT *part) {
+    for (fat_block_t i = begin; i < end; i++) {
+        unsigned char ref = refs[i].load(std::memory_order_relaxed);
+        unsigned char type = fs->block_map[i];
+        unsigned char expected;
+        if (i == 0) {
+            expected = METADATA_BLOCK;
+        } else if (ref == 0) {
+            //freed while pinned by a read view, released on unpin, freed
+            //and waiting for the trimmer, or reserved for a large block
+            if (type == EMPTY_BLOCK || type == TRIM_PENDING_BLOCK || type == RESERVED_BLOCK || deferred.count(i) > 0) continue;
+            part->leaked++;
+            check_note(*part, "block %lld is marked %d but owned by no file", (long long)i, (int)type);
+            if (repair) {
+                fs->block_map[i] = EMPTY_BLOCK;
+                part->repaired++;
+            }
+            continue;
+        } else {
+            if (ref & REF_SHARED) {
+                part->shared++;
+                check_note(*part, "block %lld is owned more than once", (long long)i);
+            }
+            expected = (ref & REF_ENTRY) ? FILE_ENTRY_BLOCK : FILE_DATA_BLOCK;
+        }
+        if (type != expected) {
+            part->mismatched++;
+            check_note(*part, "block %lld is marked %d instead of %d", (long long)i, (int)type, (int)expected);
+            if (repair) {
+                fs->block_map[i] = expected;
+                part->repaired++;
+            }
+        }
+    }
+}
+
+static void check_merge(FAT_CHECK_REPORT &report, const FAT_CHECK_REPORT &part) {
+    report.leaked += part.leaked;
+    report.shared += part.shared;
+    report.mismatched += part.mismatched;
+    report.invalid += part.invalid;
+    report.bad_sizes += part.bad_sizes;
+    report.bad_refcounts += part.bad_refcounts;
+    report.repaired += part.repaired;
+    for (size_t i = 0; i < part.messages.size() && (int)report.messages.size() < CHECK_MAX_MESSAGES; i++) {
+        report.messages.push_back(part.messages[i]);
+    }
+}
+
+/**
+ * Verify that block_map agrees with the blocks owned by the files:
+ * every entry and data block is in range, owned once and typed accordingly
+ * in block_map, every other block is empty, and file sizes match their
+ * block lists.
+ * @param  repair  reclaim leaked blocks and retype owned blocks
+ * @param  threads number of threads to use
+ * @param  report  if not NULL, receives the findings
+ * @return         true if the volume is consistent (after repair)
+ */
+bool mini_fat_check(FAT_FILESYSTEM *fs, const bool repair, const int threads, FAT_CHECK_REPORT *report) {
+    int workers = std::max(1, threads);
+    CHECK_REFS refs(fs->block_count);
+    std::vector<FAT_CHECK_REPORT> parts(workers, FAT_CHECK_REPORT());
+    std::vector<std::thread> pool;
+
+    //the migrator must not move blocks while they are counted
+    mini_fat_enter(fs);
+    CHECK_DEDUP dedup;
+    mini_fat_dedup_entries(fs, dedup.entries);
+    dedup.counts = std::vector<std::atomic<uint32_t> >(dedup.entries.size());
+    for (size_t i = 0; i < dedup.entries.size(); i++) {
+        dedup.slots[dedup.entries[i].block_id] = i;
+    }
+
+    size_t files = fs->files.size();
+    for (int t = 0; t < workers; t++) {
+        pool.push_back(std::thread(check_files, fs, std::ref(refs), std::ref(dedup), files * t / workers, files * (t + 1) / workers, &parts[t]));
+    }
+    for (int t = 0; t < workers; t++) pool[t].join();
+    pool.clear();
+
+    //blocks waiting for an unpin, copied once instead of taking pin_lock per block
+    std::set<fat_block_t> deferred;
+    {
+        std::lock_guard<std::mutex> guard(fs->pin_lock);
+        deferred = fs->deferred_free;
+    }
+    for (int t = 0; t < workers; t++) {
+        fat_block_t begin = fs->block_count * t / workers;
+        fat_block_t end = fs->block_count * (t + 1) / workers;
+        pool.push_back(std::thread(check_blocks, fs, std::cref(refs), std::cref(deferred), repair, begin, end, &parts[t]));
+    }
+    for (int t = 0; t < workers; t++) pool[t].join();
+    if (repair) {
+        mini_fat_build_groups(fs); // block_map was edited directly
+    }
+
+    //reference counts of deduplicated blocks, few enough for one thread
+    bool recount = false;
+    for (size_t i = 0; i < dedup.entries.size(); i++) {
+        uint32_t counted = dedup.counts[i].load();
+        if (counted != dedup.entries[i].refs) {
+            parts[0].bad_refcounts++;
+            check_note(parts[0], "block %lld has %u references but a count of %u", (long long)dedup.entries[i].block_id, counted, dedup.entries[i].refs);
+            dedup.entries[i].refs = counted;
+            recount = true;
+        }
+    }
+    if (repair && recount) {
+        mini_fat_dedup_restore(fs, dedup.entries);
+        parts[0].repaired += parts[0].bad_refcounts;
+    }
+
+    mini_fat_leave(fs);
+
+    FAT_CHECK_REPORT total = FAT_CHECK_REPORT();
+    for (int t = 0; t < workers; t++) {
+        check_merge(total, parts[t]);
+    }
+    bool clean = total.shared == 0 && total.invalid == 0 && total.bad_sizes == 0
+                 && (repair || (total.leaked == 0 && total.mismatched == 0 && total.bad_refcounts == 0));
+    if (report != NULL) {
+        *report = total;
+    }
+    return clean;
+}
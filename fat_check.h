@@ -0,0 +1,34 @@
+#ifndef FAT_CHECK_H
+#define FAT_CHECK_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+typedef struct t_FAT_FILESYSTEM FAT_FILESYSTEM; // Forward definition.
+
+// Findings of a consistency check, counted in blocks unless noted.
+typedef struct t_FAT_CHECK_REPORT {
+	int64_t leaked; // Marked used in block_map, owned by no file.
+	int64_t shared; // Owned by more than one file (or twice by one).
+	int64_t mismatched; // Owned, but block_map has another type (or empty).
+	int64_t invalid; // References to block ids outside the volume.
+	int bad_sizes; // Files (not blocks) whose size does not match their block list.
+	int64_t bad_refcounts; // Deduplicated blocks whose reference count is wrong.
+	int64_t repaired; // Blocks fixed in repair mode.
+	std::vector<std::string> messages; // The first few problems, human readable.
+} FAT_CHECK_REPORT;
+
+
+/// Volume verifier.
+// Checks that block_map agrees with the union of all entry and data blocks
+// of all files, using threads over partitions of the files and then of the
+// block space. In repair mode, leaked blocks are reclaimed and owned blocks
+// get their type back in block_map; the caller saves the filesystem.
+// Deduplicated blocks may be owned many times, their reference counts
+// must match and are recounted in repair mode. Other blocks that are
+// shared between files cannot be repaired.
+bool mini_fat_check(FAT_FILESYSTEM *fs, const bool repair, const int threads, FAT_CHECK_REPORT *report);
+
+
+#endif // FAT_CHECK_H
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+
+#include "fat.h"
+#include "fat_dedup.h"
+
+struct dedup_hash_hasher {
+    size_t operator()(const FAT_HASH &hash) const { return (size_t)hash.low; }
+};
+
+struct t_FAT_DEDUP {
+    std::mutex lock;
+    std::unordered_map<FAT_HASH, fat_block_t, dedup_hash_hasher> index; // Contents to block.
+    std::unordered_map<fat_block_t, FAT_DEDUP_ENTRY> blocks; // Indexed blocks.
+    int64_t references = 0;
+    int64_t blocks_hashed = 0;
+    int64_t blocks_deduplicated = 0;
+};
+
+static inline uint64_t hash_rotl(const uint64_t x, const int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_fmix(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/**
+ * MurmurHash3 x64 128 (public domain, Austin Appleby): 16 bytes per step,
+ * fast enough to hash every block written.
+ */
+FAT_HASH mini_fat_hash128(const void *data, const size_t size) {
+    const unsigned char * bytes = (const unsigned char *)data;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0, h2 = 0;
+    size_t blocks = size / 16;
+    for (size_t i = 0; i < blocks; i++) {
+        uint64_t k1, k2;
+        memcpy(&k1, bytes + i * 16, 8);
+        memcpy(&k2, bytes + i * 16 + 8, 8);
+        k1 *= c1; k1 = hash_rotl(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = hash_rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = hash_rotl(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = hash_rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+    const unsigned char * tail = bytes + blocks * 16;
+    uint64_t k1 = 0, k2 = 0;
+    for (size_t i = size & 15; i > 8; i--) k2 |= (uint64_t)tail[i - 1] << ((i - 9) * 8);
+    for (size_t i = std::min(size & 15, (size_t)8); i > 0; i--) k1 |= (uint64_t)tail[i - 1] << ((i - 1) * 8);
+    if (size & 15) {
+        k2 *= c2; k2 = hash_rotl(k2, 33); k2 *= c1; h2 ^= k2;
+        k1 *= c1; k1 = hash_rotl(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+    h1 ^= size; h2 ^= size;
+    h1 += h2; h2 += h1;
+    h1 = hash_fmix(h1); h2 = hash_fmix(h2);
+    h1 += h2; h2 += h1;
+    FAT_HASH hash = { h1, h2 };
+    return hash;
+}
+
+/**
+ * Turn on deduplication for blocks written from now on.
+ * The mode is saved with the image.
+ * @return false if it is already on
+ */
+bool mini_fat_dedup_enable(FAT_FILESYSTEM *fs) {
+    if (fs->dedup != NULL) {
+        return false;
+    }
+    fs->dedup = new FAT_DEDUP;
+    return true;
+}
+
+void mini_fat_dedup_free(FAT_FILESYSTEM *fs) {
+    delete fs->dedup;
+    fs->dedup = NULL;
+}
+
+FAT_DEDUP_STATS mini_fat_dedup_stats(const FAT_FILESYSTEM *fs) {
+    FAT_DEDUP_STATS stats = FAT_DEDUP_STATS();
+    FAT_DEDUP * d = fs->dedup;
+    if (d == NULL) return stats;
+    std::lock_guard<std::mutex> guard(d->lock);
+    stats.blocks_hashed = d->blocks_hashed;
+    stats.blocks_deduplicated = d->blocks_deduplicated;
+    stats.unique_blocks = d->blocks.size();
+    stats.references = d->references;
+    stats.ratio = stats.unique_blocks > 0 ? (double)stats.references / stats.unique_blocks : 1.0;
+    return stats;
+}
+
+/**
+ * Look for a block with the given contents. The candidate is read back and
+ * compared, so a hash collision never links different data. The read runs
+ * without d->lock; the reference is only added if the index still points
+ * at the block that was compared.
+ * @param  data contents of a full block, hashed to hash
+ * @return      the block with one more reference, -1 if there is none
+ */
+int64_t mini_fat_dedup_find(FAT_FILESYSTEM *fs, const FAT_HASH &hash, const void *data) {
+    FAT_DEDUP * d = fs->dedup;
+    int64_t candidate;
+    {
+        std::lock_guard<std::mutex> guard(d->lock);
+        d->blocks_hashed++;
+        auto it = d->index.find(hash);
+        if (it == d->index.end()) return -1;
+        candidate = it->second;
+    }
+    std::vector<char> stored(fs->block_size);
+    for (;;) {
+        if (mini_fat_read_in_block(fs, candidate, 0, fs->block_size, stored.data()) != fs->block_size
+            || memcmp(stored.data(), data, fs->block_size) != 0) {
+            return -1;
+        }
+        std::lock_guard<std::mutex> guard(d->lock);
+        auto it = d->index.find(hash);
+        if (it == d->index.end()) return -1;
+        if (it->second == candidate) {
+            d->blocks[candidate].refs++;
+            d->references++;
+            d->blocks_deduplicated++;
+            return candidate;
+        }
+        //moved by the migrator while it was compared, compare the new copy
+        candidate = it->second;
+    }
+}
+
+/**
+ * Add a block that was just written in full, with one reference, to the
+ * index. Nothing happens if other contents with the same hash are there.
+ */
+void mini_fat_dedup_insert(FAT_FILESYSTEM *fs, const int64_t block_id, const FAT_HASH &hash) {
+    FAT_DEDUP * d = fs->dedup;
+    std::lock_guard<std::mutex> guard(d->lock);
+    if (!d->index.insert(std::make_pair(hash, block_id)).second) return;
+    FAT_DEDUP_ENTRY entry = { block_id, 1, hash };
+    d->blocks[block_id] = entry;
+    d->references++;
+}
+
+/**
+ * Get ready to modify a block in place. An indexed block with a single
+ * reference leaves the index, since its contents will change.
+ * @return false if the block is shared and must be copied first
+ */
+bool mini_fat_dedup_claim(FAT_FILESYSTEM *fs, const int64_t block_id) {
+    FAT_DEDUP * d = fs->dedup;
+    if (d == NULL) return true;
+    std::lock_guard<std::mutex> guard(d->lock);
+    auto it = d->blocks.find(block_id);
+    if (it == d->blocks.end()) return true;
+    if (it->second.refs > 1) return false;
+    d->index.erase(it->second.hash);
+    d->blocks.erase(it);
+    d->references--;
+    return true;
+}
+
+/**
+ * Point the index entry of block_id, if any, at new_block, whose contents
+ * are now the same.
+ */
+void mini_fat_dedup_move(FAT_FILESYSTEM *fs, const int64_t block_id, const int64_t new_block) {
+    FAT_DEDUP * d = fs->dedup;
+    if (d == NULL) return;
+    std::lock_guard<std::mutex> guard(d->lock);
+    auto it = d->blocks.find(block_id);
+    if (it == d->blocks.end()) return;
+    FAT_DEDUP_ENTRY entry = it->second;
+    entry.block_id = new_block;
+    d->blocks.erase(it);
+    d->blocks[new_block] = entry;
+    d->index[entry.hash] = new_block;
+}
+
+/**
+ * Drop one reference to a block.
+ * @return true if other references remain and the block must stay
+ */
+bool mini_fat_dedup_release(FAT_FILESYSTEM *fs, const int64_t block_id) {
+    FAT_DEDUP * d = fs->dedup;
+    if (d == NULL) return false;
+    std::lock_guard<std::mutex> guard(d->lock);
+    auto it = d->blocks.find(block_id);
+    if (it == d->blocks.end()) return false;
+    d->references--;
+    if (--it->second.refs > 0) return true;
+    d->index.erase(it->second.hash);
+    d->blocks.erase(it);
+    return false;
+}
+
+void mini_fat_dedup_entries(const FAT_FILESYSTEM *fs, std::vector<FAT_DEDUP_ENTRY> &entries) {
+    FAT_DEDUP * d = fs->dedup;
+    if (d == NULL) return;
+    std::lock_guard<std::mutex> guard(d->lock);
+    entries.reserve(entries.size() + d->blocks.size());
+    for (auto it = d->blocks.begin(); it != d->blocks.end(); ++it) {
+        entries.push_back(it->second);
+    }
+}
+
+/**
+ * Replace the index and reference counts, enabling dedup if needed.
+ * Entries without references are left out.
+ */
+void mini_fat_dedup_restore(FAT_FILESYSTEM *fs, const std::vector<FAT_DEDUP_ENTRY> &entries) {
+    mini_fat_dedup_enable(fs);
+    FAT_DEDUP * d = fs->dedup;
+    std::lock_guard<std::mutex> guard(d->lock);
+    d->index.clear();
+    d->blocks.clear();
+    d->references = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        const FAT_DEDUP_ENTRY &entry = entries[i];
+        if (entry.refs == 0 || entry.block_id <= 0 || entry.block_id >= fs->block_count) continue;
+        if (!d->index.insert(std::make_pair(entry.hash, entry.block_id)).second) continue;
+        d->blocks[entry.block_id] = entry;
+        d->references += entry.refs;
+    }
+}
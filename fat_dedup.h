@@ -0,0 +1,58 @@
+#ifndef FAT_DEDUP_H
+#define FAT_DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+typedef struct t_FAT_FILESYSTEM FAT_FILESYSTEM; // Forward definition.
+
+// 128-bit content hash of a block.
+typedef struct t_FAT_HASH {
+	uint64_t low, high;
+	bool operator==(const t_FAT_HASH &other) const { return low == other.low && high == other.high; }
+} FAT_HASH;
+
+// One deduplicated block, as saved in the hash index of the image.
+typedef struct t_FAT_DEDUP_ENTRY {
+	int64_t block_id;
+	uint32_t refs; // Entries in block_ids of all files that point at the block.
+	FAT_HASH hash;
+} FAT_DEDUP_ENTRY;
+
+typedef struct t_FAT_DEDUP_STATS {
+	int64_t blocks_hashed; // Full blocks written while dedup was on.
+	int64_t blocks_deduplicated; // Of those, stored as a reference to an existing block.
+	int64_t unique_blocks; // Blocks in the hash index.
+	int64_t references; // References to them from files.
+	double ratio; // references / unique_blocks, 1 without sharing.
+} FAT_DEDUP_STATS;
+
+
+/// Content-addressed deduplication.
+// When enabled, mini_file_write hashes every full, block-aligned block it
+// writes. If a block with the same contents exists, the file points at it
+// and its reference count goes up instead of writing a copy. Shared blocks
+// are copied before they are modified (like pinned blocks), and freed when
+// the last reference goes. The hash index and reference counts are saved
+// with the file table, and loading an image restores them.
+bool mini_fat_dedup_enable(FAT_FILESYSTEM *fs);
+FAT_DEDUP_STATS mini_fat_dedup_stats(const FAT_FILESYSTEM *fs);
+FAT_HASH mini_fat_hash128(const void *data, const size_t size);
+
+// Used by file writes and the block allocator:
+int64_t mini_fat_dedup_find(FAT_FILESYSTEM *fs, const FAT_HASH &hash, const void *data);
+void mini_fat_dedup_insert(FAT_FILESYSTEM *fs, const int64_t block_id, const FAT_HASH &hash);
+bool mini_fat_dedup_claim(FAT_FILESYSTEM *fs, const int64_t block_id);
+bool mini_fat_dedup_release(FAT_FILESYSTEM *fs, const int64_t block_id);
+// Used by the tier migrator:
+void mini_fat_dedup_move(FAT_FILESYSTEM *fs, const int64_t block_id, const int64_t new_block);
+
+// Used by save, load and check:
+void mini_fat_dedup_entries(const FAT_FILESYSTEM *fs, std::vector<FAT_DEDUP_ENTRY> &entries);
+void mini_fat_dedup_restore(FAT_FILESYSTEM *fs, const std::vector<FAT_DEDUP_ENTRY> &entries);
+// Used by mini_fat_destroy:
+void mini_fat_dedup_free(FAT_FILESYSTEM *fs);
+
+
+#endif // FAT_DEDUP_H
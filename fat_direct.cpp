@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "fat.h"
+#include "fat_direct.h"
+
+// Idle bounce buffers kept for reuse; more are allocated under load.
+const size_t DIRECT_POOL_BUFFERS = 16;
+
+struct t_FAT_DIRECT {
+    int fd = -1; // The image, opened with O_DIRECT.
+    int mem_align = FAT_DIRECT_ALIGN; // Required alignment of buffers in memory.
+    std::mutex lock; // Guards pool.
+    std::vector<void *> pool; // Idle bounce buffers of one block.
+    std::atomic<int64_t> bytes_direct{0};
+    std::atomic<int64_t> bytes_bounced{0};
+    std::atomic<int64_t> blocks_merged{0};
+};
+
+/**
+ * Ask the host for the direct I/O alignment of the image; without statx
+ * support assume page alignment, which every device accepts.
+ */
+static void direct_alignment(const int fd, int &mem_align, int &offset_align) {
+    mem_align = offset_align = FAT_DIRECT_ALIGN;
+#ifdef STATX_DIOALIGN
+    struct statx st;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &st) == 0 && (st.stx_mask & STATX_DIOALIGN) != 0
+            && st.stx_dio_mem_align > 0 && st.stx_dio_offset_align > 0) {
+        mem_align = st.stx_dio_mem_align;
+        offset_align = st.stx_dio_offset_align;
+    }
+#endif
+}
+
+static void * direct_acquire(FAT_FILESYSTEM *fs, FAT_DIRECT *d) {
+    {
+        std::lock_guard<std::mutex> guard(d->lock);
+        if (!d->pool.empty()) {
+            void * buffer = d->pool.back();
+            d->pool.pop_back();
+            return buffer;
+        }
+    }
+    void * buffer = NULL;
+    if (posix_memalign(&buffer, std::max(d->mem_align, FAT_DIRECT_ALIGN), fs->block_size) != 0) {
+        return NULL;
+    }
+    return buffer;
+}
+
+static void direct_release(FAT_DIRECT *d, void *buffer) {
+    {
+        std::lock_guard<std::mutex> guard(d->lock);
+        if (d->pool.size() < DIRECT_POOL_BUFFERS) {
+            d->pool.push_back(buffer);
+            return;
+        }
+    }
+    free(buffer);
+}
+
+/**
+ * Move an aligned range between memory and the image, retrying short
+ * transfers.
+ * @return moved byte count
+ */
+static fat_off_t direct_transfer(FAT_DIRECT *d, const bool is_write, char *data, const fat_off_t size, const fat_off_t offset) {
+    fat_off_t done = 0;
+    while (done < size) {
+        fat_off_t moved = is_write ? pwrite(d->fd, data + done, size - done, offset + done)
+                                   : pread(d->fd, data + done, size - done, offset + done);
+        if (moved <= 0) {
+            if (moved == -1) perror(is_write ? "An error occured during direct write" : "An error occured during direct read");
+            break;
+        }
+        done += moved;
+    }
+    return done;
+}
+
+bool mini_fat_direct_enable(FAT_FILESYSTEM *fs) {
+    if (fs->direct != NULL) {
+        return true;
+    }
+    if (fs->tier != NULL || fs->memory != NULL) {
+        fprintf(stderr, "Direct I/O is not available on tiered or memory volumes.\n");
+        return false;
+    }
+    FAT_DIRECT * d = new FAT_DIRECT;
+    d->fd = open(fs->filename, O_RDWR | O_DIRECT);
+    if (d->fd == -1) {
+        perror("Cannot open virtual disk for direct I/O");
+        delete d;
+        return false;
+    }
+    int offset_align;
+    direct_alignment(d->fd, d->mem_align, offset_align);
+    if (fs->block_size % offset_align != 0) {
+        fprintf(stderr, "Direct I/O needs a block size that is a multiple of %d bytes.\n", offset_align);
+        close(d->fd);
+        delete d;
+        return false;
+    }
+    fs->direct = d;
+    return true;
+}
+
+/**
+ * Go back to buffered block I/O. No block I/O may be running.
+ */
+void mini_fat_direct_disable(FAT_FILESYSTEM *fs) {
+    FAT_DIRECT * d = fs->direct;
+    if (d == NULL) {
+        return;
+    }
+    fs->direct = NULL;
+    close(d->fd);
+    for (size_t i = 0; i < d->pool.size(); i++) {
+        free(d->pool[i]);
+    }
+    delete d;
+}
+
+FAT_DIRECT_STATS mini_fat_direct_stats(const FAT_FILESYSTEM *fs) {
+    FAT_DIRECT_STATS stats = FAT_DIRECT_STATS();
+    if (fs->direct != NULL) {
+        stats.bytes_direct = fs->direct->bytes_direct;
+        stats.bytes_bounced = fs->direct->bytes_bounced;
+        stats.blocks_merged = fs->direct->blocks_merged;
+    }
+    return stats;
+}
+
+/**
+ * Read size bytes of the image at offset. Whole blocks go straight into
+ * buffer if it is aligned, the rest block by block through bounce buffers.
+ * @return read byte count
+ */
+int64_t mini_fat_direct_read(FAT_FILESYSTEM *fs, const int64_t offset, const int64_t size, void *buffer) {
+    FAT_DIRECT * d = fs->direct;
+    const int block_size = fs->block_size;
+    fat_off_t done = 0;
+    while (done < size) {
+        fat_off_t position = offset + done;
+        int block_offset = (int)(position % block_size);
+        char * data = (char *)buffer + done;
+        if (block_offset == 0 && size - done >= block_size && (uintptr_t)data % d->mem_align == 0) {
+            fat_off_t run = (size - done) / block_size * block_size;
+            fat_off_t read = direct_transfer(d, false, data, run, position);
+            d->bytes_direct += read;
+            done += read;
+            if (read < run) break;
+            continue;
+        }
+        int chunk = (int)std::min((fat_off_t)(block_size - block_offset), size - done);
+        char * bounce = (char *)direct_acquire(fs, d);
+        bool ok = bounce != NULL && direct_transfer(d, false, bounce, block_size, position - block_offset) == block_size;
+        if (ok) {
+            memcpy(data, bounce + block_offset, chunk);
+        }
+        if (bounce != NULL) direct_release(d, bounce);
+        if (!ok) break;
+        d->bytes_bounced += chunk;
+        done += chunk;
+    }
+    return done;
+}
+
+/**
+ * Write size bytes to the image at offset. Whole blocks go straight from
+ * buffer if it is aligned; partial blocks are read, patched and written
+ * back whole through bounce buffers.
+ * @return written byte count
+ */
+int64_t mini_fat_direct_write(FAT_FILESYSTEM *fs, const int64_t offset, const int64_t size, const void *buffer) {
+    FAT_DIRECT * d = fs->direct;
+    const int block_size = fs->block_size;
+    fat_off_t done = 0;
+    while (done < size) {
+        fat_off_t position = offset + done;
+        int block_offset = (int)(position % block_size);
+        const char * data = (const char *)buffer + done;
+        if (block_offset == 0 && size - done >= block_size && (uintptr_t)data % d->mem_align == 0) {
+            fat_off_t run = (size - done) / block_size * block_size;
+            fat_off_t written = direct_transfer(d, true, (char *)data, run, position);
+            d->bytes_direct += written;
+            done += written;
+            if (written < run) break;
+            continue;
+        }
+        int chunk = (int)std::min((fat_off_t)(block_size - block_offset), size - done);
+        char * bounce = (char *)direct_acquire(fs, d);
+        bool ok = bounce != NULL;
+        if (ok && chunk < block_size) {
+            //keep the bytes of the block around the written part
+            ok = direct_transfer(d, false, bounce, block_size, position - block_offset) == block_size;
+            d->blocks_merged++;
+        }
+        if (ok) {
+            memcpy(bounce + block_offset, data, chunk);
+            ok = direct_transfer(d, true, bounce, block_size, position - block_offset) == block_size;
+        }
+        if (bounce != NULL) direct_release(d, bounce);
+        if (!ok) break;
+        d->bytes_bounced += chunk;
+        done += chunk;
+    }
+    return done;
+}
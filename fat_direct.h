@@ -0,0 +1,36 @@
+#ifndef FAT_DIRECT_H
+#define FAT_DIRECT_H
+
+#include <stdint.h>
+
+typedef struct t_FAT_FILESYSTEM FAT_FILESYSTEM; // Forward definition.
+
+// Buffers aligned to this are passed straight through on every host.
+const int FAT_DIRECT_ALIGN = 4096;
+
+typedef struct t_FAT_DIRECT_STATS {
+	int64_t bytes_direct; // Moved straight between the caller's buffer and the disk.
+	int64_t bytes_bounced; // Copied through a bounce buffer.
+	int64_t blocks_merged; // Edge blocks read back to merge a partial write.
+} FAT_DIRECT_STATS;
+
+
+/// Direct I/O.
+// While enabled, the block helpers read and write file data through a
+// second descriptor of the image opened with O_DIRECT, so the data is
+// never cached by the host. Whole blocks in a suitably aligned caller
+// buffer go to the disk without a copy. Anything else goes through a
+// pool of block sized, aligned bounce buffers, and a partial block write
+// reads the block first and writes it back whole. The block size must be
+// a multiple of the host's direct I/O alignment. Metadata and read views
+// still use the page cache.
+bool mini_fat_direct_enable(FAT_FILESYSTEM *fs);
+void mini_fat_direct_disable(FAT_FILESYSTEM *fs);
+FAT_DIRECT_STATS mini_fat_direct_stats(const FAT_FILESYSTEM *fs);
+
+// Used by the block helpers:
+int64_t mini_fat_direct_read(FAT_FILESYSTEM *fs, const int64_t offset, const int64_t size, void *buffer);
+int64_t mini_fat_direct_write(FAT_FILESYSTEM *fs, const int64_t offset, const int64_t size, const void *buffer);
+
+
+#endif // FAT_DIRECT_H
@@ -1,12 +1,19 @@
 #include "fat.h"
 #include "fat_file.h"
+#include "fat_dedup.h"
+#include "fat_trace.h"
+#include "fat_share.h"
+#include "fat_tier.h"
+#include "fat_lock.h"
 #include <cstdarg>
 #include <cstdio>
 #include <string.h>
 #include <cassert>
+#include <algorithm>
+#include <unordered_set>
 
 // Little helper to show debug messages. Set 1 to 0 to silence.
-#define DEBUG 1
+#define DEBUG 0
 inline void debug(const char * fmt, ...) {
 #if DEBUG>0
     va_list args;
@@ -36,35 +43,76 @@ static bool vector_delete_value(std::vector<T> &vector, const T var) {
 
 void mini_file_dump(const FAT_FILESYSTEM *fs, const FAT_FILE *file)
 {
-    printf("Filename: %s\tFilesize: %d\tBlock count: %d\n", file->name, file->size, (int)file->block_ids.size());
-    printf("\tMetadata block: %d\n", file->metadata_block_id);
+    printf("Filename: %s\tFilesize: %lld\tBlock count: %d\n", file->name, (long long)file->size, (int)file->block_ids.size());
+    printf("\tMetadata block: %lld\n", (long long)file->metadata_block_id);
     printf("\tBlock list: ");
     for (int i=0; i<file->block_ids.size(); ++i) {
-        printf("%d ", file->block_ids[i]);
+        printf("%lld ", (long long)file->block_ids[i]);
     }
     printf("\n");
 
     printf("\tOpen handles: \n");
     for (int i=0; i<file->open_handles.size(); ++i) {
-        printf("\t\t%d) Position: %d (Block %d, Byte %d), Is Write: %d\n", i,
-            file->open_handles[i]->position,
-            position_to_block_index(fs, file->open_handles[i]->position),
+        printf("\t\t%d) Position: %lld (Block %lld, Byte %d), Is Write: %d\n", i,
+            (long long)file->open_handles[i]->position,
+            (long long)position_to_block_index(fs, file->open_handles[i]->position),
             position_to_byte_index(fs, file->open_handles[i]->position),
             file->open_handles[i]->is_write);
     }
 }
 
 
+// A metadata change on a shared mount: holds the lock of all mounts from
+// construction to destruction. save writes the table before the lock is
+// released, so the caller can report a failure. Does nothing on a private
+// mount.
+struct share_scope {
+    FAT_FILESYSTEM * fs;
+    uint64_t token = 0;
+    explicit share_scope(FAT_FILESYSTEM *fs) : fs(fs) {
+        if (fs->share != NULL) token = mini_fat_share_begin(fs);
+    }
+    bool save() {
+        return fs->share == NULL || mini_fat_share_save(fs, token);
+    }
+    ~share_scope() {
+        if (fs->share != NULL) mini_fat_share_end(fs);
+    }
+};
+
+// A file operation: keeps the tier migrator from moving blocks of files,
+// and a memory snapshot from starting, from construction to destruction.
+struct busy_scope {
+    const FAT_FILESYSTEM * fs;
+    explicit busy_scope(const FAT_FILESYSTEM *fs) : fs(fs) {
+        mini_fat_enter(fs);
+    }
+    ~busy_scope() {
+        mini_fat_leave(fs);
+    }
+};
+
+// A read on a shared mount: keeps the mount from reloading the table, and
+// so from changing files, from construction to destruction.
+struct share_read_scope {
+    const FAT_FILESYSTEM * fs;
+    explicit share_read_scope(const FAT_FILESYSTEM *fs) : fs(fs) {
+        mini_fat_share_read_begin(fs);
+    }
+    ~share_read_scope() {
+        mini_fat_share_read_end(fs);
+    }
+};
+
 /**
  * Find a file in loaded filesystem, or return NULL.
  */
 FAT_FILE * mini_file_find(const FAT_FILESYSTEM *fs, const char *filename)
 {
-    for (int i=0; i<fs->files.size(); ++i) {
-        if (strcmp(fs->files[i]->name, filename) == 0) // Match
-            return fs->files[i];
-    }
-    return NULL;
+    std::unordered_map<std::string, FAT_FILE*>::const_iterator it = fs->file_index.find(filename);
+    if (it == fs->file_index.end())
+        return NULL;
+    return it->second;
 }
 
 /**
@@ -79,6 +127,16 @@ FAT_FILE * mini_file_create(const char * filename)
 }
 
 
+/**
+ * Free a FAT_FILE struct and its lock state.
+ */
+void mini_file_free(FAT_FILE *file)
+{
+    mini_file_locks_free(file);
+    delete file;
+}
+
+
 /**
  * Create a file and attach it to filesystem.
  * @return FAT_OPEN_FILE pointer on success, NULL on failure
@@ -88,13 +146,15 @@ FAT_FILE * mini_file_create_file(FAT_FILESYSTEM *fs, const char *filename)
     assert(strlen(filename)< MAX_FILENAME_LENGTH);
     FAT_FILE *fd = mini_file_create(filename);
 
-    int new_block_index = mini_fat_allocate_new_block(fs, FILE_ENTRY_BLOCK);
+    fat_block_t new_block_index = mini_fat_allocate_block_near(fs, FILE_ENTRY_BLOCK, mini_fat_next_group_goal(fs));
     if (new_block_index == -1)
     {
         fprintf(stderr, "Cannot create new file '%s': filesystem is full.\n", filename);
+        delete fd;
         return NULL;
     }
     fs->files.push_back(fd); // Add to filesystem.
+    fs->file_index[fd->name] = fd;
     fd->metadata_block_id = new_block_index;
     return fd;
 }
@@ -105,7 +165,8 @@ FAT_FILE * mini_file_create_file(FAT_FILESYSTEM *fs, const char *filename)
  * @param  filename name of file
  * @return          file size in bytes, or zero if file does not exist.
  */
-int mini_file_size(FAT_FILESYSTEM *fs, const char *filename) {
+fat_off_t mini_file_size(FAT_FILESYSTEM *fs, const char *filename) {
+    share_read_scope reading(fs);
     FAT_FILE * fd = mini_file_find(fs, filename);
     if (!fd) {
         fprintf(stderr, "File '%s' does not exist.\n", filename);
@@ -121,23 +182,34 @@ int mini_file_size(FAT_FILESYSTEM *fs, const char *filename) {
  * the file is created.
  * Adds the opened file to file's open handles.
  * @param  is_write whether it is opened in write (append) mode or read.
+ * @param  is_shared write mode that admits other shared writers, see fat_lock.h.
  * @return FAT_OPEN_FILE pointer on success, NULL on failure
  */
-FAT_OPEN_FILE * mini_file_open(FAT_FILESYSTEM *fs, const char *filename, const bool is_write)
+static FAT_OPEN_FILE * file_open(FAT_FILESYSTEM *fs, const char *filename, const bool is_write, const bool is_shared)
 {
-    printf("Filename: %s\n", filename);
+    busy_scope busy(fs);
+    share_scope share(fs);
+    debug("Filename: %s\n", filename);
     FAT_FILE * fd = mini_file_find(fs, filename);
     //printf("Found file: %p", fd);
     if (!fd) {
-        printf("File null\n");
+        debug("File null\n");
         // TODO: check if it's write mode, and if so create it. Otherwise return NULL.
         if (is_write){
-            printf("Is writing\n");
+            debug("Is writing\n");
             fd = mini_file_create_file(fs, filename);
             if (fd == NULL){
                 fprintf(stderr, "An error occured during creating file\n");
                 return NULL;
             }
+            if (!share.save()) {
+                //the other mounts never saw the new file, take it out again
+                fs->files.pop_back();
+                fs->file_index.erase(fd->name);
+                mini_fat_set_block_type(fs, fd->metadata_block_id, EMPTY_BLOCK);
+                delete fd;
+                return NULL;
+            }
         }
         //it is not in write mode so not existing file created only if it is in write mode
         else{
@@ -145,16 +217,23 @@ FAT_OPEN_FILE * mini_file_open(FAT_FILESYSTEM *fs, const char *filename, const b
             return NULL;
         }
     }
-    printf("Is write? %s\n", is_write ? "true" : "false");
+    debug("Is write? %s\n", is_write ? "true" : "false");
     if (is_write) {
         // TODO: check if other write handles are open.
         int total_open = fd->open_handles.size();
         for (int i = 0; i < total_open; i++){
-            if(fd->open_handles[i]->is_write){
+            //shared writers only exclude exclusive ones
+            if(fd->open_handles[i]->is_write && !(is_shared && fd->open_handles[i]->is_shared)){
                 fprintf(stderr, "Cannot open file in write mode because other write handles are open\n");
                 return NULL;
             }
         }
+        if (fs->share != NULL && !mini_fat_share_claim_writer(fs, fd->metadata_block_id)) {
+            fprintf(stderr, "Cannot open file in write mode because another mount writes it\n");
+            return NULL;
+        }
+    } else if (fs->share != NULL && !mini_fat_share_claim_reader(fs, fd->metadata_block_id)) {
+        return NULL;
     }
         
     FAT_OPEN_FILE * open_file = new FAT_OPEN_FILE;
@@ -162,20 +241,50 @@ FAT_OPEN_FILE * mini_file_open(FAT_FILESYSTEM *fs, const char *filename, const b
     open_file->file = fd;
     open_file->position = 0;
     open_file->is_write = is_write;
+    open_file->is_shared = is_shared;
+    open_file->trace_id = 0;
+    if (is_shared) {
+        mini_file_locks_attach(fd);
+    }
     // Add to list of open handles for fd:
     fd->open_handles.push_back(open_file);
     return open_file;
 }
 
+/**
+ * Hand back the reserved rest of the large block a file was filling.
+ */
+static void file_release_run(FAT_FILESYSTEM *fs, FAT_FILE *file)
+{
+    for (fat_block_t b = file->run_next; b < file->run_end; b++) {
+        mini_fat_change_block_type(fs, b, RESERVED_BLOCK, EMPTY_BLOCK);
+    }
+    file->run_next = file->run_end = 0;
+}
+
 /**
  * Close an existing open file handle.
  * @return false on failure (no open file handle), true on success.
  */
-bool mini_file_close(FAT_FILESYSTEM *fs, const FAT_OPEN_FILE * open_file)
+static bool file_close(FAT_FILESYSTEM *fs, const FAT_OPEN_FILE * open_file)
 {
     if (open_file == NULL) return false;
+    busy_scope busy(fs);
+    share_scope share(fs);
     FAT_FILE * fd = open_file->file;
     if (vector_delete_value(fd->open_handles, open_file)) {
+        mini_file_locks_release(fd, open_file);
+        if (open_file->is_write) {
+            file_release_run(fs, fd);
+        }
+        if (fs->share != NULL && open_file->is_write) {
+            mini_fat_share_release_writer(fs, fd->metadata_block_id);
+        } else if (fs->share != NULL) {
+            mini_fat_share_release_reader(fs, fd->metadata_block_id);
+        }
+        if (fd->deleted && fd->open_handles.empty()) {
+            mini_file_free(fd);
+        }
         return true;
     }
 
@@ -183,15 +292,459 @@ bool mini_file_close(FAT_FILESYSTEM *fs, const FAT_OPEN_FILE * open_file)
     return false;
 }
 
+/**
+ * Move a pinned or shared block of a file to a fresh block before it is
+ * modified, so read views and other files holding the old block keep
+ * seeing the old contents.
+ * @return the new block id, or -1 if the filesystem is full.
+ */
+static fat_block_t mini_file_unshare_block(FAT_FILESYSTEM *fs, FAT_FILE *file, const fat_block_t block_index)
+{
+    fat_block_t old_block = file->block_ids[block_index];
+    fat_block_t new_block = mini_fat_allocate_block_near(fs, FILE_DATA_BLOCK, old_block);
+    if (new_block == -1) {
+        return -1;
+    }
+    std::vector<char> copy(fs->block_size);
+    mini_fat_read_in_block(fs, old_block, 0, fs->block_size, copy.data());
+    mini_fat_write_in_block(fs, new_block, 0, fs->block_size, copy.data());
+    file->block_ids[block_index] = new_block;
+    file->block_changes++;
+    mini_fat_free_block(fs, old_block);
+    return new_block;
+}
+
+/**
+ * Where the next data block of a file should go: right after its previous
+ * block, or its entry block.
+ */
+static fat_block_t file_data_goal(const FAT_FILESYSTEM *fs, const FAT_FILE *file)
+{
+    fat_block_t goal = (file->block_ids.empty() ? file->metadata_block_id : file->block_ids.back()) + 1;
+    //new data starts out on the fast tier
+    if (goal < fs->tier_boundary) {
+        goal = fs->tier_boundary + goal % (fs->block_count - fs->tier_boundary);
+    }
+    return goal;
+}
+
+/**
+ * Allocate the next data block of a file. Files of FAT_LARGE_FILE_BLOCKS
+ * blocks, or hinted to get that large, take a whole aligned large block
+ * and fill it before they take the next one, so they stay contiguous.
+ * Small files take single blocks, and so do files on shared mounts, whose
+ * other mounts would not see the reservation.
+ * @return new block id, -1 if the filesystem is full
+ */
+static fat_block_t file_allocate_data(FAT_FILESYSTEM *fs, FAT_FILE *file)
+{
+    if (file->run_next < file->run_end) {
+        fat_block_t block_id = file->run_next++;
+        mini_fat_set_block_type(fs, block_id, FILE_DATA_BLOCK);
+        return block_id;
+    }
+    fat_block_t blocks = std::max((fat_block_t)file->block_ids.size(), (file->size_hint + fs->block_size - 1) / fs->block_size);
+    if (blocks >= FAT_LARGE_FILE_BLOCKS && fs->share == NULL) {
+        fat_block_t run = mini_fat_allocate_run(fs, FILE_DATA_BLOCK, FAT_LARGE_BLOCKS, file_data_goal(fs, file));
+        if (run != -1) {
+            file->run_next = run + 1;
+            file->run_end = run + FAT_LARGE_BLOCKS;
+            return run;
+        }
+        //no free large block left, fall back to small ones
+    }
+    return mini_fat_allocate_block_near(fs, FILE_DATA_BLOCK, file_data_goal(fs, file));
+}
+
+/**
+ * Block of a file at block_index, ready to be modified: allocated if it
+ * is the block after the end of the file, and moved if a read view or
+ * another reference still points to it.
+ * @return block id, -1 if the filesystem is full
+ */
+static fat_block_t file_block_for_write(FAT_FILESYSTEM *fs, FAT_FILE *file, const fat_block_t block_index)
+{
+    //callers ask for the blocks of a write in order, from a position no
+    //further than the end of the file, so only the next block can be new
+    assert(block_index <= (fat_block_t)file->block_ids.size());
+    if (block_index == (fat_block_t)file->block_ids.size()) {
+        fat_block_t new_block = file_allocate_data(fs, file);
+        if (new_block == -1) {
+            return -1;
+        }
+        file->block_ids.push_back(new_block);
+        file->block_changes++;
+    }
+    fat_block_t block_id = file->block_ids[block_index];
+    //never modify a block that a read view or another reference still points to
+    if (mini_fat_block_is_pinned(fs, block_id) || !mini_fat_dedup_claim(fs, block_id)) {
+        block_id = mini_file_unshare_block(fs, file, block_index);
+    }
+    return block_id;
+}
+
+/**
+ * Whether block block_index of a file cannot follow block_id in the image.
+ * Known for blocks the file has and for the rest of its large block; a
+ * block still to be allocated elsewhere is only known after allocating.
+ */
+static bool file_block_breaks_run(const FAT_FILE *file, const fat_block_t block_index, const fat_block_t block_id)
+{
+    if (block_index < (fat_block_t)file->block_ids.size()) {
+        return file->block_ids[block_index] != block_id;
+    }
+    return file->run_next < file->run_end && file->run_next != block_id;
+}
+
+/**
+ * Write up to max_blocks whole blocks of a file from block_index on with
+ * one request, as far as they follow each other in the image. A block
+ * that had to be allocated after the run is the next one the caller
+ * writes. If the write falls short, blocks allocated past the written
+ * bytes are given back.
+ * @return written byte count
+ */
+static fat_off_t file_write_run(FAT_FILESYSTEM *fs, FAT_FILE *file, const fat_block_t block_index, const fat_block_t max_blocks, const void * buffer)
+{
+    const fat_block_t had = file->block_ids.size();
+    fat_block_t first = file_block_for_write(fs, file, block_index);
+    if (first == -1) {
+        return 0;
+    }
+    fat_block_t count = 1;
+    while (count < max_blocks && !file_block_breaks_run(file, block_index + count, first + count)
+            && file_block_for_write(fs, file, block_index + count) == first + count) {
+        count++;
+    }
+    fat_off_t written = mini_fat_write_in_blocks(fs, first, count * fs->block_size, buffer);
+    if (written < count * fs->block_size) {
+        fat_block_t keep = std::max(had, block_index + (std::max(written, (fat_off_t)0) + fs->block_size - 1) / fs->block_size);
+        while ((fat_block_t)file->block_ids.size() > keep) {
+            mini_fat_free_block(fs, file->block_ids.back());
+            file->block_ids.pop_back();
+            file->block_changes++;
+        }
+    }
+    return written;
+}
+
+/// Block geometry of the per-block loops below.
+// block_pow2 knows the block size at compile time, so positions are split
+// with a shift and a mask and the chunk size of whole blocks is a constant.
+// block_any is the fallback for block sizes that are not a power of two.
+template <int SHIFT>
+struct block_pow2 {
+    static constexpr int size = 1 << SHIFT;
+    explicit block_pow2(const FAT_FILESYSTEM *) {}
+    fat_block_t index(const fat_off_t position) const { return position >> SHIFT; }
+    int offset(const fat_off_t position) const { return (int)(position & (size - 1)); }
+};
+
+struct block_any {
+    int size;
+    explicit block_any(const FAT_FILESYSTEM *fs) : size(fs->block_size) {}
+    fat_block_t index(const fat_off_t position) const { return position / size; }
+    int offset(const fat_off_t position) const { return (int)(position % size); }
+};
+
+// Bytes of the block at byte_index that fit in bytes_left.
+template <typename G>
+static inline int block_chunk(const G &geo, const int byte_index, const fat_off_t bytes_left) {
+    return (int)(((bytes_left)<(geo.size - byte_index))?(bytes_left):(geo.size - byte_index));
+}
+
+template <typename G>
+static fat_off_t file_write_kernel(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t size, const void * buffer)
+{
+    const G geo(fs);
+    fat_off_t written_bytes = 0;
+    fat_off_t bytes_left = size;
+    FAT_FILE *fat = open_file->file;
+    fat_off_t position = open_file->position;
+    while (bytes_left > 0) {
+        fat_block_t block_index = geo.index(position);
+        int byte_index = geo.offset(position);
+        //with dedup, a full block with known contents becomes one more reference
+        FAT_HASH hash;
+        bool hashed = fs->dedup != NULL && byte_index == 0 && bytes_left >= geo.size;
+        if (hashed) {
+            hash = mini_fat_hash128(buffer, geo.size);
+            fat_block_t same = mini_fat_dedup_find(fs, hash, buffer);
+            if (same != -1) {
+                if (block_index < (fat_block_t)fat->block_ids.size()) {
+                    fat_block_t old_block = fat->block_ids[block_index];
+                    fat->block_ids[block_index] = same;
+                    mini_fat_free_block(fs, old_block);
+                } else {
+                    fat->block_ids.push_back(same);
+                }
+                fat->block_changes++;
+                written_bytes += geo.size;
+                bytes_left -= geo.size;
+                position += geo.size;
+                buffer = (const char*)buffer + geo.size;
+                continue;
+            }
+        }
+        //without dedup, whole blocks that follow each other in the image go out in one request
+        if (fs->dedup == NULL && byte_index == 0 && bytes_left >= 2 * geo.size) {
+            fat_off_t written = file_write_run(fs, fat, block_index, bytes_left / geo.size, buffer);
+            if (written <= 0) {
+                break;
+            }
+            written_bytes += written;
+            bytes_left -= written;
+            position += written;
+            buffer = (const char*)buffer + written;
+            continue;
+        }
+        fat_block_t block_id = file_block_for_write(fs, fat, block_index);
+        if (block_id == -1) {
+            break;
+        }
+        //write possible highest value of bytes (it is either all we have or the space left in block)
+        int bytes_to_write = block_chunk(geo, byte_index, bytes_left);
+        int written = mini_fat_write_in_block(fs, block_id, byte_index, bytes_to_write, buffer);
+        if (written <= 0) {
+            break;
+        }
+        if (hashed && written == geo.size) {
+            mini_fat_dedup_insert(fs, block_id, hash);
+        }
+        written_bytes += written;
+        bytes_left -= written;
+        position += written;
+        //update the buffer
+        buffer = (const char*)buffer + written;
+    }
+    //overwriting inside the file does not change its size
+    if (position > fat->size) {
+        fat->size = position;
+    }
+    //change position to where we achieved last
+    open_file->position = position;
+    return written_bytes;
+}
+
+template <typename G>
+static fat_off_t file_read_kernel(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t size, void * buffer)
+{
+    const G geo(fs);
+    fat_off_t read_bytes = 0;
+    FAT_FILE * fat = open_file->file;
+    fat_off_t position = open_file->position;
+    //if size left in file is smaller than what we were given, update the size that we will read
+    fat_off_t bytes_left = (((size)<(fat->size - position))?(size):(fat->size - position));
+    while (bytes_left > 0) {
+        fat_block_t block_index = geo.index(position);
+        fat_block_t block_id = fat->block_ids[block_index];
+        int byte_index = geo.offset(position);
+        fat_off_t read;
+        if (byte_index == 0 && bytes_left > geo.size) {
+            //blocks that follow each other in the image are read with one request
+            fat_block_t count = 1;
+            while ((fat_off_t)count * geo.size < bytes_left && block_index + count < (fat_block_t)fat->block_ids.size()
+                    && fat->block_ids[block_index + count] == block_id + count) {
+                count++;
+            }
+            for (fat_block_t b = 0; fs->tier != NULL && b < count; b++) mini_fat_tier_touch(fs, block_id + b);
+            read = mini_fat_read_in_blocks(fs, block_id, std::min(bytes_left, (fat_off_t)count * geo.size), buffer);
+        } else {
+            if (fs->tier != NULL) mini_fat_tier_touch(fs, block_id);
+            //read possible highest value of bytes (it is either all we have or the space we can read in that block)
+            int bytes_to_read = block_chunk(geo, byte_index, bytes_left);
+            read = mini_fat_read_in_block(fs, block_id, byte_index, bytes_to_read, buffer);
+        }
+        if (read <= 0) {
+            break;
+        }
+        bytes_left -= read;
+        read_bytes += read;
+        position += read;
+        //update the buffer
+        buffer = (char*)buffer + read;
+    }
+    open_file->position = position;
+    return read_bytes;
+}
+
+template <typename G>
+static void file_read_view_kernel(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t size, const unsigned char * image, FAT_READ_VIEW * view)
+{
+    const G geo(fs);
+    FAT_FILE * fat = open_file->file;
+    fat_off_t position = open_file->position;
+    fat_off_t bytes_left = (((size)<(fat->size - position))?(size):(fat->size - position));
+    fat_block_t last_block = -1;
+    while (bytes_left > 0) {
+        fat_block_t block_id = fat->block_ids[geo.index(position)];
+        int byte_index = geo.offset(position);
+        int bytes_to_read = block_chunk(geo, byte_index, bytes_left);
+        if (fs->tier != NULL) mini_fat_tier_touch(fs, block_id);
+        mini_fat_pin_block(fs, block_id);
+        view->pinned_blocks.push_back(block_id);
+        if (last_block != -1 && block_id == last_block + 1) {
+            //continues the previous span in the image
+            view->spans.back().size += bytes_to_read;
+        } else {
+            FAT_SPAN span;
+            span.data = image + block_id * geo.size + byte_index;
+            span.size = bytes_to_read;
+            view->spans.push_back(span);
+        }
+        last_block = block_id;
+        bytes_left -= bytes_to_read;
+        view->size += bytes_to_read;
+        position += bytes_to_read;
+    }
+    open_file->position = position;
+}
+
+#define FILE_KERNELS(block_size, G) { block_size, file_read_kernel<G>, file_write_kernel<G>, file_read_view_kernel<G> }
+
+// One instantiation per power-of-two block size from 512 B to 64 KB.
+static const FAT_FILE_KERNELS file_kernels[] = {
+    FILE_KERNELS(512, block_pow2<9>),
+    FILE_KERNELS(1024, block_pow2<10>),
+    FILE_KERNELS(2048, block_pow2<11>),
+    FILE_KERNELS(4096, block_pow2<12>),
+    FILE_KERNELS(8192, block_pow2<13>),
+    FILE_KERNELS(16384, block_pow2<14>),
+    FILE_KERNELS(32768, block_pow2<15>),
+    FILE_KERNELS(65536, block_pow2<16>),
+};
+static const FAT_FILE_KERNELS generic_file_kernels = FILE_KERNELS(0, block_any);
+
+/**
+ * Pick the read/write loops compiled for the block size of fs, or the
+ * generic ones for other sizes. Called by create and load.
+ */
+void mini_file_select_kernels(FAT_FILESYSTEM *fs)
+{
+    fs->file_kernels = &generic_file_kernels;
+    for (size_t i = 0; i < sizeof(file_kernels) / sizeof(file_kernels[0]); i++) {
+        if (file_kernels[i].block_size == fs->block_size) {
+            fs->file_kernels = &file_kernels[i];
+        }
+    }
+    fs->block_shift = -1;
+    if ((fs->block_size & (fs->block_size - 1)) == 0) {
+        for (fs->block_shift = 0; (1 << fs->block_shift) < fs->block_size; fs->block_shift++);
+    }
+}
+
+/**
+ * Prepare the blocks of a shared write of [position, end) under the
+ * exclusive metadata lock: grow the block list, unshare the blocks about
+ * to change and zero the bytes between the data written so far and
+ * position. Blocks allocated past a write that had to be clipped are
+ * given back.
+ * @return end of the bytes that can be written, position if none
+ */
+static fat_off_t file_prepare_shared(FAT_FILESYSTEM *fs, FAT_FILE *fat, const fat_off_t position, fat_off_t end)
+{
+    const int block_size = fs->block_size;
+    const fat_block_t had = fat->block_ids.size();
+    fat_block_t needed = position_to_block_index(fs, end - 1) + 1;
+    while ((fat_block_t)fat->block_ids.size() < needed) {
+        fat_block_t new_block = mini_fat_allocate_block_near(fs, FILE_DATA_BLOCK, file_data_goal(fs, fat));
+        if (new_block == -1) break;
+        fat->block_ids.push_back(new_block);
+        fat->block_changes++;
+    }
+    end = std::min(end, (fat_off_t)fat->block_ids.size() * block_size);
+    fat_off_t zero_from = std::max(mini_file_reserved(fat), fat->size);
+    fat_off_t from = position > zero_from ? zero_from : position;
+    for (fat_block_t index = position_to_block_index(fs, from); index * block_size < end; index++) {
+        //never modify a block that a read view or another reference still points to
+        fat_block_t block_id = fat->block_ids[index];
+        if ((mini_fat_block_is_pinned(fs, block_id) || !mini_fat_dedup_claim(fs, block_id))
+                && mini_file_unshare_block(fs, fat, index) == -1) {
+            end = std::min(end, index * block_size);
+            break;
+        }
+    }
+    if (end <= position) {
+        end = position;
+    } else {
+        if (zero_from < position) {
+            std::vector<char> zeros(block_size, 0);
+            for (fat_off_t at = zero_from; at < position;) {
+                int byte_index = position_to_byte_index(fs, at);
+                int chunk = (int)std::min((fat_off_t)(block_size - byte_index), position - at);
+                mini_fat_write_in_block(fs, fat->block_ids[position_to_block_index(fs, at)], byte_index, chunk, zeros.data());
+                at += chunk;
+            }
+        }
+        mini_file_reserve(fat, end);
+    }
+    //blocks this call allocated past what the file and the other writers use
+    fat_off_t used = std::max(mini_file_reserved(fat), fat->size);
+    fat_block_t keep = std::max(had, (used + block_size - 1) / block_size);
+    while ((fat_block_t)fat->block_ids.size() > keep) {
+        mini_fat_free_block(fs, fat->block_ids.back());
+        fat->block_ids.pop_back();
+        fat->block_changes++;
+    }
+    return end;
+}
+
+/**
+ * Write of a handle opened with mini_file_open_shared. The block list is
+ * grown, and the blocks about to change are unshared, under the exclusive
+ * metadata lock of the file. The data is then written under the shared
+ * lock, so writers of disjoint ranges run in parallel while the block
+ * list stays put.
+ * @return           number of bytes written.
+ */
+static fat_off_t file_write_shared(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t size, const void * buffer)
+{
+    FAT_FILE * fat = open_file->file;
+    const int block_size = fs->block_size;
+    const fat_off_t position = open_file->position;
+    fat_off_t end = position;
+    bool pinned = true;
+    //a read view may pin a block between the two locks; unshare it and try again
+    while (pinned) {
+        mini_file_meta_lock(fat, true);
+        end = file_prepare_shared(fs, fat, position, position + size);
+        mini_file_meta_unlock(fat, true);
+        mini_file_meta_lock(fat, false);
+        pinned = false;
+        for (fat_off_t at = position; at < end && !pinned; at += block_size - position_to_byte_index(fs, at)) {
+            pinned = mini_fat_block_is_pinned(fs, fat->block_ids[position_to_block_index(fs, at)]);
+        }
+        if (pinned) mini_file_meta_unlock(fat, false);
+    }
+
+    fat_off_t written_bytes = 0;
+    while (position + written_bytes < end) {
+        fat_off_t at = position + written_bytes;
+        int byte_index = position_to_byte_index(fs, at);
+        int chunk = (int)std::min((fat_off_t)(block_size - byte_index), end - at);
+        int written = mini_fat_write_in_block(fs, fat->block_ids[position_to_block_index(fs, at)], byte_index, chunk,
+                                              (const char *)buffer + written_bytes);
+        if (written <= 0) break;
+        written_bytes += written;
+        if (written < chunk) break;
+    }
+    mini_file_meta_unlock(fat, false);
+
+    mini_file_meta_lock(fat, true);
+    if (position + written_bytes > fat->size) {
+        fat->size = position + written_bytes;
+    }
+    mini_file_meta_unlock(fat, true);
+    open_file->position = position + written_bytes;
+    return written_bytes;
+}
+
 /**
  * Write size bytes from buffer to open_file, at current position.
  * @return           number of bytes written.
  */
-int mini_file_write(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int size, const void * buffer)
+static fat_off_t file_write(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t size, const void * buffer)
 {
-    int written_bytes = 0;
-    int bytes_left = size;
-    FAT_FILE *fat = open_file->file;
     //do initial checks if not in write mode, if given size is negative etc.
     if (!open_file->is_write) {
         fprintf(stderr, "Attempting to write to a file opened in read mode.\n");
@@ -201,121 +754,128 @@ int mini_file_write(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int siz
         fprintf(stderr, "Attempting to write a negative number of bytes.\n");
         return 0;
     }
-    int position = open_file->position;
-    int block_index = position_to_block_index(fs, position);
-    int byte_index = position_to_byte_index(fs, position);
-    int bytes_to_write = 0;
-    //write in first block (the file position left) if there is still space
-    if (byte_index <= fs->block_size){
-        //write possible highest value of bytes (it is either all we have or the space left in block)
-        bytes_to_write = (((bytes_left)<(fs->block_size - byte_index))?(bytes_left):(fs->block_size - byte_index));
-        fat->size += mini_fat_write_in_block(fs, block_index, byte_index, bytes_to_write, buffer);
-                written_bytes += bytes_to_write;
-                bytes_left -= bytes_to_write;
-                //update the buffer
-                buffer = (char*)buffer + bytes_to_write;
-    }
-    // TODO: write to file.
-    while (bytes_left > 0) {
-        // Write to next block.
-        block_index = mini_fat_allocate_new_block(fs, FILE_DATA_BLOCK);
-        //add block index to fat block ids
-        fat->block_ids.push_back(block_index);
-        bytes_to_write = (((bytes_left)<(fs->block_size))?(bytes_left):(fs->block_size));
-        fat->size += mini_fat_write_in_block(fs, block_index, 0, bytes_to_write, buffer);
-        written_bytes += bytes_to_write;
-        bytes_left -= bytes_to_write;
-        //update the buffer
-        buffer = (char*)buffer + bytes_to_write;
+    busy_scope busy(fs);
+    share_scope share(fs);
+    //on a shared mount its lock keeps the other writers out meanwhile
+    FAT_FILE * fat = open_file->file;
+    const fat_off_t old_size = fs->share != NULL ? fat->size : 0;
+    const uint64_t old_changes = fs->share != NULL ? fat->block_changes : 0;
+    fat_off_t written = open_file->is_shared ? file_write_shared(fs, open_file, size, buffer)
+                                             : fs->file_kernels->write(fs, open_file, size, buffer);
+    //data written into blocks the file already had leaves the table as it is
+    if (fs->share != NULL && (fat->size != old_size || fat->block_changes != old_changes) && !share.save()) {
+        fprintf(stderr, "Cannot save the file table after writing to '%s'.\n", fat->name);
+        return 0;
     }
-    //change position to where we achieved last
-    open_file->position += written_bytes;
-    return written_bytes;
+    return written;
 }
 
 /**
  * Read up to size bytes from open_file into buffer.
  * @return           number of bytes read.
  */
-int mini_file_read(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int size, void * buffer)
+static fat_off_t file_read(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t size, void * buffer)
 {
-    int read_bytes = 0;
-
-    // TODO: read file.
-        
-    FAT_FILE * fat = open_file->file;
     if (size < 0) {
-        fprintf(stderr, "Attempting to write a negative number of bytes.\n");
+        fprintf(stderr, "Attempting to read a negative number of bytes.\n");
         return 0;
     }
-        //give an error if file is empty
-    if (fat->size == 0){
+    share_read_scope reading(fs);
+    //give an error if file is empty
+    if (open_file->file->size == 0){
         fprintf(stderr, "File is empty\n");
         return 0;
     }
-    int bytes_left = size;
-    int position = open_file->position;
-    int block_index = position_to_block_index(fs, position);
-    int byte_index = position_to_byte_index(fs, position);
-    //if size left in file is smaller than what we were given, update the size that we will read
-    bytes_left = (((bytes_left)<(fat->size - position))?(bytes_left):(fat->size - position));
-    int bytes_to_read = 0;
-    //read in first block (the file position left) if there is still space to read
-    if (byte_index <= fs->block_size){
-        // Read from first block.
-        //read possible highest value of bytes (it is either all we have or the space we can read in that block)
-        bytes_to_read = (((bytes_left)<(fs->block_size - byte_index))?(bytes_left):(fs->block_size - byte_index));
-        mini_fat_read_in_block(fs, block_index, byte_index, bytes_to_read, buffer);
-        bytes_left -= bytes_to_read;
-        read_bytes += bytes_to_read;
-        //update the buffer
-        buffer = (char*)buffer + bytes_to_read;
-    }
-    //get index of block_index in fat block_id s
-    int block_index_in_fat = 0;
-    for (int i = 0; i < fat->block_ids.size(); i++){
-        if (fat->block_ids[i] == block_index){
-            block_index_in_fat = i;
-            break;
-            }
-        }
-    while (bytes_left > 0) {
-        // Read from next block.
-        block_index_in_fat += 1;
-        block_index = fat->block_ids[block_index_in_fat];
-        bytes_to_read = (((bytes_left)<(fs->block_size))?(bytes_left):(fs->block_size));
-        mini_fat_read_in_block(fs, block_index, 0, bytes_to_read, buffer);
-        bytes_left -= bytes_to_read;
-        read_bytes += bytes_to_read;
-        //update the buffer
-        buffer = (char*)buffer + bytes_to_read;
-            
-        }
-        open_file ->position += read_bytes;
+    busy_scope busy(fs);
+    FAT_FILE * fat = open_file->file;
+    //shared writers may grow the block list meanwhile
+    if (fat->locks != NULL) mini_file_meta_lock(fat, false);
+    fat_off_t read = fs->file_kernels->read(fs, open_file, size, buffer);
+    if (fat->locks != NULL) mini_file_meta_unlock(fat, false);
+    return read;
+}
 
+/**
+ * Zero-copy read: return up to size bytes from open_file, at current
+ * position, as read-only spans into the mapped virtual disk.
+ * Physically contiguous blocks are merged into a single span.
+ * The blocks stay pinned (not reused, not overwritten in place) until the
+ * view is given back with mini_file_release_view.
+ * @return view (possibly with no spans at end of file), NULL on failure
+ */
+FAT_READ_VIEW * mini_file_read_view(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t size)
+{
+    if (size < 0) {
+        fprintf(stderr, "Attempting to read a negative number of bytes.\n");
+        return NULL;
+    }
+    const unsigned char * image = mini_fat_map_image(fs);
+    if (image == NULL) {
+        return NULL;
+    }
+    busy_scope busy(fs);
+    share_read_scope reading(fs);
+    FAT_READ_VIEW * view = new FAT_READ_VIEW;
+    view->size = 0;
+    FAT_FILE * fat = open_file->file;
+    if (fat->locks != NULL) mini_file_meta_lock(fat, false);
+    fs->file_kernels->read_view(fs, open_file, size, image, view);
+    if (fat->locks != NULL) mini_file_meta_unlock(fat, false);
+    return view;
+}
 
-    return read_bytes;
+/**
+ * Release a view returned by mini_file_read_view and unpin its blocks.
+ * The spans must not be used afterwards.
+ */
+bool mini_file_release_view(FAT_FILESYSTEM *fs, FAT_READ_VIEW * view)
+{
+    if (view == NULL) return false;
+    busy_scope busy(fs);
+    for (int i = 0; i < (int)view->pinned_blocks.size(); i++) {
+        mini_fat_unpin_block(fs, view->pinned_blocks[i]);
+    }
+    delete view;
+    return true;
 }
 
 
+/**
+ * Tell the filesystem how large a file open for writing is going to be.
+ * Files expected to reach FAT_LARGE_FILE_BLOCKS blocks are allocated in
+ * large blocks from their first write on. Not recorded in the image.
+ * @return false if open_file is not open for writing
+ */
+bool mini_file_size_hint(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t size)
+{
+    if (!open_file->is_write || size < 0) {
+        fprintf(stderr, "Attempting to hint the size of a file not opened for writing.\n");
+        return false;
+    }
+    open_file->file->size_hint = size;
+    return true;
+}
+
 /**
  * Change the cursor position of an open file.
  * @param  offset     how much to change
  * @param  from_start whether to start from beginning of file (or current position)
  * @return            false if the new position is not available, true otherwise.
  */
-bool mini_file_seek(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int offset, const bool from_start)
+static bool file_seek(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t offset, const bool from_start)
 {
     // TODO: seek and return true.
+    share_read_scope reading(fs);
     FAT_FILE * fat = open_file->file;
-    int new_position ;
+    fat_off_t new_position ;
     if (from_start){
         new_position = offset;
     }
     else{
         new_position = open_file->position + offset;
     }
-    if (new_position < 0 || new_position > fat->size) {
+    //shared writers fill their own ranges, also past the end of the file
+    if (new_position < 0 || (!open_file->is_shared && new_position > fat->size)) {
         return false;
     }
     open_file->position = new_position;
@@ -323,17 +883,32 @@ bool mini_file_seek(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int off
     return true;
 }
 
+/**
+ * Free a file taken out of the filesystem, or leave that to its last close
+ * if read handles still use it.
+ */
+static void file_forget(FAT_FILE *file)
+{
+    if (file->open_handles.empty()) {
+        mini_file_free(file);
+    } else {
+        file->deleted = true;
+    }
+}
+
 /**
  * Attemps to delete a file from filesystem.
  * If the file is open, it cannot be deleted.
- * Marks the blocks of a deleted file as empty on the filesystem.
+ * Marks the data and entry blocks of a deleted file as empty on the filesystem.
  * @return true on success, false on non-existing or open file.
  */
-bool mini_file_delete(FAT_FILESYSTEM *fs, const char *filename)
+static bool file_delete(FAT_FILESYSTEM *fs, const char *filename)
 {
     // TODO: delete file after checks.
+    busy_scope busy(fs);
+    share_scope share(fs);
     FAT_FILE* fat = mini_file_find(fs, filename);
-    printf("File Exists? %s\n", fat == NULL ? "No" : "Yes");
+    debug("File Exists? %s\n", fat == NULL ? "No" : "Yes");
     if (fat == NULL){
         fprintf(stderr, "File cannot be found so will not be deleted\n");
         return false;
@@ -346,14 +921,285 @@ bool mini_file_delete(FAT_FILESYSTEM *fs, const char *filename)
             return false;
         }
     }
+    //its blocks must stay while another mount reads them
+    if (mini_fat_share_has_writer(fs, fat->metadata_block_id) || mini_fat_share_has_reader(fs, fat->metadata_block_id)) {
+        fprintf(stderr, "File is open on another mount so will not be deleted\n");
+        return false;
+    }
     int block_ids_size =fat->block_ids.size();
-    printf("Block ID size: %d\n", block_ids_size);
+    debug("Block ID size: %d\n", block_ids_size);
     for (int i=0; i<block_ids_size; ++i) {
-        int block_id = fat->block_ids[i];
-        fs->block_map[block_id] = EMPTY_BLOCK;
+        fat_block_t block_id = fat->block_ids[i];
+        mini_fat_free_block(fs, block_id);
     }
+    //the entry block belongs to the file too
+    mini_fat_free_block(fs, fat->metadata_block_id);
     //use given function to delete file after emptying its content
     vector_delete_value(fs->files, fat);
+    fs->file_index.erase(fat->name);
+    file_forget(fat);
 
-    return true;
+    return share.save();
+}
+
+/// Public entry points: the calls above, recorded while a tracer runs.
+
+// A traced call on an open handle, started now.
+static FAT_TRACE_RECORD trace_begin(FAT_FILESYSTEM *fs, const uint16_t op, const FAT_OPEN_FILE * open_file, const fat_off_t size)
+{
+    FAT_TRACE_RECORD record = FAT_TRACE_RECORD();
+    record.op = op;
+    record.handle = open_file != NULL ? open_file->trace_id : 0;
+    record.offset = open_file != NULL ? open_file->position : 0;
+    record.size = size;
+    record.timestamp = mini_fat_trace_clock(fs);
+    return record;
+}
+
+FAT_OPEN_FILE * mini_file_open(FAT_FILESYSTEM *fs, const char *filename, const bool is_write)
+{
+    if (fs->tracer == NULL) return file_open(fs, filename, is_write, false);
+    FAT_TRACE_RECORD record = trace_begin(fs, FAT_TRACE_OPEN, NULL, is_write);
+    FAT_OPEN_FILE * open_file = file_open(fs, filename, is_write, false);
+    record.name = mini_fat_trace_name(fs, filename);
+    record.handle = mini_fat_trace_handle(fs);
+    record.result = open_file != NULL;
+    if (open_file != NULL) open_file->trace_id = record.handle;
+    mini_fat_trace_record(fs, record);
+    return open_file;
+}
+
+FAT_OPEN_FILE * mini_file_open_shared(FAT_FILESYSTEM *fs, const char *filename)
+{
+    if (fs->tracer == NULL) return file_open(fs, filename, true, true);
+    FAT_TRACE_RECORD record = trace_begin(fs, FAT_TRACE_OPEN_SHARED, NULL, 1);
+    FAT_OPEN_FILE * open_file = file_open(fs, filename, true, true);
+    record.name = mini_fat_trace_name(fs, filename);
+    record.handle = mini_fat_trace_handle(fs);
+    record.result = open_file != NULL;
+    if (open_file != NULL) open_file->trace_id = record.handle;
+    mini_fat_trace_record(fs, record);
+    return open_file;
+}
+
+bool mini_file_close(FAT_FILESYSTEM *fs, const FAT_OPEN_FILE * open_file)
+{
+    if (fs->tracer == NULL) return file_close(fs, open_file);
+    FAT_TRACE_RECORD record = trace_begin(fs, FAT_TRACE_CLOSE, open_file, 0);
+    record.result = file_close(fs, open_file);
+    mini_fat_trace_record(fs, record);
+    return record.result;
+}
+
+bool mini_file_seek(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t offset, const bool from_start)
+{
+    if (fs->tracer == NULL) return file_seek(fs, open_file, offset, from_start);
+    FAT_TRACE_RECORD record = trace_begin(fs, FAT_TRACE_SEEK, open_file, from_start);
+    record.offset = offset;
+    record.result = file_seek(fs, open_file, offset, from_start);
+    mini_fat_trace_record(fs, record);
+    return record.result;
+}
+
+bool mini_file_delete(FAT_FILESYSTEM *fs, const char *filename)
+{
+    if (fs->tracer == NULL) return file_delete(fs, filename);
+    FAT_TRACE_RECORD record = trace_begin(fs, FAT_TRACE_DELETE, NULL, 0);
+    record.result = file_delete(fs, filename);
+    record.name = mini_fat_trace_name(fs, filename);
+    mini_fat_trace_record(fs, record);
+    return record.result;
+}
+
+fat_off_t mini_file_read(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t size, void * buffer)
+{
+    if (fs->tracer == NULL) return file_read(fs, open_file, size, buffer);
+    FAT_TRACE_RECORD record = trace_begin(fs, FAT_TRACE_READ, open_file, size);
+    record.result = file_read(fs, open_file, size, buffer);
+    mini_fat_trace_record(fs, record);
+    return record.result;
+}
+
+fat_off_t mini_file_write(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t size, const void * buffer)
+{
+    if (fs->tracer == NULL) return file_write(fs, open_file, size, buffer);
+    FAT_TRACE_RECORD record = trace_begin(fs, FAT_TRACE_WRITE, open_file, size);
+    record.result = file_write(fs, open_file, size, buffer);
+    mini_fat_trace_record(fs, record);
+    return record.result;
+}
+
+
+// Order of the entries of a batch sorted by name; equal names stay in input
+// order, so the first occurrence of a duplicate is the one that is applied.
+static std::vector<int> batch_order(const char * const *names, const int count)
+{
+    std::vector<int> order(count);
+    for (int i = 0; i < count; i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [names](int a, int b) {
+        return strcmp(names[a], names[b]) < 0;
+    });
+    return order;
+}
+
+static bool batch_is_duplicate(const char * const *names, const std::vector<int> &order, const int k)
+{
+    return k > 0 && strcmp(names[order[k - 1]], names[order[k]]) == 0;
+}
+
+static bool batch_in_use(const FAT_FILESYSTEM *fs, const FAT_FILE *file)
+{
+    for (int i = 0; i < (int)file->open_handles.size(); i++) {
+        if (file->open_handles[i]->is_write) return true;
+    }
+    return mini_fat_share_has_writer(fs, file->metadata_block_id) || mini_fat_share_has_reader(fs, file->metadata_block_id);
+}
+
+/**
+ * Create many empty files at once. Names are sorted and deduplicated, entry
+ * blocks come from a single pass over the block map, starting in the next
+ * group like a single new file, the files are added to the namespace
+ * together and the filesystem is saved once. If the save fails, the files
+ * are taken out again.
+ * @param  results if not NULL, receives for each name whether it was created
+ * @return         number of files created
+ */
+int mini_file_batch_create(FAT_FILESYSTEM *fs, const char * const *names, const int count, bool *results)
+{
+    busy_scope busy(fs);
+    share_scope share(fs);
+    std::vector<int> order = batch_order(names, count);
+    std::vector<int> todo;
+    for (int k = 0; k < count; k++) {
+        int i = order[k];
+        if (results) results[i] = false;
+        if (strlen(names[i]) >= (size_t)MAX_FILENAME_LENGTH) {
+            fprintf(stderr, "Cannot create '%s': name is too long.\n", names[i]);
+        } else if (!batch_is_duplicate(names, order, k) && mini_file_find(fs, names[i]) == NULL) {
+            todo.push_back(i);
+        }
+    }
+
+    std::vector<fat_block_t> blocks;
+    int allocated = mini_fat_allocate_blocks(fs, FILE_ENTRY_BLOCK, todo.size(), mini_fat_next_group_goal(fs), blocks);
+    if (allocated < (int)todo.size()) {
+        fprintf(stderr, "Cannot create %d files: filesystem is full.\n", (int)todo.size() - allocated);
+    }
+    fs->files.reserve(fs->files.size() + allocated);
+    fs->file_index.reserve(fs->file_index.size() + allocated);
+    for (int k = 0; k < allocated; k++) {
+        FAT_FILE * file = mini_file_create(names[todo[k]]);
+        file->metadata_block_id = blocks[k];
+        fs->files.push_back(file);
+        fs->file_index[file->name] = file;
+    }
+    if (allocated > 0 && !mini_fat_save(fs)) {
+        //the new files are the last ones, and nobody has opened them yet
+        for (int k = 0; k < allocated; k++) {
+            FAT_FILE * file = fs->files.back();
+            fs->files.pop_back();
+            fs->file_index.erase(file->name);
+            mini_fat_set_block_type(fs, file->metadata_block_id, EMPTY_BLOCK);
+            delete file;
+        }
+        return 0;
+    }
+    for (int k = 0; results && k < allocated; k++) {
+        results[todo[k]] = true;
+    }
+    return allocated;
+}
+
+/**
+ * Delete many files at once. Files that do not exist, are open for
+ * writing or are open on another mount are skipped. The files are removed from the namespace in one
+ * pass and the filesystem is saved once.
+ * @param  results if not NULL, receives for each name whether it was deleted
+ * @return         number of files deleted
+ */
+int mini_file_batch_delete(FAT_FILESYSTEM *fs, const char * const *names, const int count, bool *results)
+{
+    busy_scope busy(fs);
+    share_scope share(fs);
+    std::vector<int> order = batch_order(names, count);
+    std::unordered_set<FAT_FILE*> doomed;
+    for (int k = 0; k < count; k++) {
+        int i = order[k];
+        if (results) results[i] = false;
+        if (batch_is_duplicate(names, order, k)) continue;
+        FAT_FILE * file = mini_file_find(fs, names[i]);
+        if (file == NULL || batch_in_use(fs, file)) {
+            fprintf(stderr, "Cannot delete '%s': it does not exist, is open for writing or is open on another mount.\n", names[i]);
+            continue;
+        }
+        for (int b = 0; b < (int)file->block_ids.size(); b++) {
+            mini_fat_free_block(fs, file->block_ids[b]);
+        }
+        mini_fat_free_block(fs, file->metadata_block_id);
+        fs->file_index.erase(file->name);
+        doomed.insert(file);
+        if (results) results[i] = true;
+    }
+    if (doomed.empty()) {
+        return 0;
+    }
+    fs->files.erase(std::remove_if(fs->files.begin(), fs->files.end(), [&doomed](FAT_FILE *file) {
+        return doomed.count(file) > 0;
+    }), fs->files.end());
+    for (std::unordered_set<FAT_FILE*>::iterator it = doomed.begin(); it != doomed.end(); ++it) {
+        file_forget(*it);
+    }
+    mini_fat_save(fs);
+    return doomed.size();
+}
+
+/**
+ * Rename many files at once, old_names[i] to new_names[i], in order of the
+ * old names. A rename is skipped if the old name does not exist or the new
+ * name is taken. Open handles stay valid. The filesystem is saved once.
+ * @param  results if not NULL, receives for each pair whether it was renamed
+ * @return         number of files renamed
+ */
+int mini_file_batch_rename(FAT_FILESYSTEM *fs, const char * const *old_names, const char * const *new_names, const int count, bool *results)
+{
+    busy_scope busy(fs);
+    share_scope share(fs);
+    std::vector<int> order = batch_order(old_names, count);
+    int renamed = 0;
+    for (int k = 0; k < count; k++) {
+        int i = order[k];
+        if (results) results[i] = false;
+        if (batch_is_duplicate(old_names, order, k)) continue;
+        FAT_FILE * file = mini_file_find(fs, old_names[i]);
+        if (file == NULL || strlen(new_names[i]) >= (size_t)MAX_FILENAME_LENGTH || mini_file_find(fs, new_names[i]) != NULL) {
+            fprintf(stderr, "Cannot rename '%s' to '%s'.\n", old_names[i], new_names[i]);
+            continue;
+        }
+        fs->file_index.erase(file->name);
+        strcpy(file->name, new_names[i]);
+        fs->file_index[file->name] = file;
+        if (results) results[i] = true;
+        renamed++;
+    }
+    if (renamed > 0) {
+        mini_fat_save(fs);
+    }
+    return renamed;
+}
+
+/**
+ * Look up the sizes of many files at once.
+ * @param  sizes receives for each name its size, or -1 if it does not exist
+ * @return       number of files found
+ */
+int mini_file_batch_stat(const FAT_FILESYSTEM *fs, const char * const *names, const int count, fat_off_t *sizes)
+{
+    share_read_scope reading(fs);
+    int found = 0;
+    for (int i = 0; i < count; i++) {
+        FAT_FILE * file = mini_file_find(fs, names[i]);
+        sizes[i] = file != NULL ? file->size : -1;
+        found += file != NULL;
+    }
+    return found;
 }
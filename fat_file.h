@@ -9,22 +9,54 @@ const int MAX_FILENAME_LENGTH = 256;
 // Feel free to modify the following structure.
 typedef struct t_FAT_OPEN_FILE {
 	FAT_FILE * file; // Pointers to FAT_FILE structure (the actual file).
-	int position; // Seek position.
+	fat_off_t position; // Seek position.
 	bool is_write;
+	bool is_shared; // Opened by mini_file_open_shared, see fat_lock.h.
+	uint32_t trace_id; // Handle number in the API trace, 0 if not traced.
 } FAT_OPEN_FILE;
 
 // Feel free to modify the following structure.
 typedef struct t_FAT_FILE {
 	char name[MAX_FILENAME_LENGTH];
-	int size;
-	int metadata_block_id; // The block index that holds the metadata of this file (entry block).
-	std::vector<int> block_ids; // Data blocks.
+	fat_off_t size;
+	fat_block_t metadata_block_id; // The block index that holds the metadata of this file (entry block).
+	std::vector<fat_block_t> block_ids; // Data blocks.
+	uint64_t block_changes = 0; // Bumped whenever block_ids changes, see file_write.
 
 	std::vector<const FAT_OPEN_FILE*> open_handles; // One entry each time this file is opened.
+	FAT_FILE_LOCKS * locks = NULL; // Byte-range locks, once a handle uses them.
+
+	fat_off_t size_hint = 0; // Expected size, see mini_file_size_hint.
+	// Reserved rest of the large block being filled, handed back at close.
+	fat_block_t run_next = 0, run_end = 0;
+	bool deleted = false; // Dropped from the filesystem while open, freed at its last close.
 } FAT_FILE;
 
 typedef struct t_FAT_FILESYSTEM FAT_FILESYSTEM; // Forward definition.
 
+// A read-only run of file bytes inside the mapped virtual disk.
+typedef struct t_FAT_SPAN {
+	const void * data;
+	fat_off_t size;
+} FAT_SPAN;
+
+// Result of a zero-copy read. Its blocks stay pinned until released.
+typedef struct t_FAT_READ_VIEW {
+	std::vector<FAT_SPAN> spans; // One span per physically contiguous run.
+	fat_off_t size; // Total bytes over all spans.
+	std::vector<fat_block_t> pinned_blocks;
+} FAT_READ_VIEW;
+
+
+// Per-block loops of read, write and read_view, compiled for one block
+// size (0: any block size). See mini_file_select_kernels.
+typedef struct t_FAT_FILE_KERNELS {
+	int block_size;
+	fat_off_t (*read)(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t size, void * buffer);
+	fat_off_t (*write)(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t size, const void * buffer);
+	void (*read_view)(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t size, const unsigned char * image, FAT_READ_VIEW * view);
+} FAT_FILE_KERNELS;
+
 
 /// Public APIs
 // DO NOT MODIFY THE FOLLOWING:
@@ -32,24 +64,40 @@ void mini_file_dump(const FAT_FILESYSTEM *fs, const FAT_FILE *file);
 FAT_OPEN_FILE * mini_file_open(FAT_FILESYSTEM *fs, const char *filename, const bool is_write);
 bool mini_file_close(FAT_FILESYSTEM *fs, const FAT_OPEN_FILE * open_file);
 
-bool mini_file_seek(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int offset, const bool from_start);
+bool mini_file_seek(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t offset, const bool from_start);
 bool mini_file_delete(FAT_FILESYSTEM *fs, const char *filename);
-int mini_file_size(FAT_FILESYSTEM *fs, const char *filename);
+fat_off_t mini_file_size(FAT_FILESYSTEM *fs, const char *filename);
+
+fat_off_t mini_file_read(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t size, void * buffer);
+fat_off_t mini_file_write(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t size, const void * buffer);
+
+// Expected final size of a file open for writing; files expected to reach
+// FAT_LARGE_FILE_BLOCKS blocks get large blocks from their first write.
+bool mini_file_size_hint(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t size);
+
+// Zero-copy reads:
+FAT_READ_VIEW * mini_file_read_view(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const fat_off_t size);
+bool mini_file_release_view(FAT_FILESYSTEM *fs, FAT_READ_VIEW * view);
 
-int mini_file_read(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int size, void * buffer);
-int mini_file_write(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int size, const void * buffer);
+// Batched metadata operations, each saves the filesystem once:
+int mini_file_batch_create(FAT_FILESYSTEM *fs, const char * const *names, const int count, bool *results);
+int mini_file_batch_delete(FAT_FILESYSTEM *fs, const char * const *names, const int count, bool *results);
+int mini_file_batch_rename(FAT_FILESYSTEM *fs, const char * const *old_names, const char * const *new_names, const int count, bool *results);
+int mini_file_batch_stat(const FAT_FILESYSTEM *fs, const char * const *names, const int count, fat_off_t *sizes);
 
 
 // Helpers (not mandatory):
 FAT_FILE * mini_file_create_file(FAT_FILESYSTEM *fs, const char *filename);
 FAT_FILE * mini_file_create(const char * filename);
+void mini_file_free(FAT_FILE *file);
 FAT_FILE * mini_file_find(const FAT_FILESYSTEM *fs, const char *filename);
+void mini_file_select_kernels(FAT_FILESYSTEM *fs);
 
-inline int position_to_block_index(const FAT_FILESYSTEM * fs, const int position)  {
-	return position / fs->block_size;
+inline fat_block_t position_to_block_index(const FAT_FILESYSTEM * fs, const fat_off_t position)  {
+	return fs->block_shift >= 0 ? position >> fs->block_shift : position / fs->block_size;
 }
-inline int position_to_byte_index(const FAT_FILESYSTEM * fs, const int position) {
-	return position % fs->block_size;
+inline int position_to_byte_index(const FAT_FILESYSTEM * fs, const fat_off_t position) {
+	return (int)(fs->block_shift >= 0 ? position & (fs->block_size - 1) : position % fs->block_size);
 }
 
 #endif // FAT_FILE_H
\ No newline at end of file
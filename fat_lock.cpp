@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+
+#include "fat.h"
+#include "fat_file.h"
+#include "fat_lock.h"
+
+// A locked byte range [begin, end) of one handle.
+typedef struct t_LOCK_RANGE {
+    const FAT_OPEN_FILE * owner;
+    fat_off_t begin;
+    fat_off_t end;
+    bool exclusive;
+} LOCK_RANGE;
+
+struct t_FAT_FILE_LOCKS {
+    std::mutex lock; // Guards ranges.
+    std::condition_variable released;
+    std::vector<LOCK_RANGE> ranges;
+    std::shared_mutex meta; // Exclusive to change block_ids and size, shared to use them.
+    fat_off_t reserved = 0;
+};
+
+// Guards attaching the locks of a file.
+static std::mutex attach_lock;
+
+/**
+ * Give file its lock state, if it has none yet. Files keep it while they
+ * exist.
+ */
+void mini_file_locks_attach(FAT_FILE *file) {
+    std::lock_guard<std::mutex> guard(attach_lock);
+    if (file->locks == NULL) {
+        FAT_FILE_LOCKS * l = new FAT_FILE_LOCKS;
+        l->reserved = file->size;
+        file->locks = l;
+    }
+}
+
+/**
+ * Free the lock state of a file that is going away.
+ */
+void mini_file_locks_free(FAT_FILE *file) {
+    delete file->locks;
+    file->locks = NULL;
+}
+
+static bool lock_conflicts(const FAT_FILE_LOCKS *l, const LOCK_RANGE &range) {
+    for (size_t i = 0; i < l->ranges.size(); i++) {
+        const LOCK_RANGE &held = l->ranges[i];
+        if (held.owner != range.owner && held.begin < range.end && range.begin < held.end
+                && (held.exclusive || range.exclusive)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Lock length bytes of the file of open_file from offset on.
+ * @param  wait wait for conflicting locks to go away instead of failing
+ * @return      false if the range is invalid, or taken and wait is false
+ */
+bool mini_file_lock(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int64_t offset, const int64_t length, const bool exclusive, const bool wait) {
+    if (offset < 0 || length < 0 || (length > 0 && offset > INT64_MAX - length)) {
+        fprintf(stderr, "Attempting to lock an invalid range.\n");
+        return false;
+    }
+    if (exclusive && !open_file->is_write) {
+        fprintf(stderr, "Attempting to lock a range exclusively with a handle opened in read mode.\n");
+        return false;
+    }
+    FAT_FILE * file = open_file->file;
+    mini_file_locks_attach(file);
+    FAT_FILE_LOCKS * l = file->locks;
+    LOCK_RANGE range = {open_file, offset, length == 0 ? INT64_MAX : offset + length, exclusive};
+    std::unique_lock<std::mutex> guard(l->lock);
+    while (lock_conflicts(l, range)) {
+        if (!wait) return false;
+        l->released.wait(guard);
+    }
+    l->ranges.push_back(range);
+    return true;
+}
+
+/**
+ * Release a lock taken with the same offset and length.
+ * @return false if open_file holds no such lock
+ */
+bool mini_file_unlock(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int64_t offset, const int64_t length) {
+    FAT_FILE_LOCKS * l = open_file->file->locks;
+    fat_off_t end = length == 0 ? INT64_MAX : offset + length;
+    if (l != NULL) {
+        std::lock_guard<std::mutex> guard(l->lock);
+        for (size_t i = 0; i < l->ranges.size(); i++) {
+            const LOCK_RANGE &held = l->ranges[i];
+            if (held.owner == open_file && held.begin == offset && held.end == end) {
+                l->ranges.erase(l->ranges.begin() + i);
+                l->released.notify_all();
+                return true;
+            }
+        }
+    }
+    fprintf(stderr, "Attempting to unlock a range that is not locked.\n");
+    return false;
+}
+
+/**
+ * Drop all locks of a handle that is being closed.
+ */
+void mini_file_locks_release(FAT_FILE *file, const FAT_OPEN_FILE * open_file) {
+    FAT_FILE_LOCKS * l = file->locks;
+    if (l == NULL) return;
+    std::lock_guard<std::mutex> guard(l->lock);
+    size_t kept = 0;
+    for (size_t i = 0; i < l->ranges.size(); i++) {
+        if (l->ranges[i].owner != open_file) l->ranges[kept++] = l->ranges[i];
+    }
+    if (kept < l->ranges.size()) {
+        l->ranges.resize(kept);
+        l->released.notify_all();
+    }
+}
+
+void mini_file_meta_lock(const FAT_FILE *file, const bool exclusive) {
+    if (exclusive) {
+        file->locks->meta.lock();
+    } else {
+        file->locks->meta.lock_shared();
+    }
+}
+
+void mini_file_meta_unlock(const FAT_FILE *file, const bool exclusive) {
+    if (exclusive) {
+        file->locks->meta.unlock();
+    } else {
+        file->locks->meta.unlock_shared();
+    }
+}
+
+int64_t mini_file_reserved(const FAT_FILE *file) {
+    return file->locks->reserved;
+}
+
+void mini_file_reserve(FAT_FILE *file, const int64_t end) {
+    if (end > file->locks->reserved) {
+        file->locks->reserved = end;
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef FAT_LOCK_H
+#define FAT_LOCK_H
+
+#include <stdint.h>
+
+typedef struct t_FAT_FILESYSTEM FAT_FILESYSTEM; // Forward definition.
+typedef struct t_FAT_FILE FAT_FILE; // See fat_file.h.
+typedef struct t_FAT_OPEN_FILE FAT_OPEN_FILE; // See fat_file.h.
+
+
+/// Byte-range locks.
+// mini_file_open_shared opens a file for writing in shared-write mode: any
+// number of such handles can write the file at once, but not next to a
+// handle from mini_file_open(..., true). A shared handle may seek past the
+// end of the file; the bytes it skips read as zeros. Writers of disjoint
+// ranges run in parallel: they hold the metadata lock of the file shared
+// while writing data, and only take it exclusive to grow or unshare the
+// block list and to raise the size. Shared writes are not
+// deduplicated. With direct I/O, partial blocks are written whole, so
+// writers should then use block-aligned ranges.
+// The locks are advisory, as with fcntl: handles lock the bytes from
+// offset on (length 0: up to any end of file) shared or exclusive, and
+// wait or fail if another handle holds an overlapping lock that conflicts.
+// Exclusive locks need a handle open for writing. unlock takes the same
+// range as lock; close releases all locks of the handle. There is no
+// deadlock detection.
+FAT_OPEN_FILE * mini_file_open_shared(FAT_FILESYSTEM *fs, const char *filename);
+bool mini_file_lock(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int64_t offset, const int64_t length, const bool exclusive, const bool wait);
+bool mini_file_unlock(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int64_t offset, const int64_t length);
+
+// Used by file operations. The metadata lock guards block_ids and size of
+// files with shared writers; reserved is the end of the bytes they have
+// blocks for, changed under the exclusive metadata lock.
+void mini_file_locks_attach(FAT_FILE *file);
+void mini_file_locks_free(FAT_FILE *file);
+void mini_file_locks_release(FAT_FILE *file, const FAT_OPEN_FILE * open_file);
+void mini_file_meta_lock(const FAT_FILE *file, const bool exclusive);
+void mini_file_meta_unlock(const FAT_FILE *file, const bool exclusive);
+int64_t mini_file_reserved(const FAT_FILE *file);
+void mini_file_reserve(FAT_FILE *file, const int64_t end);
+
+
+#endif // FAT_LOCK_H
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "fat.h"
+#include "fat_memory.h"
+
+// Locks guarding the copies of blocks during a snapshot, by block id.
+const int MEMORY_STRIPES = 64;
+// Blocks the snapshot thread copies per round, at most.
+const fat_block_t MEMORY_SNAPSHOT_BATCH = 256;
+
+struct t_FAT_MEMORY {
+    unsigned char * base = NULL; // Block 0.
+    size_t length = 0; // Mapped bytes, a multiple of FAT_MEMORY_HUGE_PAGE.
+    bool huge_pages = false;
+
+    // While a snapshot runs, saved[b] is set once the snapshot no longer
+    // needs block b in memory: it was free at the start, the snapshot
+    // thread copied it, or a writer preserved its old contents.
+    std::atomic<bool> active{false};
+    std::vector<std::atomic<uint8_t> > saved;
+    std::mutex stripes[MEMORY_STRIPES]; // Make copying a block and setting saved one step.
+    std::mutex preserved_lock; // Guards preserved.
+    std::unordered_map<fat_block_t, std::vector<unsigned char> > preserved;
+    std::thread worker;
+    bool ok = true; // Result of the last snapshot.
+
+    std::atomic<int64_t> snapshots{0};
+    std::atomic<int64_t> preserved_blocks{0};
+};
+
+bool mini_fat_is_memory_name(const char *filename) {
+    return strncmp(filename, FAT_MEMORY_PREFIX, strlen(FAT_MEMORY_PREFIX)) == 0;
+}
+
+/**
+ * Give fs zeroed block memory. Explicit huge pages only map if the host
+ * has enough of them reserved, so that is tried first.
+ * @return false if the memory cannot be allocated
+ */
+bool mini_fat_memory_attach(FAT_FILESYSTEM *fs) {
+    const size_t bytes = fs->block_count * fs->block_size;
+    const size_t length = (bytes + FAT_MEMORY_HUGE_PAGE - 1) / FAT_MEMORY_HUGE_PAGE * FAT_MEMORY_HUGE_PAGE;
+    bool huge_pages = true;
+    void * base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (base == MAP_FAILED) {
+        huge_pages = false;
+        base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            perror("Cannot allocate memory volume");
+            return false;
+        }
+        madvise(base, length, MADV_HUGEPAGE);
+    }
+    FAT_MEMORY * m = new FAT_MEMORY;
+    m->base = (unsigned char *)base;
+    m->length = length;
+    m->huge_pages = huge_pages;
+    m->saved = std::vector<std::atomic<uint8_t> >(fs->block_count);
+    fs->memory = m;
+    //read views point straight into the block memory
+    fs->image_map = m->base;
+    fs->image_map_size = bytes;
+    return true;
+}
+
+/**
+ * Copy the blocks of the image open at fd into the block memory. Bytes
+ * past the end of the image stay zero.
+ * @return false on a read error
+ */
+bool mini_fat_memory_fill(FAT_FILESYSTEM *fs, const int fd) {
+    const fat_off_t bytes = fs->block_count * fs->block_size;
+    fat_off_t done = 0;
+    while (done < bytes) {
+        fat_off_t read = pread(fd, fs->memory->base + done, bytes - done, done);
+        if (read <= 0) {
+            if (read == -1) {
+                perror("Cannot read virtual disk into memory");
+                return false;
+            }
+            break;
+        }
+        done += read;
+    }
+    return true;
+}
+
+int64_t mini_fat_memory_read(FAT_FILESYSTEM *fs, const int64_t offset, const int64_t size, void *buffer) {
+    memcpy(buffer, fs->memory->base + offset, size);
+    return size;
+}
+
+/**
+ * Copy the contents of a block the running snapshot has not saved yet
+ * aside, before it is overwritten.
+ */
+static void memory_preserve(FAT_FILESYSTEM *fs, FAT_MEMORY *m, const fat_block_t block_id) {
+    std::lock_guard<std::mutex> guard(m->stripes[block_id % MEMORY_STRIPES]);
+    if (m->saved[block_id].load(std::memory_order_relaxed)) {
+        return;
+    }
+    const unsigned char * block = m->base + block_id * fs->block_size;
+    std::vector<unsigned char> copy(block, block + fs->block_size);
+    {
+        std::lock_guard<std::mutex> preserved_guard(m->preserved_lock);
+        m->preserved[block_id].swap(copy);
+    }
+    m->preserved_blocks++;
+    m->saved[block_id].store(1, std::memory_order_release);
+}
+
+int64_t mini_fat_memory_write(FAT_FILESYSTEM *fs, const int64_t offset, const int64_t size, const void *buffer) {
+    FAT_MEMORY * m = fs->memory;
+    //snapshots only start while no file operation runs, so this cannot change during the write
+    if (size > 0 && m->active.load(std::memory_order_acquire)) {
+        fat_block_t last = (offset + size - 1) / fs->block_size;
+        for (fat_block_t b = offset / fs->block_size; b <= last; b++) {
+            if (!m->saved[b].load(std::memory_order_acquire)) {
+                memory_preserve(fs, m, b);
+            }
+        }
+    }
+    memcpy(m->base + offset, buffer, size);
+    return size;
+}
+
+static bool memory_write_all(const int fd, const unsigned char *data, const fat_off_t size, const fat_off_t offset) {
+    fat_off_t done = 0;
+    while (done < size) {
+        fat_off_t written = pwrite(fd, data + done, size - done, offset + done);
+        if (written <= 0) return false;
+        done += written;
+    }
+    return true;
+}
+
+/**
+ * Write the blocks of the snapshot in batches, then the blocks writers
+ * preserved meanwhile, then the file table and last the superblock.
+ */
+static void memory_snapshot_worker(FAT_FILESYSTEM *fs, FAT_MEMORY *m, const int fd, const std::vector<unsigned char> super,
+                                   const std::vector<unsigned char> table, const fat_off_t table_offset, const int64_t bytes_per_sec) {
+    const int block_size = fs->block_size;
+    //throttled, a round takes about a tenth of a second
+    const fat_block_t batch_blocks = bytes_per_sec > 0 ? std::max((fat_block_t)1, std::min(MEMORY_SNAPSHOT_BATCH, bytes_per_sec / 10 / block_size))
+                                                       : MEMORY_SNAPSHOT_BATCH;
+    std::vector<unsigned char> batch(batch_blocks * block_size);
+    std::chrono::steady_clock::time_point next_slot = std::chrono::steady_clock::now();
+    bool ok = true;
+    for (fat_block_t first = 0; first < fs->block_count && ok; first += batch_blocks) {
+        fat_block_t count = std::min(batch_blocks, fs->block_count - first);
+        fat_block_t run = -1; // First copied block of the current run in batch.
+        fat_off_t written = 0;
+        for (fat_block_t i = 0; i <= count && ok; i++) {
+            bool copied = false;
+            if (i < count) {
+                fat_block_t b = first + i;
+                std::lock_guard<std::mutex> guard(m->stripes[b % MEMORY_STRIPES]);
+                if (!m->saved[b].load(std::memory_order_relaxed)) {
+                    memcpy(&batch[i * block_size], m->base + b * block_size, block_size);
+                    m->saved[b].store(1, std::memory_order_release);
+                    copied = true;
+                }
+            }
+            if (copied && run == -1) {
+                run = i;
+            } else if (!copied && run != -1) {
+                //free blocks are skipped, they stay holes in the image
+                ok = memory_write_all(fd, &batch[run * block_size], (i - run) * block_size, (first + run) * block_size);
+                written += (i - run) * block_size;
+                run = -1;
+            }
+        }
+        if (bytes_per_sec > 0 && written > 0) {
+            next_slot += std::chrono::microseconds(written * 1000000 / bytes_per_sec);
+            std::this_thread::sleep_until(next_slot);
+        }
+    }
+
+    //every block is saved now, so writers add no more copies
+    std::unordered_map<fat_block_t, std::vector<unsigned char> > preserved;
+    {
+        std::lock_guard<std::mutex> guard(m->preserved_lock);
+        preserved.swap(m->preserved);
+    }
+    for (std::unordered_map<fat_block_t, std::vector<unsigned char> >::iterator it = preserved.begin(); it != preserved.end() && ok; ++it) {
+        ok = memory_write_all(fd, it->second.data(), block_size, it->first * block_size);
+    }
+    ok = ok && memory_write_all(fd, table.data(), table.size(), table_offset)
+            && memory_write_all(fd, super.data(), super.size(), 0) && fdatasync(fd) == 0;
+    if (!ok) {
+        perror("Cannot write snapshot");
+    }
+    close(fd);
+    m->ok = ok;
+    if (ok) {
+        m->snapshots++;
+    }
+    m->active.store(false, std::memory_order_release);
+}
+
+/**
+ * Start writing a snapshot of memory volume fs to the image filename.
+ * Waits for a running snapshot to finish first.
+ * @return false if fs is not a memory volume or filename cannot be created
+ */
+bool mini_fat_memory_snapshot(FAT_FILESYSTEM *fs, const char *filename, const int64_t bytes_per_sec) {
+    FAT_MEMORY * m = fs->memory;
+    if (m == NULL) {
+        fprintf(stderr, "Snapshots are only available on memory volumes.\n");
+        return false;
+    }
+    mini_fat_memory_wait(fs);
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("Cannot create snapshot image");
+        return false;
+    }
+    std::vector<unsigned char> super, table;
+    mini_fat_pause(fs);
+    fat_off_t table_offset = mini_fat_serialize(fs, super, table);
+    for (fat_block_t b = 0; b < fs->block_count; b++) {
+        m->saved[b].store(fs->block_map[b] == EMPTY_BLOCK || fs->block_map[b] == RESERVED_BLOCK, std::memory_order_relaxed);
+    }
+    m->active.store(true, std::memory_order_release);
+    mini_fat_resume(fs);
+    m->worker = std::thread(memory_snapshot_worker, fs, m, fd, std::move(super), std::move(table), table_offset, bytes_per_sec);
+    return true;
+}
+
+/**
+ * Wait for the running snapshot, if any, to be written.
+ * @return false if fs is not a memory volume or the last snapshot failed
+ */
+bool mini_fat_memory_wait(FAT_FILESYSTEM *fs) {
+    FAT_MEMORY * m = fs->memory;
+    if (m == NULL) {
+        return false;
+    }
+    if (m->worker.joinable()) {
+        m->worker.join();
+    }
+    return m->ok;
+}
+
+/**
+ * Wait for the running snapshot, then give the block memory back.
+ */
+void mini_fat_memory_detach(FAT_FILESYSTEM *fs) {
+    FAT_MEMORY * m = fs->memory;
+    if (m == NULL) {
+        return;
+    }
+    mini_fat_memory_wait(fs);
+    munmap(m->base, m->length);
+    fs->memory = NULL;
+    fs->image_map = NULL;
+    fs->image_map_size = 0;
+    delete m;
+}
+
+FAT_MEMORY_STATS mini_fat_memory_stats(const FAT_FILESYSTEM *fs) {
+    FAT_MEMORY_STATS stats = FAT_MEMORY_STATS();
+    FAT_MEMORY * m = fs->memory;
+    if (m != NULL) {
+        stats.bytes = m->length;
+        stats.huge_pages = m->huge_pages;
+        stats.snapshot_running = m->active;
+        stats.snapshots = m->snapshots;
+        stats.preserved = m->preserved_blocks;
+    }
+    return stats;
+}
@@ -0,0 +1,54 @@
+#ifndef FAT_MEMORY_H
+#define FAT_MEMORY_H
+
+#include <stdint.h>
+
+typedef struct t_FAT_FILESYSTEM FAT_FILESYSTEM; // Forward definition.
+
+// Image names starting with this select a memory volume, see below.
+const char FAT_MEMORY_PREFIX[] = "mem:";
+// Block memory is allocated in multiples of this, the huge page size.
+const int64_t FAT_MEMORY_HUGE_PAGE = 2 << 20;
+
+typedef struct t_FAT_MEMORY_STATS {
+	int64_t bytes; // Of block memory.
+	bool huge_pages; // Explicit huge pages; else the host may use transparent ones.
+	bool snapshot_running;
+	int64_t snapshots; // Finished snapshots.
+	int64_t preserved; // Blocks copied aside because they were written during a snapshot.
+} FAT_MEMORY_STATS;
+
+
+/// Memory volumes.
+// mini_fat_create("mem:<name>", ...) creates a volume whose blocks live in
+// anonymous memory instead of an image file, and mini_fat_load("mem:<path>")
+// reads the image at path into such a volume once. The block helpers copy
+// with memcpy, read views point straight into the memory, and nothing
+// touches the host file system afterwards: mini_fat_save keeps the table
+// in memory. The memory comes from huge pages if the host has some
+// reserved, else from normal pages advised for transparent huge pages.
+// mini_fat_memory_snapshot writes a loadable image of the volume to
+// filename from a background thread, throttled to bytes_per_sec (0: no
+// limit). It waits for running file operations to finish and takes the
+// file table, then lets writers go on: a block written before the
+// snapshot thread has copied it is first copied aside, so the image shows
+// the volume at the start of the snapshot. One snapshot runs at a time.
+// Direct I/O, shared mounts, fast tiers and the trimmer are not available
+// on memory volumes.
+bool mini_fat_memory_snapshot(FAT_FILESYSTEM *fs, const char *filename, const int64_t bytes_per_sec);
+bool mini_fat_memory_wait(FAT_FILESYSTEM *fs);
+FAT_MEMORY_STATS mini_fat_memory_stats(const FAT_FILESYSTEM *fs);
+
+// Used by create and load:
+bool mini_fat_is_memory_name(const char *filename);
+bool mini_fat_memory_attach(FAT_FILESYSTEM *fs);
+bool mini_fat_memory_fill(FAT_FILESYSTEM *fs, const int fd);
+// Used by mini_fat_destroy:
+void mini_fat_memory_detach(FAT_FILESYSTEM *fs);
+
+// Used by the block helpers:
+int64_t mini_fat_memory_read(FAT_FILESYSTEM *fs, const int64_t offset, const int64_t size, void *buffer);
+int64_t mini_fat_memory_write(FAT_FILESYSTEM *fs, const int64_t offset, const int64_t size, const void *buffer);
+
+
+#endif // FAT_MEMORY_H
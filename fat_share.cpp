@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <shared_mutex>
+#include <string>
+
+#include "fat.h"
+#include "fat_share.h"
+
+const uint64_t SHARE_MAGIC = 0x5248534f4e494d32ULL; // Set once the segment is initialized.
+
+// Mounts attached to the segment; mount 0 marks a free slot.
+const int SHARE_MAX_MOUNTS = 64;
+
+typedef struct t_SHARE_MOUNT {
+    int32_t pid;
+    uint32_t mount;
+} SHARE_MOUNT;
+
+// A handle of a file open on some mount. entry_block 0 marks a free slot,
+// block 0 is never an entry block.
+typedef struct t_SHARE_HANDLE {
+    int32_t pid;
+    uint32_t mount;
+    int64_t entry_block;
+} SHARE_HANDLE;
+
+// Layout of the shared-memory segment, the same in every mount.
+typedef struct t_SHARE_STATE {
+    uint64_t magic;
+    pthread_mutex_t lock; // Robust, process-shared and recursive.
+    uint64_t generation; // Bumped by every save of the file table.
+    uint32_t next_mount;
+    SHARE_MOUNT mounts[SHARE_MAX_MOUNTS]; // The last one to leave removes the segment.
+    SHARE_HANDLE writers[FAT_SHARE_MAX_WRITERS];
+    SHARE_HANDLE readers[FAT_SHARE_MAX_READERS]; // One per read handle.
+} SHARE_STATE;
+
+struct t_FAT_SHARE {
+    SHARE_STATE * state = NULL;
+    std::string name; // Of the segment, for shm_unlink.
+    uint32_t mount = 0; // Number of this mount, for its writer slots.
+    uint64_t generation = 0; // Of the table this mount loaded or saved last.
+    std::shared_mutex reload; // Shared by reads on this mount, exclusive while it reloads the table.
+};
+
+static void share_lock(FAT_SHARE *s) {
+    int rc = pthread_mutex_lock(&s->state->lock);
+    if (rc == EOWNERDEAD) {
+        //the owner died in the middle of a change: take over and reload the table
+        pthread_mutex_consistent(&s->state->lock);
+        s->generation = 0;
+    }
+}
+
+static void share_unlock(FAT_SHARE *s) {
+    pthread_mutex_unlock(&s->state->lock);
+}
+
+// Slots of processes that died without unmounting count as free.
+static bool share_alive(const int32_t pid) {
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+/**
+ * Reload the table if another mount saved it since this mount last saw it.
+ * The caller holds the lock.
+ * @return false if the table cannot be read
+ */
+static bool share_sync(FAT_FILESYSTEM *fs, FAT_SHARE *s) {
+    if (s->generation == s->state->generation) {
+        return true;
+    }
+    {
+        std::unique_lock<std::shared_mutex> guard(s->reload);
+        if (!mini_fat_reload(fs)) {
+            return false;
+        }
+    }
+    s->generation = s->state->generation;
+    return true;
+}
+
+void mini_fat_share_read_begin(const FAT_FILESYSTEM *fs) {
+    if (fs->share != NULL) fs->share->reload.lock_shared();
+}
+
+void mini_fat_share_read_end(const FAT_FILESYSTEM *fs) {
+    if (fs->share != NULL) fs->share->reload.unlock_shared();
+}
+
+/**
+ * Attach fs to the shared segment of its image, creating it if this is the
+ * first mount. The image must be saved: the mount reloads it.
+ * @return false if the segment cannot be set up or the image not read
+ */
+bool mini_fat_share_mount(FAT_FILESYSTEM *fs) {
+    if (fs->share != NULL) {
+        return true;
+    }
+    if (fs->trimmer != NULL) {
+        fprintf(stderr, "Cannot share a mount while the trimmer runs.\n");
+        return false;
+    }
+    if (fs->memory != NULL) {
+        fprintf(stderr, "Cannot share a memory volume.\n");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fs->image_fd, &st) != 0) {
+        perror("Cannot share virtual disk");
+        return false;
+    }
+    FAT_SHARE * s = new FAT_SHARE;
+    char name[64];
+    snprintf(name, sizeof(name), "/minifs-%llx-%llx", (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+    s->name = name;
+
+    //the image lock orders creating, initializing and removing the segment
+    flock(fs->image_fd, LOCK_EX);
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    void * map = MAP_FAILED;
+    if (fd != -1) {
+        struct stat shm;
+        if (fstat(fd, &shm) == 0 && (shm.st_size >= (off_t)sizeof(SHARE_STATE) || ftruncate(fd, sizeof(SHARE_STATE)) == 0)) {
+            map = mmap(NULL, sizeof(SHARE_STATE), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+    }
+    if (map == MAP_FAILED) {
+        perror("Cannot set up shared mount");
+        flock(fs->image_fd, LOCK_UN);
+        delete s;
+        return false;
+    }
+    s->state = (SHARE_STATE *)map;
+    if (s->state->magic != SHARE_MAGIC) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&s->state->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        s->state->generation = 1;
+        s->state->magic = SHARE_MAGIC;
+    }
+    share_lock(s);
+    int slot = -1;
+    for (int i = 0; i < SHARE_MAX_MOUNTS && slot == -1; i++) {
+        const SHARE_MOUNT &mount = s->state->mounts[i];
+        if (mount.mount == 0 || !share_alive(mount.pid)) slot = i;
+    }
+    if (slot != -1) {
+        s->mount = ++s->state->next_mount;
+        s->state->mounts[slot].pid = getpid();
+        s->state->mounts[slot].mount = s->mount;
+    }
+    share_unlock(s);
+    flock(fs->image_fd, LOCK_UN);
+    if (slot == -1) {
+        fprintf(stderr, "Cannot share a virtual disk among more than %d mounts.\n", SHARE_MAX_MOUNTS);
+        munmap(s->state, sizeof(SHARE_STATE));
+        delete s;
+        return false;
+    }
+
+    fs->share = s;
+    if (!mini_fat_share_refresh(fs)) {
+        mini_fat_share_unmount(fs);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Detach fs from the shared segment and give up its writer slots. No file
+ * operation may be running.
+ */
+void mini_fat_share_unmount(FAT_FILESYSTEM *fs) {
+    FAT_SHARE * s = fs->share;
+    if (s == NULL) {
+        return;
+    }
+    flock(fs->image_fd, LOCK_EX);
+    share_lock(s);
+    for (int i = 0; i < FAT_SHARE_MAX_WRITERS; i++) {
+        if (s->state->writers[i].mount == s->mount) {
+            s->state->writers[i] = SHARE_HANDLE();
+        }
+    }
+    for (int i = 0; i < FAT_SHARE_MAX_READERS; i++) {
+        if (s->state->readers[i].mount == s->mount) {
+            s->state->readers[i] = SHARE_HANDLE();
+        }
+    }
+    bool last = true;
+    for (int i = 0; i < SHARE_MAX_MOUNTS; i++) {
+        SHARE_MOUNT &mount = s->state->mounts[i];
+        if (mount.mount == s->mount) {
+            mount = SHARE_MOUNT();
+        } else if (mount.mount != 0 && share_alive(mount.pid)) {
+            last = false;
+        }
+    }
+    share_unlock(s);
+    if (last) {
+        shm_unlink(s->name.c_str());
+    }
+    flock(fs->image_fd, LOCK_UN);
+    munmap(s->state, sizeof(SHARE_STATE));
+    fs->share = NULL;
+    delete s;
+}
+
+/**
+ * Pick up the changes other mounts saved, without changing anything.
+ * @return false if the table cannot be read
+ */
+bool mini_fat_share_refresh(FAT_FILESYSTEM *fs) {
+    FAT_SHARE * s = fs->share;
+    if (s == NULL) {
+        return true;
+    }
+    share_lock(s);
+    bool ok = share_sync(fs, s);
+    share_unlock(s);
+    return ok;
+}
+
+uint64_t mini_fat_share_begin(FAT_FILESYSTEM *fs) {
+    FAT_SHARE * s = fs->share;
+    share_lock(s);
+    if (!share_sync(fs, s)) {
+        fprintf(stderr, "Cannot reload the file table of the shared mount.\n");
+    }
+    return s->generation;
+}
+
+/**
+ * Save a change made since begin returned token, with the lock still held.
+ * @return false if the save failed
+ */
+bool mini_fat_share_save(FAT_FILESYSTEM *fs, const uint64_t token) {
+    if (fs->share->generation != token) {
+        return true;
+    }
+    return mini_fat_save(fs);
+}
+
+void mini_fat_share_end(FAT_FILESYSTEM *fs) {
+    share_unlock(fs->share);
+}
+
+// Take a free slot of handles for entry_block. The caller holds the lock.
+static bool share_claim(FAT_SHARE *s, SHARE_HANDLE *handles, const int count, const int64_t entry_block) {
+    for (int i = 0; i < count; i++) {
+        SHARE_HANDLE &handle = handles[i];
+        if (handle.entry_block == 0 || !share_alive(handle.pid)) {
+            handle.pid = getpid();
+            handle.mount = s->mount;
+            handle.entry_block = entry_block;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void share_release(FAT_SHARE *s, SHARE_HANDLE *handles, const int count, const int64_t entry_block) {
+    for (int i = 0; i < count; i++) {
+        if (handles[i].mount == s->mount && handles[i].entry_block == entry_block) {
+            handles[i] = SHARE_HANDLE();
+            break;
+        }
+    }
+}
+
+// Whether a live process has the file open on another mount. The caller holds the lock.
+static bool share_find(const FAT_SHARE *s, const SHARE_HANDLE *handles, const int count, const int64_t entry_block) {
+    for (int i = 0; i < count; i++) {
+        if (handles[i].entry_block == entry_block && handles[i].mount != s->mount && share_alive(handles[i].pid)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Record that this mount opened a file for writing.
+ * @return false if another mount writes it or all slots are taken
+ */
+bool mini_fat_share_claim_writer(FAT_FILESYSTEM *fs, const int64_t entry_block) {
+    FAT_SHARE * s = fs->share;
+    share_lock(s);
+    bool taken = share_find(s, s->state->writers, FAT_SHARE_MAX_WRITERS, entry_block);
+    bool claimed = !taken && share_claim(s, s->state->writers, FAT_SHARE_MAX_WRITERS, entry_block);
+    share_unlock(s);
+    if (!taken && !claimed) {
+        fprintf(stderr, "Cannot open more than %d files for writing on a shared mount.\n", FAT_SHARE_MAX_WRITERS);
+    }
+    return claimed;
+}
+
+void mini_fat_share_release_writer(FAT_FILESYSTEM *fs, const int64_t entry_block) {
+    FAT_SHARE * s = fs->share;
+    share_lock(s);
+    share_release(s, s->state->writers, FAT_SHARE_MAX_WRITERS, entry_block);
+    share_unlock(s);
+}
+
+/**
+ * @return true if a live process writes the file on another mount
+ */
+bool mini_fat_share_has_writer(const FAT_FILESYSTEM *fs, const int64_t entry_block) {
+    FAT_SHARE * s = fs->share;
+    if (s == NULL) {
+        return false;
+    }
+    share_lock(s);
+    bool found = share_find(s, s->state->writers, FAT_SHARE_MAX_WRITERS, entry_block);
+    share_unlock(s);
+    return found;
+}
+
+/**
+ * Record that this mount opened a file for reading, so that no other
+ * mount deletes it before the handle is closed.
+ * @return false if all slots are taken
+ */
+bool mini_fat_share_claim_reader(FAT_FILESYSTEM *fs, const int64_t entry_block) {
+    FAT_SHARE * s = fs->share;
+    share_lock(s);
+    bool claimed = share_claim(s, s->state->readers, FAT_SHARE_MAX_READERS, entry_block);
+    share_unlock(s);
+    if (!claimed) {
+        fprintf(stderr, "Cannot open more than %d files for reading on a shared mount.\n", FAT_SHARE_MAX_READERS);
+    }
+    return claimed;
+}
+
+void mini_fat_share_release_reader(FAT_FILESYSTEM *fs, const int64_t entry_block) {
+    FAT_SHARE * s = fs->share;
+    share_lock(s);
+    share_release(s, s->state->readers, FAT_SHARE_MAX_READERS, entry_block);
+    share_unlock(s);
+}
+
+/**
+ * @return true if a live process reads the file on another mount
+ */
+bool mini_fat_share_has_reader(const FAT_FILESYSTEM *fs, const int64_t entry_block) {
+    FAT_SHARE * s = fs->share;
+    if (s == NULL) {
+        return false;
+    }
+    share_lock(s);
+    bool found = share_find(s, s->state->readers, FAT_SHARE_MAX_READERS, entry_block);
+    share_unlock(s);
+    return found;
+}
+
+void mini_fat_share_lock(const FAT_FILESYSTEM *fs) {
+    share_lock(fs->share);
+}
+
+/**
+ * Release the lock taken for a save, and tell the other mounts about it.
+ */
+void mini_fat_share_unlock(const FAT_FILESYSTEM *fs, const bool saved) {
+    FAT_SHARE * s = fs->share;
+    if (saved) {
+        s->generation = ++s->state->generation;
+    }
+    share_unlock(s);
+}
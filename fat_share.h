@@ -0,0 +1,54 @@
+#ifndef FAT_SHARE_H
+#define FAT_SHARE_H
+
+#include <stdint.h>
+
+typedef struct t_FAT_FILESYSTEM FAT_FILESYSTEM; // Forward definition.
+
+// Files open for writing over all mounts of one image.
+const int FAT_SHARE_MAX_WRITERS = 256;
+// Read handles over all mounts of one image.
+const int FAT_SHARE_MAX_READERS = 1024;
+
+
+/// Shared mounts.
+// Several processes (or several loads in one process) can mount the same
+// image at once. The mounts share a small shared-memory segment named
+// after the image's device and inode. It holds a robust, process-shared
+// mutex, a generation count of the saved file table, and the files open
+// on each mount. Every call that changes metadata (open, write, close,
+// delete, batch calls, bulk import) holds the mutex, first reloads the
+// table if another mount saved it, and saves it if the call changed it;
+// a write within the blocks a file already has changes nothing. A mount sees
+// changes from the others at its next such call, e.g. at open. Reads
+// only wait for this mount's own reloads. Only one handle over all mounts may write a file, and a
+// file cannot be deleted while another mount has it open. If a process
+// dies holding the mutex, the next one takes it over and reloads the
+// table. The trimmer and read view pins only work within one process,
+// so the trimmer cannot run on a shared mount.
+bool mini_fat_share_mount(FAT_FILESYSTEM *fs);
+void mini_fat_share_unmount(FAT_FILESYSTEM *fs);
+bool mini_fat_share_refresh(FAT_FILESYSTEM *fs);
+
+// Used by file operations; begin returns the token that save takes. save
+// writes the table unless it was saved since begin, end releases the lock.
+uint64_t mini_fat_share_begin(FAT_FILESYSTEM *fs);
+bool mini_fat_share_save(FAT_FILESYSTEM *fs, const uint64_t token);
+void mini_fat_share_end(FAT_FILESYSTEM *fs);
+bool mini_fat_share_claim_writer(FAT_FILESYSTEM *fs, const int64_t entry_block);
+void mini_fat_share_release_writer(FAT_FILESYSTEM *fs, const int64_t entry_block);
+bool mini_fat_share_has_writer(const FAT_FILESYSTEM *fs, const int64_t entry_block);
+bool mini_fat_share_claim_reader(FAT_FILESYSTEM *fs, const int64_t entry_block);
+void mini_fat_share_release_reader(FAT_FILESYSTEM *fs, const int64_t entry_block);
+bool mini_fat_share_has_reader(const FAT_FILESYSTEM *fs, const int64_t entry_block);
+// Reads of file metadata and data run between these, so a reload does not
+// change the files under them. Nothing on a private mount.
+void mini_fat_share_read_begin(const FAT_FILESYSTEM *fs);
+void mini_fat_share_read_end(const FAT_FILESYSTEM *fs);
+
+// Used by mini_fat_save:
+void mini_fat_share_lock(const FAT_FILESYSTEM *fs);
+void mini_fat_share_unlock(const FAT_FILESYSTEM *fs, const bool saved);
+
+
+#endif // FAT_SHARE_H
@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "fat.h"
+#include "fat_file.h"
+#include "fat_tier.h"
+#include "fat_dedup.h"
+
+struct t_FAT_TIER {
+    std::string filename; // Of the fast tier image.
+    std::vector<std::atomic<uint8_t> > heat; // Reads per block, saturating, halved every round.
+    std::mutex worker_lock;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread worker;
+    std::atomic<int64_t> promoted{0};
+    std::atomic<int64_t> demoted{0};
+    std::atomic<int64_t> rounds{0};
+};
+
+static void tier_init(FAT_FILESYSTEM *fs, const int fd, const char *fast_filename, const fat_block_t boundary) {
+    FAT_TIER * t = new FAT_TIER;
+    t->filename = fast_filename;
+    t->heat = std::vector<std::atomic<uint8_t> >(fs->block_count);
+    fs->tier_fd = fd;
+    fs->tier_boundary = boundary;
+    fs->tier = t;
+}
+
+/**
+ * Add a fast tier of fast_blocks blocks to fs, in a new (sparse) image.
+ * @return false if fs already has one, is in memory, uses direct I/O or is
+ *         mapped for read views, or the image cannot be created
+ */
+bool mini_fat_tier_attach(FAT_FILESYSTEM *fs, const char *fast_filename, const int64_t fast_blocks) {
+    if (fs->tier != NULL || fast_blocks < 1) {
+        fprintf(stderr, "Cannot add a fast tier: the volume has one already, or it is empty.\n");
+        return false;
+    }
+    if (fs->memory != NULL) {
+        fprintf(stderr, "Cannot add a fast tier to a memory volume.\n");
+        return false;
+    }
+    if (fs->direct != NULL || fs->image_map != NULL) {
+        fprintf(stderr, "Cannot add a fast tier to a volume with direct I/O or read views.\n");
+        return false;
+    }
+    int fd = open(fast_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, fast_blocks * fs->block_size) != 0) {
+        perror("Cannot create fast tier image");
+        if (fd != -1) close(fd);
+        return false;
+    }
+    fat_block_t boundary = fs->block_count;
+    fs->block_count += fast_blocks;
+    fs->block_map.resize(fs->block_count, EMPTY_BLOCK);
+    tier_init(fs, fd, fast_filename, boundary);
+    mini_fat_build_groups(fs);
+    return true;
+}
+
+/**
+ * Reopen the fast tier image of a loaded volume; its blocks start at
+ * boundary.
+ * @return false if the image is missing or too short
+ */
+bool mini_fat_tier_open(FAT_FILESYSTEM *fs, const char *fast_filename, const int64_t boundary) {
+    int fd = open(fast_filename, O_RDWR);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0 || st.st_size < (fs->block_count - boundary) * fs->block_size) {
+        fprintf(stderr, "Cannot open fast tier image '%s'.\n", fast_filename);
+        if (fd != -1) close(fd);
+        return false;
+    }
+    tier_init(fs, fd, fast_filename, boundary);
+    return true;
+}
+
+/**
+ * Stop the migrator and close the fast tier image.
+ */
+void mini_fat_tier_close(FAT_FILESYSTEM *fs) {
+    FAT_TIER * t = fs->tier;
+    if (t == NULL) return;
+    mini_fat_tier_stop(fs);
+    close(fs->tier_fd);
+    fs->tier_fd = -1;
+    fs->tier = NULL;
+    delete t;
+}
+
+const char * mini_fat_tier_filename(const FAT_FILESYSTEM *fs) {
+    return fs->tier != NULL ? fs->tier->filename.c_str() : NULL;
+}
+
+void mini_fat_tier_touch(const FAT_FILESYSTEM *fs, const int64_t block_id) {
+    std::atomic<uint8_t> &heat = fs->tier->heat[block_id];
+    uint8_t value = heat.load(std::memory_order_relaxed);
+    if (value < 255) {
+        heat.store(value + 1, std::memory_order_relaxed);
+    }
+}
+
+// Where a block is referenced from, for the blocks a round wants to move.
+typedef struct t_TIER_OWNER {
+    FAT_FILE * file; // NULL if several files share the block.
+    size_t index;
+} TIER_OWNER;
+
+/**
+ * Call visit(group, b) for the blocks [begin, end) in order, holding the
+ * lock of the allocation group of each, until it returns true.
+ * @return true if visit stopped the scan
+ */
+template<typename VISIT>
+static bool tier_scan(FAT_FILESYSTEM *fs, const fat_block_t begin, const fat_block_t end, VISIT visit) {
+    for (fat_block_t b = begin; b < end; ) {
+        FAT_ALLOC_GROUP * group = fs->groups[b / fs->group_blocks];
+        std::lock_guard<std::mutex> guard(group->lock);
+        for (const fat_block_t stop = std::min(end, group->end); b < stop; b++) {
+            if (visit(group, b)) return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Take the first empty block of one tier at or after goal, wrapping around
+ * to the start of the tier. Allocation groups may straddle the boundary,
+ * so this does not go through mini_fat_allocate_block_near.
+ * @return block id, -1 if the tier is full
+ */
+static fat_block_t tier_take(FAT_FILESYSTEM *fs, const bool fast, const fat_block_t goal) {
+    const fat_block_t begin = fast ? fs->tier_boundary : 1;
+    const fat_block_t end = fast ? fs->block_count : fs->tier_boundary;
+    const fat_block_t start = goal >= begin && goal < end ? goal : begin;
+    fat_block_t taken = -1;
+    auto take = [fs, &taken](FAT_ALLOC_GROUP *group, const fat_block_t b) {
+        if (fs->block_map[b] != EMPTY_BLOCK) return false;
+        fs->block_map[b] = FILE_DATA_BLOCK;
+        group->free_blocks--;
+        taken = b;
+        return true;
+    };
+    if (!tier_scan(fs, start, end, take)) {
+        tier_scan(fs, begin, start, take);
+    }
+    return taken;
+}
+
+/**
+ * Move one block of a file to a free block of the fast or capacity tier.
+ * goal is updated to the block after the new one, so moved blocks stay
+ * together.
+ * @return false if the target tier is full
+ */
+static bool tier_move(FAT_FILESYSTEM *fs, FAT_TIER *t, const fat_block_t block_id, const TIER_OWNER &owner,
+                      const bool to_fast, fat_block_t &goal, std::vector<char> &copy) {
+    fat_block_t new_block = tier_take(fs, to_fast, goal);
+    if (new_block == -1) {
+        return false;
+    }
+    if (mini_fat_read_in_block(fs, block_id, 0, fs->block_size, copy.data()) != fs->block_size
+            || mini_fat_write_in_block(fs, new_block, 0, fs->block_size, copy.data()) != fs->block_size) {
+        mini_fat_set_block_type(fs, new_block, EMPTY_BLOCK);
+        return false;
+    }
+    owner.file->block_ids[owner.index] = new_block;
+    owner.file->block_changes++;
+    t->heat[new_block].store(t->heat[block_id].load());
+    t->heat[block_id].store(0);
+    //a block of one reference may still be indexed, and the index follows it
+    mini_fat_dedup_move(fs, block_id, new_block);
+    mini_fat_free_block(fs, block_id);
+    goal = new_block + 1;
+    return true;
+}
+
+/**
+ * Run one migration round now: promote the hottest capacity tier blocks,
+ * demote the coldest fast tier blocks to make room, then halve the counts.
+ * @return blocks moved
+ */
+int64_t mini_fat_tier_migrate(FAT_FILESYSTEM *fs) {
+    FAT_TIER * t = fs->tier;
+    if (t == NULL) return 0;
+    mini_fat_pause(fs);
+    const fat_block_t boundary = fs->tier_boundary;
+
+    std::vector<fat_block_t> hot, cold;
+    tier_scan(fs, 1, boundary, [fs, t, &hot](FAT_ALLOC_GROUP *, const fat_block_t b) {
+        if (fs->block_map[b] == FILE_DATA_BLOCK && t->heat[b] >= FAT_TIER_PROMOTE_HEAT) hot.push_back(b);
+        return false;
+    });
+    std::sort(hot.begin(), hot.end(), [t](fat_block_t a, fat_block_t b) { return t->heat[a] > t->heat[b]; });
+    if (hot.size() > (size_t)FAT_TIER_MOVE_BATCH) hot.resize(FAT_TIER_MOVE_BATCH);
+
+    fat_block_t free_fast = 0;
+    tier_scan(fs, boundary, fs->block_count, [fs, &free_fast](FAT_ALLOC_GROUP *, const fat_block_t b) {
+        free_fast += fs->block_map[b] == EMPTY_BLOCK;
+        return false;
+    });
+    fat_block_t need = (fat_block_t)hot.size() + (fs->block_count - boundary) / 8 - free_fast;
+    if (need > 0) {
+        tier_scan(fs, boundary, fs->block_count, [fs, t, &cold](FAT_ALLOC_GROUP *, const fat_block_t b) {
+            if (fs->block_map[b] == FILE_DATA_BLOCK && t->heat[b] < FAT_TIER_PROMOTE_HEAT) cold.push_back(b);
+            return false;
+        });
+        need = std::min(need, (fat_block_t)FAT_TIER_MOVE_BATCH);
+        if ((fat_block_t)cold.size() > need) {
+            std::partial_sort(cold.begin(), cold.begin() + need, cold.end(), [t](fat_block_t a, fat_block_t b) { return t->heat[a] < t->heat[b]; });
+            cold.resize(need);
+        }
+    }
+
+    int64_t moved = 0;
+    if (!hot.empty() || !cold.empty()) {
+        std::unordered_map<fat_block_t, TIER_OWNER> owners;
+        for (size_t i = 0; i < hot.size(); i++) owners[hot[i]] = TIER_OWNER{NULL, 0};
+        for (size_t i = 0; i < cold.size(); i++) owners[cold[i]] = TIER_OWNER{NULL, 0};
+        std::unordered_map<fat_block_t, int> seen;
+        for (size_t f = 0; f < fs->files.size(); f++) {
+            FAT_FILE * file = fs->files[f];
+            for (size_t i = 0; i < file->block_ids.size(); i++) {
+                std::unordered_map<fat_block_t, TIER_OWNER>::iterator it = owners.find(file->block_ids[i]);
+                if (it == owners.end()) continue;
+                //blocks shared through dedup stay where they are
+                it->second = ++seen[it->first] == 1 ? TIER_OWNER{file, i} : TIER_OWNER{NULL, 0};
+            }
+        }
+        std::vector<char> copy(fs->block_size);
+        fat_block_t goal = 1;
+        for (size_t i = 0; i < cold.size(); i++) {
+            const TIER_OWNER &owner = owners[cold[i]];
+            if (owner.file == NULL || mini_fat_block_is_pinned(fs, cold[i])) continue;
+            if (!tier_move(fs, t, cold[i], owner, false, goal, copy)) break;
+            t->demoted++;
+            moved++;
+        }
+        goal = boundary;
+        for (size_t i = 0; i < hot.size(); i++) {
+            const TIER_OWNER &owner = owners[hot[i]];
+            if (owner.file == NULL || mini_fat_block_is_pinned(fs, hot[i])) continue;
+            if (!tier_move(fs, t, hot[i], owner, true, goal, copy)) break;
+            t->promoted++;
+            moved++;
+        }
+    }
+    for (size_t b = 0; b < t->heat.size(); b++) {
+        t->heat[b].store(t->heat[b].load(std::memory_order_relaxed) >> 1, std::memory_order_relaxed);
+    }
+    t->rounds++;
+    mini_fat_resume(fs);
+    return moved;
+}
+
+static void tier_worker(FAT_FILESYSTEM *fs, FAT_TIER *t, const int interval_ms) {
+    std::unique_lock<std::mutex> guard(t->worker_lock);
+    while (!t->stopping) {
+        t->wake.wait_for(guard, std::chrono::milliseconds(interval_ms));
+        if (t->stopping) break;
+        guard.unlock();
+        mini_fat_tier_migrate(fs);
+        guard.lock();
+    }
+}
+
+bool mini_fat_tier_start(FAT_FILESYSTEM *fs, const int interval_ms) {
+    FAT_TIER * t = fs->tier;
+    if (t == NULL || t->worker.joinable()) {
+        return false;
+    }
+    //other mounts would not learn about moved blocks
+    if (fs->share != NULL) {
+        fprintf(stderr, "Cannot migrate blocks of a shared mount.\n");
+        return false;
+    }
+    t->stopping = false;
+    t->worker = std::thread(tier_worker, fs, t, std::max(1, interval_ms));
+    return true;
+}
+
+void mini_fat_tier_stop(FAT_FILESYSTEM *fs) {
+    FAT_TIER * t = fs->tier;
+    if (t == NULL || !t->worker.joinable()) return;
+    {
+        std::lock_guard<std::mutex> guard(t->worker_lock);
+        t->stopping = true;
+    }
+    t->wake.notify_all();
+    t->worker.join();
+}
+
+FAT_TIER_STATS mini_fat_tier_stats(const FAT_FILESYSTEM *fs) {
+    FAT_TIER_STATS stats = FAT_TIER_STATS();
+    FAT_TIER * t = fs->tier;
+    if (t == NULL) return stats;
+    mini_fat_enter(fs);
+    stats.fast_blocks = fs->block_count - fs->tier_boundary;
+    for (fat_block_t b = fs->tier_boundary; b < fs->block_count; b++) {
+        stats.fast_used += fs->block_map[b] != EMPTY_BLOCK;
+    }
+    stats.promoted = t->promoted;
+    stats.demoted = t->demoted;
+    stats.rounds = t->rounds;
+    mini_fat_leave(fs);
+    return stats;
+}
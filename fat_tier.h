@@ -0,0 +1,53 @@
+#ifndef FAT_TIER_H
+#define FAT_TIER_H
+
+#include <stdint.h>
+
+typedef struct t_FAT_FILESYSTEM FAT_FILESYSTEM; // Forward definition.
+
+// A capacity tier block read this often (halved every round) moves up.
+const int FAT_TIER_PROMOTE_HEAT = 4;
+// Blocks moved per migration round at most.
+const int FAT_TIER_MOVE_BATCH = 256;
+
+typedef struct t_FAT_TIER_STATS {
+	int64_t fast_blocks; // Blocks of the fast tier.
+	int64_t fast_used; // Of those, in use.
+	int64_t promoted; // Blocks moved to the fast tier so far.
+	int64_t demoted; // Blocks moved to the capacity tier so far.
+	int64_t rounds; // Migration rounds run.
+} FAT_TIER_STATS;
+
+
+/// Tiered storage.
+// mini_fat_tier_attach adds a fast tier image, e.g. on tmpfs or NVMe, to a
+// volume. Its blocks get the ids after the blocks of the main (capacity)
+// image, so the volume holds the blocks of both. New file data is
+// allocated on the fast tier while it has room. Bulk import (cp-in) fills
+// the capacity tier first. File reads count the reads of each block. A
+// migration round moves the most read capacity tier blocks to the fast
+// tier. To make room, and to keep an eighth of the fast tier free for new
+// writes, it moves the coldest fast tier blocks down. Then it halves all
+// counts. Files only see their block_ids change. The migrator thread runs
+// a round every interval_ms. It cannot run on a shared mount. The fast
+// image is recorded in the file table and reopened by mini_fat_load. Read
+// views map it after the main image and pin blocks in place; direct I/O is
+// not available on tiered volumes.
+bool mini_fat_tier_attach(FAT_FILESYSTEM *fs, const char *fast_filename, const int64_t fast_blocks);
+bool mini_fat_tier_start(FAT_FILESYSTEM *fs, const int interval_ms);
+void mini_fat_tier_stop(FAT_FILESYSTEM *fs);
+int64_t mini_fat_tier_migrate(FAT_FILESYSTEM *fs);
+FAT_TIER_STATS mini_fat_tier_stats(const FAT_FILESYSTEM *fs);
+
+// Used by load and save:
+bool mini_fat_tier_open(FAT_FILESYSTEM *fs, const char *fast_filename, const int64_t boundary);
+const char * mini_fat_tier_filename(const FAT_FILESYSTEM *fs);
+// Used by mini_fat_destroy:
+void mini_fat_tier_close(FAT_FILESYSTEM *fs);
+
+// Used by file operations, which a migration round pauses (see
+// mini_fat_pause):
+void mini_fat_tier_touch(const FAT_FILESYSTEM *fs, const int64_t block_id);
+
+
+#endif // FAT_TIER_H
@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "fat.h"
+#include "fat_file.h"
+#include "fat_dedup.h"
+#include "fat_trace.h"
+#include "fat_lock.h"
+
+/**
+ * Trace file layout:
+ *   magic[8], u32 version, u32 record_size, i32 block_size, u32 flags,
+ *   i64 block_count
+ * followed by chunks of u32 kind, u32 bytes and a payload: a run of
+ * FAT_TRACE_RECORD for TRACE_CHUNK_RECORDS, or u32 id and the bytes of the
+ * name for TRACE_CHUNK_NAME. Records of different threads are interleaved
+ * by chunk; replay sorts them by timestamp.
+ */
+const char TRACE_MAGIC[8] = "MINITRC";
+const uint32_t TRACE_VERSION = 1;
+const uint32_t TRACE_CHUNK_RECORDS = 1;
+const uint32_t TRACE_CHUNK_NAME = 2;
+
+const uint64_t TRACE_RING_SIZE = 4096; // Records per thread, a power of two.
+const std::chrono::milliseconds TRACE_FLUSH_DELAY(10);
+
+// Single producer (the calling thread), single consumer (the flusher).
+struct trace_ring {
+    FAT_TRACE_RECORD records[TRACE_RING_SIZE];
+    std::atomic<uint64_t> head{0}; // Next record to write.
+    std::atomic<uint64_t> tail{0}; // Next record to flush.
+    uint16_t thread;
+};
+
+struct t_FAT_TRACER {
+    uint64_t generation; // Tells apart rings of earlier tracers in thread_local caches.
+    int fd;
+    std::chrono::steady_clock::time_point start;
+    std::mutex lock; // Guards rings, names and pending_names.
+    std::condition_variable wake;
+    std::vector<trace_ring*> rings;
+    std::unordered_map<std::string, uint32_t> names;
+    std::vector<std::pair<uint32_t, std::string> > pending_names;
+    std::atomic<uint32_t> next_handle{1};
+    bool stopping = false;
+    bool failed = false;
+    std::thread flusher;
+};
+
+static std::atomic<uint64_t> trace_generations{1};
+
+// Rings of the calling thread, by generation of their tracer, so a thread
+// that calls into several traced volumes keeps one ring per tracer. The
+// ring used last is looked up first. Entries of stopped tracers are never
+// used again.
+struct trace_thread_cache {
+    uint64_t generation = 0;
+    trace_ring * ring = NULL;
+    std::unordered_map<uint64_t, trace_ring*> rings;
+};
+static thread_local trace_thread_cache trace_cache;
+
+static bool trace_write(FAT_TRACER *t, const void *data, const size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t written = write(t->fd, (const char *)data + done, size - done);
+        if (written <= 0) {
+            if (!t->failed) perror("Cannot write trace");
+            t->failed = true;
+            return false;
+        }
+        done += written;
+    }
+    return true;
+}
+
+static void trace_write_chunk(FAT_TRACER *t, const uint32_t kind, const std::vector<unsigned char> &payload) {
+    uint32_t header[2] = { kind, (uint32_t)payload.size() };
+    trace_write(t, header, sizeof(header));
+    trace_write(t, payload.data(), payload.size());
+}
+
+// Write pending names and everything in the rings. Only the flusher calls this.
+static void trace_drain(FAT_TRACER *t) {
+    std::vector<std::pair<uint32_t, std::string> > names;
+    std::vector<trace_ring*> rings;
+    {
+        std::lock_guard<std::mutex> guard(t->lock);
+        names.swap(t->pending_names);
+        rings = t->rings;
+    }
+    for (size_t i = 0; i < names.size(); i++) {
+        std::vector<unsigned char> payload(sizeof(uint32_t) + names[i].second.size());
+        memcpy(payload.data(), &names[i].first, sizeof(uint32_t));
+        memcpy(payload.data() + sizeof(uint32_t), names[i].second.data(), names[i].second.size());
+        trace_write_chunk(t, TRACE_CHUNK_NAME, payload);
+    }
+    std::vector<unsigned char> payload;
+    for (size_t r = 0; r < rings.size(); r++) {
+        trace_ring * ring = rings[r];
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        if (head == tail) continue;
+        payload.resize((head - tail) * sizeof(FAT_TRACE_RECORD));
+        for (uint64_t i = tail; i < head; i++) {
+            memcpy(&payload[(i - tail) * sizeof(FAT_TRACE_RECORD)], &ring->records[i % TRACE_RING_SIZE], sizeof(FAT_TRACE_RECORD));
+        }
+        ring->tail.store(head, std::memory_order_release);
+        trace_write_chunk(t, TRACE_CHUNK_RECORDS, payload);
+    }
+}
+
+static void trace_flusher(FAT_TRACER *t) {
+    std::unique_lock<std::mutex> guard(t->lock);
+    while (!t->stopping) {
+        t->wake.wait_for(guard, TRACE_FLUSH_DELAY);
+        guard.unlock();
+        trace_drain(t);
+        guard.lock();
+    }
+    guard.unlock();
+    trace_drain(t);
+}
+
+/**
+ * Start recording the file API calls on fs into a new trace file.
+ * @return false if a tracer runs already or the file cannot be created
+ */
+bool mini_fat_trace_start(FAT_FILESYSTEM *fs, const char *trace_path) {
+    if (fs->tracer != NULL) {
+        return false;
+    }
+    int fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("Cannot create trace");
+        return false;
+    }
+    FAT_TRACER * t = new FAT_TRACER;
+    t->generation = trace_generations++;
+    t->fd = fd;
+    t->start = std::chrono::steady_clock::now();
+
+    unsigned char header[32] = {0};
+    uint32_t version = TRACE_VERSION, record_size = sizeof(FAT_TRACE_RECORD);
+    int32_t block_size = fs->block_size;
+    uint32_t flags = fs->dedup != NULL ? FAT_FLAG_DEDUP : 0;
+    int64_t block_count = fs->block_count;
+    memcpy(header, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    memcpy(header + 8, &version, 4);
+    memcpy(header + 12, &record_size, 4);
+    memcpy(header + 16, &block_size, 4);
+    memcpy(header + 20, &flags, 4);
+    memcpy(header + 24, &block_count, 8);
+    if (!trace_write(t, header, sizeof(header))) {
+        close(fd);
+        delete t;
+        return false;
+    }
+    t->flusher = std::thread(trace_flusher, t);
+    fs->tracer = t;
+    return true;
+}
+
+/**
+ * Flush the remaining records and close the trace file.
+ * @return false if no tracer runs or writing the trace failed
+ */
+bool mini_fat_trace_stop(FAT_FILESYSTEM *fs) {
+    FAT_TRACER * t = fs->tracer;
+    if (t == NULL) return false;
+    {
+        std::lock_guard<std::mutex> guard(t->lock);
+        t->stopping = true;
+        t->wake.notify_all();
+    }
+    t->flusher.join();
+    bool ok = !t->failed && close(t->fd) == 0;
+    for (size_t i = 0; i < t->rings.size(); i++) {
+        delete t->rings[i];
+    }
+    fs->tracer = NULL;
+    delete t;
+    return ok;
+}
+
+int64_t mini_fat_trace_clock(const FAT_FILESYSTEM *fs) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - fs->tracer->start).count();
+}
+
+// Id of a file name, written to the trace the first time it is seen.
+uint32_t mini_fat_trace_name(FAT_FILESYSTEM *fs, const char *name) {
+    FAT_TRACER * t = fs->tracer;
+    std::lock_guard<std::mutex> guard(t->lock);
+    auto it = t->names.find(name);
+    if (it != t->names.end()) return it->second;
+    uint32_t id = t->names.size() + 1;
+    t->names[name] = id;
+    t->pending_names.push_back(std::make_pair(id, std::string(name)));
+    return id;
+}
+
+uint32_t mini_fat_trace_handle(FAT_FILESYSTEM *fs) {
+    return fs->tracer->next_handle++;
+}
+
+/**
+ * Append a record to the ring of the calling thread. record.timestamp holds
+ * the start of the call and the duration is filled in here. Waits only if
+ * the flusher is a whole ring behind.
+ */
+void mini_fat_trace_record(FAT_FILESYSTEM *fs, FAT_TRACE_RECORD &record) {
+    FAT_TRACER * t = fs->tracer;
+    record.duration = mini_fat_trace_clock(fs) - record.timestamp;
+    if (trace_cache.generation != t->generation) {
+        trace_ring * &ring = trace_cache.rings[t->generation];
+        if (ring == NULL) {
+            ring = new trace_ring;
+            std::lock_guard<std::mutex> guard(t->lock);
+            ring->thread = t->rings.size();
+            t->rings.push_back(ring);
+        }
+        trace_cache.generation = t->generation;
+        trace_cache.ring = ring;
+    }
+    trace_ring * ring = trace_cache.ring;
+    record.thread = ring->thread;
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    while (head - ring->tail.load(std::memory_order_acquire) >= TRACE_RING_SIZE) {
+        t->wake.notify_one();
+        std::this_thread::yield();
+    }
+    ring->records[head % TRACE_RING_SIZE] = record;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+const char * mini_fat_trace_op_name(const uint16_t op) {
+    static const char * names[FAT_TRACE_OP_COUNT] = { "?", "open", "read", "write", "seek", "close", "delete", "open_shared" };
+    return op < FAT_TRACE_OP_COUNT ? names[op] : names[0];
+}
+
+// Count, mean and percentiles of latencies in nanoseconds.
+static FAT_LATENCY_STATS replay_latency(std::vector<int64_t> &latencies) {
+    FAT_LATENCY_STATS stats = FAT_LATENCY_STATS();
+    stats.count = latencies.size();
+    if (latencies.empty()) return stats;
+    std::sort(latencies.begin(), latencies.end());
+    double sum = 0;
+    for (size_t i = 0; i < latencies.size(); i++) sum += latencies[i];
+    stats.mean_us = sum / latencies.size() / 1000;
+    stats.p50_us = latencies[latencies.size() * 50 / 100] / 1000.0;
+    stats.p90_us = latencies[latencies.size() * 90 / 100] / 1000.0;
+    stats.p99_us = latencies[latencies.size() * 99 / 100] / 1000.0;
+    stats.max_us = latencies.back() / 1000.0;
+    return stats;
+}
+
+static bool replay_load(const char *trace_path, int32_t &block_size, uint32_t &flags, int64_t &block_count,
+                        std::vector<FAT_TRACE_RECORD> &records, std::unordered_map<uint32_t, std::string> &names) {
+    FILE * f = fopen(trace_path, "rb");
+    if (f == NULL) {
+        perror("Cannot open trace");
+        return false;
+    }
+    unsigned char header[32];
+    uint32_t version = 0, record_size = 0;
+    bool ok = fread(header, sizeof(header), 1, f) == 1 && memcmp(header, TRACE_MAGIC, sizeof(TRACE_MAGIC)) == 0;
+    if (ok) {
+        memcpy(&version, header + 8, 4);
+        memcpy(&record_size, header + 12, 4);
+        memcpy(&block_size, header + 16, 4);
+        memcpy(&flags, header + 20, 4);
+        memcpy(&block_count, header + 24, 8);
+        ok = version == TRACE_VERSION && record_size == sizeof(FAT_TRACE_RECORD);
+    }
+    uint32_t chunk[2];
+    std::vector<unsigned char> payload;
+    while (ok && fread(chunk, sizeof(chunk), 1, f) == 1) {
+        payload.resize(chunk[1]);
+        if (chunk[1] > 0 && fread(payload.data(), chunk[1], 1, f) != 1) {
+            ok = false;
+        } else if (chunk[0] == TRACE_CHUNK_RECORDS) {
+            size_t first = records.size();
+            records.resize(first + chunk[1] / sizeof(FAT_TRACE_RECORD));
+            memcpy(&records[first], payload.data(), (records.size() - first) * sizeof(FAT_TRACE_RECORD));
+        } else if (chunk[0] == TRACE_CHUNK_NAME && chunk[1] >= sizeof(uint32_t)) {
+            uint32_t id;
+            memcpy(&id, payload.data(), sizeof(id));
+            names[id] = std::string((const char *)payload.data() + sizeof(id), chunk[1] - sizeof(id));
+        }
+    }
+    fclose(f);
+    if (!ok) {
+        fprintf(stderr, "Cannot replay '%s': not a trace or truncated.\n", trace_path);
+    }
+    return ok;
+}
+
+/**
+ * Replay a trace, see fat_trace.h.
+ * @param  report receives the counts and latency distributions
+ * @return        false if the trace or the image cannot be used
+ */
+bool mini_fat_trace_replay(const char *trace_path, const char *image_path, const bool timed, FAT_REPLAY_REPORT *report) {
+    int32_t block_size = 0;
+    uint32_t flags = 0;
+    int64_t block_count = 0;
+    std::vector<FAT_TRACE_RECORD> records;
+    std::unordered_map<uint32_t, std::string> names;
+    if (!replay_load(trace_path, block_size, flags, block_count, records, names)) {
+        return false;
+    }
+    std::stable_sort(records.begin(), records.end(), [](const FAT_TRACE_RECORD &a, const FAT_TRACE_RECORD &b) {
+        return a.timestamp < b.timestamp;
+    });
+    FAT_FILESYSTEM * fs = mini_fat_create(image_path, block_size, block_count);
+    if (fs == NULL) {
+        return false;
+    }
+    if (flags & FAT_FLAG_DEDUP) {
+        mini_fat_dedup_enable(fs);
+    }
+
+    std::unordered_map<uint32_t, FAT_OPEN_FILE*> handles;
+    std::vector<char> buffer;
+    std::vector<int64_t> traced[FAT_TRACE_OP_COUNT], replayed[FAT_TRACE_OP_COUNT];
+    int64_t mismatched = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < records.size(); i++) {
+        const FAT_TRACE_RECORD &r = records[i];
+        if (r.op == 0 || r.op >= FAT_TRACE_OP_COUNT) continue;
+        if (timed) {
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds(r.timestamp));
+        }
+        const char * name = names.count(r.name) ? names[r.name].c_str() : "";
+        FAT_OPEN_FILE * fd = handles.count(r.handle) ? handles[r.handle] : NULL;
+        if ((r.op == FAT_TRACE_READ || r.op == FAT_TRACE_WRITE) && (int64_t)buffer.size() < r.size) {
+            size_t old_size = buffer.size();
+            buffer.resize(r.size);
+            for (size_t b = old_size; b < buffer.size(); b++) buffer[b] = (char)(b * 131 + 7);
+        }
+        //shared handles may write past the end, see fat_lock.h
+        if (fd != NULL && (r.op == FAT_TRACE_READ || r.op == FAT_TRACE_WRITE) && (fd->is_shared || r.offset <= fd->file->size)) {
+            fd->position = r.offset;
+        }
+        std::chrono::steady_clock::time_point call = std::chrono::steady_clock::now();
+        int64_t result = 0;
+        if (r.op == FAT_TRACE_OPEN) {
+            fd = mini_file_open(fs, name, r.size != 0);
+            if (fd != NULL) handles[r.handle] = fd;
+            result = fd != NULL;
+        } else if (r.op == FAT_TRACE_OPEN_SHARED) {
+            fd = mini_file_open_shared(fs, name);
+            if (fd != NULL) handles[r.handle] = fd;
+            result = fd != NULL;
+        } else if (r.op == FAT_TRACE_DELETE) {
+            result = mini_file_delete(fs, name);
+        } else if (fd == NULL) {
+            result = -1; // handle was never opened in the replay
+        } else if (r.op == FAT_TRACE_READ) {
+            result = mini_file_read(fs, fd, r.size, buffer.data());
+        } else if (r.op == FAT_TRACE_WRITE) {
+            result = mini_file_write(fs, fd, r.size, buffer.data());
+        } else if (r.op == FAT_TRACE_SEEK) {
+            result = mini_file_seek(fs, fd, r.offset, r.size != 0);
+        } else if (r.op == FAT_TRACE_CLOSE) {
+            result = mini_file_close(fs, fd);
+            handles.erase(r.handle);
+            delete fd;
+        }
+        replayed[r.op].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - call).count());
+        traced[r.op].push_back(r.duration);
+        mismatched += result != r.result;
+    }
+
+    FAT_REPLAY_REPORT total = FAT_REPLAY_REPORT();
+    total.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    total.records = records.size();
+    total.mismatched = mismatched;
+    for (int op = 0; op < FAT_TRACE_OP_COUNT; op++) {
+        total.traced[op] = replay_latency(traced[op]);
+        total.replayed[op] = replay_latency(replayed[op]);
+    }
+    if (report != NULL) {
+        *report = total;
+    }
+    for (std::unordered_map<uint32_t, FAT_OPEN_FILE*>::iterator it = handles.begin(); it != handles.end(); ++it) {
+        mini_file_close(fs, it->second);
+        delete it->second;
+    }
+    bool ok = mini_fat_save(fs);
+    mini_fat_destroy(fs);
+    return ok;
+}
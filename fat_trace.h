@@ -0,0 +1,70 @@
+#ifndef FAT_TRACE_H
+#define FAT_TRACE_H
+
+#include <stdint.h>
+
+typedef struct t_FAT_FILESYSTEM FAT_FILESYSTEM; // Forward definition.
+
+// Traced calls of the file API.
+const uint16_t FAT_TRACE_OPEN = 1;
+const uint16_t FAT_TRACE_READ = 2;
+const uint16_t FAT_TRACE_WRITE = 3;
+const uint16_t FAT_TRACE_SEEK = 4;
+const uint16_t FAT_TRACE_CLOSE = 5;
+const uint16_t FAT_TRACE_DELETE = 6;
+const uint16_t FAT_TRACE_OPEN_SHARED = 7;
+const int FAT_TRACE_OP_COUNT = 8;
+
+// One call, as stored in the trace file.
+typedef struct t_FAT_TRACE_RECORD {
+	int64_t timestamp; // Nanoseconds from the start of the trace to the call.
+	int64_t duration; // Nanoseconds spent in the call.
+	int64_t offset; // Position of the handle before the call; seek: requested offset.
+	int64_t size; // Requested bytes; open: is_write, seek: from_start.
+	int64_t result; // Bytes done, or 1/0 for success.
+	uint32_t handle; // Open handle (all calls but delete), numbered from 1.
+	uint32_t name; // File name (open, open_shared, delete), see the name chunks.
+	uint16_t op;
+	uint16_t thread; // Calling thread, numbered from 0.
+	uint32_t unused;
+} FAT_TRACE_RECORD;
+
+typedef struct t_FAT_LATENCY_STATS {
+	int64_t count;
+	double mean_us, p50_us, p90_us, p99_us, max_us;
+} FAT_LATENCY_STATS;
+
+typedef struct t_FAT_REPLAY_REPORT {
+	int64_t records; // Calls replayed.
+	int64_t mismatched; // Calls whose result differs from the trace.
+	double seconds; // Wall time of the replay.
+	FAT_LATENCY_STATS traced[FAT_TRACE_OP_COUNT]; // Latencies in the trace, by op.
+	FAT_LATENCY_STATS replayed[FAT_TRACE_OP_COUNT]; // Latencies of the replay, by op.
+} FAT_REPLAY_REPORT;
+
+
+/// API tracer.
+// While running, every open, open_shared, read, write, seek, close and
+// delete on fs is recorded. Calling threads append to their own lock-free ring buffer and
+// a background thread drains the rings into the trace file every few ms.
+// Data is not recorded. Stop the tracer after the last traced call.
+bool mini_fat_trace_start(FAT_FILESYSTEM *fs, const char *trace_path);
+bool mini_fat_trace_stop(FAT_FILESYSTEM *fs);
+
+// Used by the file API:
+int64_t mini_fat_trace_clock(const FAT_FILESYSTEM *fs);
+uint32_t mini_fat_trace_name(FAT_FILESYSTEM *fs, const char *name);
+uint32_t mini_fat_trace_handle(FAT_FILESYSTEM *fs);
+void mini_fat_trace_record(FAT_FILESYSTEM *fs, FAT_TRACE_RECORD &record);
+
+/// Replay.
+// Re-executes a trace against a fresh image with the block size and count
+// of the traced one, in timestamp order on one thread. Writes use a fixed
+// byte pattern. With timed, each call waits for its original time offset,
+// otherwise calls run back to back. The image is saved and the filesystem
+// freed at the end.
+bool mini_fat_trace_replay(const char *trace_path, const char *image_path, const bool timed, FAT_REPLAY_REPORT *report);
+const char * mini_fat_trace_op_name(const uint16_t op);
+
+
+#endif // FAT_TRACE_H
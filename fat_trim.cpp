@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "fat.h"
+#include "fat_trim.h"
+
+// The trimmer wakes up when this many blocks are queued, or after the delay.
+const size_t TRIM_BATCH_BLOCKS = 1024;
+const std::chrono::milliseconds TRIM_BATCH_DELAY(100);
+
+struct t_FAT_TRIMMER {
+    std::mutex lock;
+    std::condition_variable wake; // Work queued, flush or stop requested.
+    std::condition_variable idle; // Queue drained.
+    std::vector<fat_block_t> queued; // Freed, waiting to be punched.
+    std::vector<fat_block_t> punched; // Punched, waiting to be marked empty.
+    size_t in_flight = 0; // Blocks of the batch being punched.
+    int flushing = 0;
+    bool stopping = false;
+    bool cancelling = false; // Volume is full, hand the batch back now.
+    bool unsupported = false;
+    std::atomic<bool> has_punched{false};
+    int64_t bytes_per_second;
+    FAT_TRIM_STATS stats = FAT_TRIM_STATS();
+    std::thread worker;
+};
+
+static bool trim_punch(const int fd, const fat_off_t offset, const fat_off_t length) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0;
+#else
+    errno = EOPNOTSUPP;
+    return false;
+#endif
+}
+
+/**
+ * Punch a sorted batch of blocks, merged into contiguous ranges. Ranges are
+ * split so that no piece is worth more than a tenth of a second of the rate
+ * limit, and each piece waits for its turn.
+ */
+static void trim_batch(FAT_FILESYSTEM *fs, FAT_TRIMMER *t, std::vector<fat_block_t> &batch,
+                       std::chrono::steady_clock::time_point &next_slot) {
+    std::sort(batch.begin(), batch.end());
+    fat_off_t piece = t->bytes_per_second > 0 ? std::max((fat_off_t)fs->block_size, t->bytes_per_second / 10) : 0;
+    for (size_t i = 0; i < batch.size();) {
+        size_t j = i + 1;
+        //ranges end at the fast tier, which is another image
+        while (j < batch.size() && batch[j] == batch[j - 1] + 1 && batch[j] != fs->tier_boundary) j++;
+        fat_off_t begin;
+        int fd = mini_fat_block_location(fs, batch[i], begin);
+        fat_off_t end = begin + (batch[j - 1] + 1 - batch[i]) * fs->block_size;
+        for (fat_off_t offset = begin; offset < end;) {
+            fat_off_t length = piece > 0 ? std::min(piece, end - offset) : end - offset;
+            if (t->bytes_per_second > 0) {
+                std::this_thread::sleep_until(next_slot);
+                next_slot = std::max(next_slot, std::chrono::steady_clock::now())
+                            + std::chrono::microseconds(length * 1000000 / t->bytes_per_second);
+            }
+            bool ok = trim_punch(fd, offset, length);
+            std::lock_guard<std::mutex> guard(t->lock);
+            if (ok) {
+                t->stats.bytes_reclaimed += length;
+                t->stats.ranges_punched++;
+            } else if (!t->unsupported) {
+                t->unsupported = true;
+                perror("Cannot punch holes in virtual disk, freed blocks stay allocated on the host");
+            }
+            if (t->stopping || t->cancelling) return;
+            offset += length;
+        }
+        i = j;
+    }
+}
+
+static void trim_worker(FAT_FILESYSTEM *fs, FAT_TRIMMER *t) {
+    std::chrono::steady_clock::time_point next_slot = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> guard(t->lock);
+    while (!t->stopping) {
+        t->wake.wait_for(guard, TRIM_BATCH_DELAY, [t] {
+            return t->stopping || (!t->queued.empty() && (t->flushing > 0 || t->queued.size() >= TRIM_BATCH_BLOCKS));
+        });
+        if (t->stopping || t->queued.empty()) continue;
+        std::vector<fat_block_t> batch;
+        batch.swap(t->queued);
+        t->in_flight = batch.size();
+        guard.unlock();
+        trim_batch(fs, t, batch, next_slot);
+        guard.lock();
+        //blocks of an interrupted batch are handed back unpunched
+        t->punched.insert(t->punched.end(), batch.begin(), batch.end());
+        t->has_punched = true;
+        t->in_flight = 0;
+        t->idle.notify_all();
+    }
+}
+
+/**
+ * Start the background trimmer of a filesystem.
+ * @param  bytes_per_second rate limit of hole punching, 0 for none
+ * @return                  false if it is already running, or fs is shared
+ *                          or in memory
+ */
+bool mini_fat_trim_start(FAT_FILESYSTEM *fs, const int64_t bytes_per_second) {
+    if (fs->trimmer != NULL) {
+        return false;
+    }
+    //other mounts would reuse blocks that are still waiting to be punched
+    if (fs->share != NULL) {
+        fprintf(stderr, "Cannot trim a shared mount.\n");
+        return false;
+    }
+    if (fs->memory != NULL) {
+        fprintf(stderr, "Cannot trim a memory volume.\n");
+        return false;
+    }
+    FAT_TRIMMER * t = new FAT_TRIMMER;
+    t->bytes_per_second = bytes_per_second;
+    t->worker = std::thread(trim_worker, fs, t);
+    fs->trimmer = t;
+    return true;
+}
+
+// Take every freed block out of the trimmer, punched or not.
+static void trim_take_all(FAT_FILESYSTEM *fs, FAT_TRIMMER *t, std::vector<fat_block_t> &blocks) {
+    blocks.swap(t->punched);
+    blocks.insert(blocks.end(), t->queued.begin(), t->queued.end());
+    t->queued.clear();
+    t->has_punched = false;
+}
+
+static void trim_mark_empty(FAT_FILESYSTEM *fs, const std::vector<fat_block_t> &blocks) {
+    for (size_t i = 0; i < blocks.size(); i++) {
+        mini_fat_change_block_type(fs, blocks[i], TRIM_PENDING_BLOCK, EMPTY_BLOCK);
+    }
+}
+
+/**
+ * Stop the trimmer. Blocks that were not punched yet become empty without
+ * being punched; call mini_fat_trim_flush first to punch them.
+ */
+void mini_fat_trim_stop(FAT_FILESYSTEM *fs) {
+    FAT_TRIMMER * t = fs->trimmer;
+    if (t == NULL) return;
+    {
+        std::lock_guard<std::mutex> guard(t->lock);
+        t->stopping = true;
+        t->wake.notify_all();
+    }
+    t->worker.join();
+    std::vector<fat_block_t> blocks;
+    trim_take_all(fs, t, blocks);
+    trim_mark_empty(fs, blocks);
+    fs->trimmer = NULL;
+    delete t;
+}
+
+/**
+ * Wait until every freed block has been punched (at the rate limit) and
+ * mark them empty.
+ */
+void mini_fat_trim_flush(FAT_FILESYSTEM *fs) {
+    FAT_TRIMMER * t = fs->trimmer;
+    if (t == NULL) return;
+    {
+        std::unique_lock<std::mutex> guard(t->lock);
+        t->flushing++;
+        t->wake.notify_all();
+        t->idle.wait(guard, [t] { return t->queued.empty() && t->in_flight == 0; });
+        t->flushing--;
+    }
+    mini_fat_trim_collect(fs);
+}
+
+/**
+ * Queue every empty block of the volume for punching, e.g. for images that
+ * were used before the trimmer existed. Requires a running trimmer.
+ * @return number of blocks queued
+ */
+int64_t mini_fat_trim_free_blocks(FAT_FILESYSTEM *fs) {
+    FAT_TRIMMER * t = fs->trimmer;
+    if (t == NULL) return 0;
+    std::vector<fat_block_t> blocks;
+    for (fat_block_t i = 0; i < fs->block_count; i++) {
+        if (mini_fat_change_block_type(fs, i, EMPTY_BLOCK, TRIM_PENDING_BLOCK)) {
+            blocks.push_back(i);
+        }
+    }
+    std::lock_guard<std::mutex> guard(t->lock);
+    t->queued.insert(t->queued.end(), blocks.begin(), blocks.end());
+    t->wake.notify_all();
+    return blocks.size();
+}
+
+FAT_TRIM_STATS mini_fat_trim_stats(const FAT_FILESYSTEM *fs) {
+    FAT_TRIMMER * t = fs->trimmer;
+    if (t == NULL) return FAT_TRIM_STATS();
+    std::lock_guard<std::mutex> guard(t->lock);
+    FAT_TRIM_STATS stats = t->stats;
+    stats.blocks_pending = t->queued.size() + t->in_flight;
+    return stats;
+}
+
+/**
+ * Hand a freed block to the trimmer, if one is running.
+ * @return false if there is no trimmer and the block should just be emptied
+ */
+bool mini_fat_trim_queue(FAT_FILESYSTEM *fs, const int64_t block_id) {
+    FAT_TRIMMER * t = fs->trimmer;
+    if (t == NULL) return false;
+    mini_fat_set_block_type(fs, block_id, TRIM_PENDING_BLOCK);
+    std::lock_guard<std::mutex> guard(t->lock);
+    t->queued.push_back(block_id);
+    if (t->queued.size() == TRIM_BATCH_BLOCKS) {
+        t->wake.notify_one();
+    }
+    return true;
+}
+
+/**
+ * Mark blocks punched so far as empty. Cheap if there are none.
+ */
+void mini_fat_trim_collect(FAT_FILESYSTEM *fs) {
+    FAT_TRIMMER * t = fs->trimmer;
+    if (t == NULL || !t->has_punched.load(std::memory_order_acquire)) return;
+    std::vector<fat_block_t> blocks;
+    {
+        std::lock_guard<std::mutex> guard(t->lock);
+        blocks.swap(t->punched);
+        t->has_punched = false;
+    }
+    trim_mark_empty(fs, blocks);
+}
+
+/**
+ * The volume is full: give up on punching the queued blocks and make them
+ * available right away.
+ * @return true if any block became empty
+ */
+bool mini_fat_trim_reclaim(FAT_FILESYSTEM *fs) {
+    FAT_TRIMMER * t = fs->trimmer;
+    if (t == NULL) return false;
+    std::vector<fat_block_t> blocks;
+    {
+        std::unique_lock<std::mutex> guard(t->lock);
+        t->cancelling = true;
+        t->idle.wait(guard, [t] { return t->in_flight == 0; });
+        t->cancelling = false;
+        trim_take_all(fs, t, blocks);
+    }
+    trim_mark_empty(fs, blocks);
+    return !blocks.empty();
+}
@@ -0,0 +1,32 @@
+#ifndef FAT_TRIM_H
+#define FAT_TRIM_H
+
+#include <stdint.h>
+
+typedef struct t_FAT_FILESYSTEM FAT_FILESYSTEM; // Forward definition.
+
+typedef struct t_FAT_TRIM_STATS {
+	int64_t bytes_reclaimed; // Bytes given back to the host with hole punching.
+	int64_t ranges_punched; // Hole punch calls made.
+	int64_t blocks_pending; // Freed blocks waiting to be punched.
+} FAT_TRIM_STATS;
+
+
+/// Background trimmer.
+// While running, blocks freed on the volume are marked TRIM_PENDING_BLOCK
+// (never allocated), batched into contiguous ranges and released on the
+// host with FALLOC_FL_PUNCH_HOLE, at most bytes_per_second (0: no limit).
+// The next allocation turns punched blocks back into EMPTY_BLOCK.
+bool mini_fat_trim_start(FAT_FILESYSTEM *fs, const int64_t bytes_per_second);
+void mini_fat_trim_stop(FAT_FILESYSTEM *fs);
+void mini_fat_trim_flush(FAT_FILESYSTEM *fs);
+int64_t mini_fat_trim_free_blocks(FAT_FILESYSTEM *fs);
+FAT_TRIM_STATS mini_fat_trim_stats(const FAT_FILESYSTEM *fs);
+
+// Used by the block allocator:
+bool mini_fat_trim_queue(FAT_FILESYSTEM *fs, const int64_t block_id);
+void mini_fat_trim_collect(FAT_FILESYSTEM *fs);
+bool mini_fat_trim_reclaim(FAT_FILESYSTEM *fs);
+
+
+#endif // FAT_TRIM_H
@@ -1,328 +1,282 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <thread>
+
 #include "fat.h"
 #include "fat_file.h"
-
-const char * fox = "The quick brown fox jumps over the lazy dog.\n";
-
-int total_score = 0;
-int current_score = 0;
-inline void score2(const bool cond, const char * fmt, ...)
-{
-	va_list args;
-   va_start(args, fmt);
-   vprintf(fmt, args);
-   va_end(args);
-	current_score += cond;
-	total_score++;
+#include "fat_bulk.h"
+#include "fat_check.h"
+#include "fat_trim.h"
+#include "fat_dedup.h"
+#include "fat_trace.h"
+#include "fat_direct.h"
+#include "fat_share.h"
+#include "fat_tier.h"
+
+static void usage() {
+	fprintf(stderr,
+		"Usage: minifs <command> <image> [arguments]\n"
+		"  mkfs   <image> <block_size> <block_count> [--dedup] [--fast <fast_image> <fast_blocks>]\n"
+		"                                              create an empty virtual disk\n"
+		"  ls     <image>                              list files\n"
+		"  cp-in  <image> <host_path> [name] [-j N]    copy a host file or directory tree in\n"
+		"  cp-out <image> <name|prefix> <host_path> [-j N]\n"
+		"                                              copy a file or all files below prefix out\n"
+		"  rm     <image> <name>...                    delete files and punch their blocks\n"
+		"  stat   <image> [name]                       show volume or file information\n"
+		"  dump   <image>                              dump block map and files\n"
+		"  check  <image> [--repair] [-j N]            verify (and repair) block ownership\n"
+		"  trim   <image> [bytes_per_sec]              give all free blocks back to the host\n"
+		"  replay <trace> <image> [--timed]            re-run an API trace on a fresh image\n"
+		"Commands on an existing image also take --direct, which bypasses the host\n"
+		"page cache for file data (O_DIRECT), and --shared, which coordinates with\n"
+		"other processes that use the image at the same time.\n");
 }
-inline void score(const bool cond, int points = 1) {
-	current_score += cond*points;
-	total_score+=points;
-	if (cond)
-		printf("  => Pass\n");
-	else
-		printf("  => Fail\n");
-}
-
-void test_small_filesystem(FAT_FILESYSTEM * fs) {
-	FAT_OPEN_FILE *fd1, *fd2, *fd3;
-	printf("Openning 1st file in write mode should work.\n");
-	fd1 = mini_file_open(fs, "file1.txt", true);
-	score(fd1 != NULL);
-
-	printf("Openning 2nd file in write mode should work.\n");
-	fd2 = mini_file_open(fs, "file2.txt", true);
-	score(fd2 != NULL);
 
-	printf("Openning 3rd file in write mode should not work:\n");
-	fd3 = mini_file_open(fs, "file3.txt", true);
-	score(fd3 == NULL);
+// Remove a trailing "-j N" from the arguments; defaults to one worker per core.
+static int parse_workers(int &argc, char **argv) {
+	if (argc >= 2 && strcmp(argv[argc - 2], "-j") == 0) {
+		int workers = atoi(argv[argc - 1]);
+		argc -= 2;
+		return workers > 0 ? workers : 1;
+	}
+	int cores = std::thread::hardware_concurrency();
+	return cores > 0 ? cores : 4;
 }
 
-void test_open_3_files(FAT_FILESYSTEM * fs) {
-	FAT_OPEN_FILE *fd1, *fd2, *fd3, *fd4, *fd5, *fd6;
-	// Openning three files:
-	printf("Openning a non-existing file in read mode should error:\n");
-	fd1 = mini_file_open(fs, "file1.txt", false);
-	score(fd1 == NULL);
-	printf("\n");
-
-	printf("Openning a non-existing file in write mode should work.\n");
-	fd1 = mini_file_open(fs, "file1.txt", true);
-	score(fd1 != NULL);
-
-	printf("Openning an existing file in write mode (again) should error:\n");
-	fd2 = mini_file_open(fs, "file1.txt", true);
-	score(fd2 == NULL);
-	printf("\n");
-
-	printf("Openning an existing file in read mode (again) should work.\n");
-	fd2 = mini_file_open(fs, "file1.txt", false);
-	score(fd2 != NULL);
-
-	printf("Openning an existing file in read mode (again, 2nd time) should work.\n");
-	fd3 = mini_file_open(fs, "file1.txt", false);
-	score(fd3 != NULL);
-
-	printf("Openning 2nd, non-existing file in write mode should work.\n");
-	fd4 = mini_file_open(fs, "file2.txt", true);
-	score(fd4 != NULL);
-
-	printf("Openning 2nd, non-existing file in write mode (again) should error:\n");
-	fd5 = mini_file_open(fs, "file2.txt", true);
-	score(fd5 == NULL);
-	printf("\n");
-
-	printf("Closing 2nd file should work.\n");
-	score(mini_file_close(fs, fd4));
-
-	printf("Reopenning 2nd file in write mode should work.\n");
-	fd4 = mini_file_open(fs, "file2.txt", true);
-	score(fd4 != NULL);
-
-	printf("Openning 3rd, non-existing file in write mode should work.\n");
-	fd6 = mini_file_open(fs, "file3.txt", true);
-	score(fd6 != NULL);
+// Remove a mount option like "--direct" from the arguments.
+static bool parse_option(int &argc, char **argv, const char * option) {
+	for (int i = 3; i < argc; i++) {
+		if (strcmp(argv[i], option) == 0) {
+			memmove(argv + i, argv + i + 1, (argc - i - 1) * sizeof(char *));
+			argc--;
+			return true;
+		}
+	}
+	return false;
+}
 
-	score(mini_file_close(fs, fd1));
-	score(mini_file_close(fs, fd2));
-	score(mini_file_close(fs, fd3));
-	score(mini_file_close(fs, fd4));
-	score(mini_file_close(fs, fd5) == false);
-	score(mini_file_close(fs, fd6));
+static int cmd_mkfs(int argc, char **argv) {
+	bool dedup = false;
+	const char * fast_image = NULL;
+	long long fast_blocks = 0;
+	for (int i = 5; i < argc; i++) {
+		if (strcmp(argv[i], "--dedup") == 0) {
+			dedup = true;
+		} else if (strcmp(argv[i], "--fast") == 0 && i + 2 < argc) {
+			fast_image = argv[i + 1];
+			fast_blocks = atoll(argv[i + 2]);
+			i += 2;
+		} else {
+			usage();
+			return 2;
+		}
+	}
+	if (argc < 5) {
+		usage();
+		return 2;
+	}
+	FAT_FILESYSTEM * fs = mini_fat_create(argv[2], atoi(argv[3]), atoll(argv[4]));
+	if (fs != NULL && dedup) {
+		mini_fat_dedup_enable(fs);
+	}
+	if (fs != NULL && fast_image != NULL && !mini_fat_tier_attach(fs, fast_image, fast_blocks)) {
+		return 1;
+	}
+	if (fs == NULL || !mini_fat_save(fs)) {
+		return 1;
+	}
+	return 0;
 }
 
-void test_delete_file2(FAT_FILESYSTEM * fs) {
-	FAT_OPEN_FILE *fd1, *fd2;
-	// Deleting the second file:
-	printf("Trying to delelete 'file1.txt' should fail, as it's open:\n");
-	fd1 = mini_file_open(fs, "file1.txt", true);
-	score(fd1 != NULL);
-	score(mini_file_delete(fs, "file1.txt") == false);
-	score(mini_file_close(fs, fd1));
-	printf("\n");
+static void print_latency(const char * label, const char * op, const FAT_LATENCY_STATS &stats) {
+	printf("%-8s %-8s %10lld %10.1f %10.1f %10.1f %10.1f %10.1f\n", op, label, (long long)stats.count,
+		stats.mean_us, stats.p50_us, stats.p90_us, stats.p99_us, stats.max_us);
+}
 
-	printf("Trying to delete 'file2.txt' should fail, as it's open:\n");
-	fd2 = mini_file_open(fs, "file2.txt", true);
-	score(fd2 != NULL);
-	score(mini_file_delete(fs, "file2.txt") == false);
-	printf("\n");
+static int cmd_replay(int argc, char **argv) {
+	bool timed = argc == 5 && strcmp(argv[4], "--timed") == 0;
+	if (argc != 4 && !timed) {
+		usage();
+		return 2;
+	}
+	FAT_REPLAY_REPORT report;
+	if (!mini_fat_trace_replay(argv[2], argv[3], timed, &report)) {
+		return 1;
+	}
+	printf("Replayed %lld calls in %.3f s, %lld with other results than traced\n",
+		(long long)report.records, report.seconds, (long long)report.mismatched);
+	printf("%-8s %-8s %10s %10s %10s %10s %10s %10s\n", "op", "", "calls", "mean us", "p50 us", "p90 us", "p99 us", "max us");
+	for (int op = 1; op < FAT_TRACE_OP_COUNT; op++) {
+		if (report.traced[op].count == 0) continue;
+		print_latency("traced", mini_fat_trace_op_name(op), report.traced[op]);
+		print_latency("replayed", mini_fat_trace_op_name(op), report.replayed[op]);
+	}
+	return report.mismatched == 0 ? 0 : 1;
+}
 
-	printf("Closing handle to 'file2.txt' should work.\n");
-	score(mini_file_close(fs, fd2));
+static int cmd_ls(FAT_FILESYSTEM * fs, int argc, char **argv) {
+	for (int i = 0; i < (int)fs->files.size(); ++i) {
+		printf("%12lld  %s\n", (long long)fs->files[i]->size, fs->files[i]->name);
+	}
+	return 0;
+}
 
-	printf("Closing handle to 'file2.txt' again should fail:\n");
-	score(mini_file_close(fs, fd2) == false);
+static void print_bulk_stats(const char * verb, const FAT_BULK_STATS &stats) {
+	printf("%s %d files, %lld bytes", verb, stats.files, (long long)stats.bytes);
+	if (stats.failed > 0) {
+		printf(", %d failed", stats.failed);
+	}
 	printf("\n");
-
-	printf("Trying to delete 'file2.txt' should now work.\n");
-	score(mini_file_delete(fs, "file2.txt"), 3);
 }
 
-
-void test_write_to_file1(FAT_FILESYSTEM * fs) {
-	FAT_OPEN_FILE *fd1;
-	// Create a long string (more than 1 block):
-	char buffer[4096] = "";
-	char num[5];
-	for (int i=0; i<50; ++i) {
-		num[0] = (i/10) + '0';
-		num[1] = (i%10) + '0';
-		num[2] = '.';
-		num[3] = ' ';
-		num[4] = 0;
-		strcat(buffer, num);
-		strcat(buffer, fox);
+static int cmd_cp_in(FAT_FILESYSTEM * fs, int argc, char **argv) {
+	int workers = parse_workers(argc, argv);
+	if (argc != 4 && argc != 5) {
+		usage();
+		return 2;
 	}
-
-	int written;
-
-	printf("Writing 3 chunks of 45 bytes, all should fit in 1 block.\n");
-	fd1 = mini_file_open(fs, "file1.txt", true);
-	written = mini_file_write(fs, fd1, strlen(fox), fox);
-	score(written == 45);
-	score(mini_file_size(fs, "file1.txt") == 45, 2);
-
-	written = mini_file_write(fs, fd1, strlen(fox), fox);
-	score(written == 45);
-	score(mini_file_size(fs, "file1.txt") == 45*2);
-
-	written = mini_file_write(fs, fd1, strlen(fox), fox);
-	score(written == 45);
-	score(mini_file_size(fs, "file1.txt") == 45*3);
-
-	printf("Writing 1 chunk of %d bytes, should fit in multiple block (new blocks).\n", (int)strlen(buffer));
-	written = mini_file_write(fs, fd1, strlen(buffer), buffer);
-	score(written == strlen(buffer), 3);
-	score(mini_file_size(fs, "file1.txt") == 45*3+strlen(buffer), 2);
-
-	printf("Writing another chunk of 45 bytes, should fit in the last block.\n");
-	written = mini_file_write(fs, fd1, strlen(fox), fox);
-	score(written == 45);
-	score(mini_file_size(fs, "file1.txt") == 45*4+strlen(buffer));
-
-	score(mini_file_close(fs, fd1));
+	FAT_BULK_STATS stats;
+	bool ok = mini_bulk_import(fs, argv[3], argc == 5 ? argv[4] : NULL, workers, &stats);
+	print_bulk_stats("Imported", stats);
+	return ok ? 0 : 1;
 }
 
-void test_read_from_file1(FAT_FILESYSTEM * fs) {
-	FAT_OPEN_FILE *fd1, *fd2;
-	char buffer[4096];
-	int read;
-
-	printf("Reading 45 bytes from file.\n");
-
-	memset(buffer, 0, sizeof(buffer));
-	fd2 = mini_file_open(fs, "file1.txt", false);
-	read = mini_file_read(fs, fd2, 45, buffer);
-	score(read == 45);
-	score(strcmp(buffer, fox) == 0, 2);
-
-	printf("Reading another 45 bytes from file.\n");
-
-	memset(buffer, 0, sizeof(buffer));
-	read = mini_file_read(fs, fd2, 45, buffer);
-	score(read == 45);
-	score(strcmp(buffer, fox) == 0);
-	// printf("\t[%d] %s\n", read, buffer);
-
-	printf("Reading 1 byte from file.\n");
-	memset(buffer, 0, sizeof(buffer));
-	read = mini_file_read(fs, fd2, 1, buffer);
-	score(strcmp(buffer, "T") == 0);
-
-	printf("Reading the rest of the file.\n");
-	memset(buffer, 0, sizeof(buffer));
-	read = mini_file_read(fs, fd2, 4096, buffer);
-	score(read == 2539); // There's nothing more to read.
-	score(strcmp(buffer+strlen(buffer)-5, "dog.\n") == 0);
-
-
-	printf("Attempting to read from an empty file.\n");
-	fd1 = mini_file_open(fs, "file3.txt", false);
-	read = mini_file_read(fs, fd1, 10, buffer);
-	score(read == 0);
-
-	mini_file_close(fs, fd1);
-	mini_file_close(fs, fd2);
-
+static int cmd_cp_out(FAT_FILESYSTEM * fs, int argc, char **argv) {
+	int workers = parse_workers(argc, argv);
+	if (argc != 5) {
+		usage();
+		return 2;
+	}
+	FAT_BULK_STATS stats;
+	bool ok = mini_bulk_export(fs, argv[3], argv[4], workers, &stats);
+	print_bulk_stats("Exported", stats);
+	return ok ? 0 : 1;
 }
 
-void test_seek(FAT_FILESYSTEM * fs) {
-	FAT_OPEN_FILE *fd1, *fd2;
-	char buffer[4096];
-	int read;
-	bool res;
-
-
-	fd1 = mini_file_open(fs, "file1.txt", true);
-	fd2 = mini_file_open(fs, "file1.txt", false);
-
-	printf("Reading 45 bytes from beginning file.\n");
-	memset(buffer, 0, sizeof(buffer));
-	res = mini_file_seek(fs, fd2, 0, true); // Seek to start
-	score(res);
-	read = mini_file_read(fs, fd2, 45, buffer);
-	score(read == 45);
-	score(strcmp(buffer, fox) == 0);
-
-	printf("Reading 45 bytes from beginning file again.\n");
-	memset(buffer, 0, sizeof(buffer));
-	res = mini_file_seek(fs, fd2, 0, true); // Seek to start
-	score(res);
-	read = mini_file_read(fs, fd2, 45, buffer);
-	score(read == 45);
-	score(strcmp(buffer, fox) == 0);
-
-	printf("Seeking to negative.\n");
-	memset(buffer, 0, sizeof(buffer));
-	res = mini_file_seek(fs, fd2, -10, true); // Seek to start
-	score(res == false);
-	read = mini_file_read(fs, fd2, 45, buffer);
-	score(read == 45);
-	score(strcmp(buffer, fox) == 0);
-
-	printf("Seeking to after file.\n");
-	memset(buffer, 0, sizeof(buffer));
-	res = mini_file_seek(fs, fd2, mini_file_size(fs, "file1.txt") + 1, true); // Seek to start
-	score(res == false);
-
-	printf("Seeking 45 bytes forward.\n");
-	memset(buffer, 0, sizeof(buffer));
-	// res = mini_file_seek(fs, fd2, 0, true); // Seek to start
-	res = mini_file_seek(fs, fd2, -45, false);
-	score(res == true);
-	read = mini_file_read(fs, fd2, 45, buffer);
-	printf("%s\n", buffer);
-	score(read == 45);
-	score(strcmp(buffer, fox) == 0);
-
-	printf("Relative seek to negative.\n");
-	res = mini_file_seek(fs, fd2, -90 -1, false);
-	score(res == false);
-
-	printf("Relative seek to after file.\n");
-	res = mini_file_seek(fs, fd2, mini_file_size(fs, "file1.txt") - 90 + 1, false);
-	score(res == false);
-
-	printf("Seek to middle of file and overwrite.\n");
-	res = mini_file_seek(fs, fd1, 45 + 4, true);
-	score(res);
-	int written = mini_file_write(fs ,fd1, 5, "slowy");
-	score(written = 5);
-
-	res = mini_file_seek(fs, fd1, -5, false);
-	memset(buffer, 0, sizeof(buffer));
-	read = mini_file_read(fs, fd1, 5, buffer);
-	score(read == 5);
-	score(strcmp(buffer, "slowy") == 0);
-
-	res = mini_file_seek(fs, fd2, 45, true);
-	memset(buffer, 0, sizeof(buffer));
-	read = mini_file_read(fs, fd2, 45, buffer);
-	score(strcmp(buffer, "The slowy brown fox jumps over the lazy dog.\n") == 0);
-
-	mini_file_close(fs, fd1);
-	mini_file_close(fs, fd2);
+static void print_trim_stats(const FAT_TRIM_STATS &stats) {
+	printf("Reclaimed %lld bytes in %lld ranges\n", (long long)stats.bytes_reclaimed, (long long)stats.ranges_punched);
 }
 
-void test_suite(FAT_FILESYSTEM * fs) {
-	test_open_3_files(fs);
-	test_delete_file2(fs);
-
-	test_write_to_file1(fs);
-	test_read_from_file1(fs);
+static int cmd_rm(FAT_FILESYSTEM * fs, int argc, char **argv) {
+	if (argc < 4) {
+		usage();
+		return 2;
+	}
+	int count = argc - 3;
+	mini_fat_trim_start(fs, 0);
+	int deleted = mini_file_batch_delete(fs, argv + 3, count, NULL);
+	mini_fat_trim_flush(fs);
+	print_trim_stats(mini_fat_trim_stats(fs));
+	mini_fat_trim_stop(fs);
+	return deleted == count ? 0 : 1;
+}
 
-	test_seek(fs);
+static int cmd_trim(FAT_FILESYSTEM * fs, int argc, char **argv) {
+	if (argc != 3 && argc != 4) {
+		usage();
+		return 2;
+	}
+	mini_fat_trim_start(fs, argc == 4 ? atoll(argv[3]) : 0);
+	mini_fat_trim_free_blocks(fs);
+	mini_fat_trim_flush(fs);
+	print_trim_stats(mini_fat_trim_stats(fs));
+	mini_fat_trim_stop(fs);
+	return mini_fat_save(fs) ? 0 : 1;
+}
 
-	mini_fat_dump(fs);
+static int cmd_stat(FAT_FILESYSTEM * fs, int argc, char **argv) {
+	if (argc == 4) {
+		FAT_FILE * file = mini_file_find(fs, argv[3]);
+		if (file == NULL) {
+			fprintf(stderr, "File '%s' does not exist.\n", argv[3]);
+			return 1;
+		}
+		mini_file_dump(fs, file);
+		return 0;
+	}
+	fat_block_t used = 0;
+	for (fat_block_t i = 0; i < fs->block_count; ++i) {
+		used += fs->block_map[i] != EMPTY_BLOCK;
+	}
+	printf("Block size:  %d\n", fs->block_size);
+	printf("Blocks:      %lld (%lld used, %lld free)\n", (long long)fs->block_count, (long long)used, (long long)(fs->block_count - used));
+	printf("Files:       %d\n", (int)fs->files.size());
+	if (fs->dedup != NULL) {
+		FAT_DEDUP_STATS stats = mini_fat_dedup_stats(fs);
+		printf("Dedup:       %lld blocks shared by %lld references (ratio %.2f)\n", (long long)stats.unique_blocks, (long long)stats.references, stats.ratio);
+	}
+	if (fs->tier != NULL) {
+		FAT_TIER_STATS stats = mini_fat_tier_stats(fs);
+		printf("Fast tier:   %lld blocks from block %lld (%lld used) in '%s'\n", (long long)stats.fast_blocks,
+			(long long)fs->tier_boundary, (long long)stats.fast_used, mini_fat_tier_filename(fs));
+	}
+	return 0;
 }
 
+static int cmd_check(FAT_FILESYSTEM * fs, int argc, char **argv) {
+	int workers = parse_workers(argc, argv);
+	bool repair = argc == 4 && strcmp(argv[3], "--repair") == 0;
+	if (argc != 3 && !repair) {
+		usage();
+		return 2;
+	}
+	FAT_CHECK_REPORT report;
+	bool clean = mini_fat_check(fs, repair, workers, &report);
+	for (size_t i = 0; i < report.messages.size(); ++i) {
+		printf("%s\n", report.messages[i].c_str());
+	}
+	printf("Leaked blocks:     %lld\n", (long long)report.leaked);
+	printf("Shared blocks:     %lld\n", (long long)report.shared);
+	printf("Mistyped blocks:   %lld\n", (long long)report.mismatched);
+	printf("Invalid block ids: %lld\n", (long long)report.invalid);
+	printf("Bad file sizes:    %d\n", report.bad_sizes);
+	printf("Bad refcounts:     %lld\n", (long long)report.bad_refcounts);
+	if (repair) {
+		printf("Repaired blocks:   %lld\n", (long long)report.repaired);
+		if (report.repaired > 0 && !mini_fat_save(fs)) {
+			return 1;
+		}
+	}
+	printf("%s\n", clean ? "Volume is consistent." : "Volume has errors.");
+	return clean ? 0 : 1;
+}
 
-int main()
+int main(int argc, char **argv)
 {
-	printf("Creating a FAT filesystem:\n");
-	FAT_FILESYSTEM * fs = mini_fat_create("fs1.fat", 1024, 10);
-
-	test_small_filesystem(mini_fat_create("temp.fat", 128, 3)); // Only 3 blocks, 1 metadata, 2 files.
-
-	test_suite(fs);
-
-	if (current_score == total_score) {
-		// Everything is working, now test save/load:
-		printf("Saving the FAT filesystem.\n");
-		score(mini_fat_save(fs), 6);
-
-		printf("Loading the FAT filesystem.\n");
-		FAT_FILESYSTEM *loaded_fs = mini_fat_load("fs1.fat");
-		mini_fat_dump(loaded_fs);
-
-		score(mini_file_delete(loaded_fs, "file1.txt"));
-		test_suite(loaded_fs);
-	} else {
-		printf("Skipping save/load tests as other tests are not passing.\n");
+	if (argc < 3) {
+		usage();
+		return 2;
+	}
+	const char * command = argv[1];
+	if (strcmp(command, "mkfs") == 0) {
+		return cmd_mkfs(argc, argv);
+	}
+	if (strcmp(command, "replay") == 0) {
+		return cmd_replay(argc, argv);
 	}
 
-
-	printf("Final score: %d/%d\n", current_score/3*2, 100);
-	return 0;
+	int (*run)(FAT_FILESYSTEM *, int, char **) = NULL;
+	if (strcmp(command, "ls") == 0) run = cmd_ls;
+	else if (strcmp(command, "cp-in") == 0) run = cmd_cp_in;
+	else if (strcmp(command, "cp-out") == 0) run = cmd_cp_out;
+	else if (strcmp(command, "rm") == 0) run = cmd_rm;
+	else if (strcmp(command, "stat") == 0) run = cmd_stat;
+	else if (strcmp(command, "check") == 0) run = cmd_check;
+	else if (strcmp(command, "trim") == 0) run = cmd_trim;
+	else if (strcmp(command, "dump") == 0) run = [](FAT_FILESYSTEM * fs, int, char **) { mini_fat_dump(fs); return 0; };
+	if (run == NULL) {
+		usage();
+		return 2;
+	}
+	bool direct = parse_option(argc, argv, "--direct");
+	bool shared = parse_option(argc, argv, "--shared");
+	FAT_FILESYSTEM * fs = mini_fat_load(argv[2]);
+	if ((direct && !mini_fat_direct_enable(fs)) || (shared && !mini_fat_share_mount(fs))) {
+		return 1;
+	}
+	int status = run(fs, argc, argv);
+	mini_fat_share_unmount(fs);
+	return status;
 }
-
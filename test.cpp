@@ -0,0 +1,1345 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdarg>
+#include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "fat.h"
+#include "fat_file.h"
+#include "fat_check.h"
+#include "fat_dedup.h"
+#include "fat_direct.h"
+#include "fat_share.h"
+#include "fat_tier.h"
+#include "fat_lock.h"
+#include "fat_memory.h"
+#include "fat_trace.h"
+#include "fat_trim.h"
+
+const char * fox = "The quick brown fox jumps over the lazy dog.\n";
+
+int total_score = 0;
+int current_score = 0;
+inline void score2(const bool cond, const char * fmt, ...)
+{
+	va_list args;
+   va_start(args, fmt);
+   vprintf(fmt, args);
+   va_end(args);
+	current_score += cond;
+	total_score++;
+}
+inline void score(const bool cond, int points = 1) {
+	current_score += cond*points;
+	total_score+=points;
+	if (cond)
+		printf("  => Pass\n");
+	else
+		printf("  => Fail\n");
+}
+
+void test_small_filesystem(FAT_FILESYSTEM * fs) {
+	FAT_OPEN_FILE *fd1, *fd2, *fd3;
+	printf("Openning 1st file in write mode should work.\n");
+	fd1 = mini_file_open(fs, "file1.txt", true);
+	score(fd1 != NULL);
+
+	printf("Openning 2nd file in write mode should work.\n");
+	fd2 = mini_file_open(fs, "file2.txt", true);
+	score(fd2 != NULL);
+
+	printf("Openning 3rd file in write mode should not work:\n");
+	fd3 = mini_file_open(fs, "file3.txt", true);
+	score(fd3 == NULL);
+}
+
+void test_open_3_files(FAT_FILESYSTEM * fs) {
+	FAT_OPEN_FILE *fd1, *fd2, *fd3, *fd4, *fd5, *fd6;
+	// Openning three files:
+	printf("Openning a non-existing file in read mode should error:\n");
+	fd1 = mini_file_open(fs, "file1.txt", false);
+	score(fd1 == NULL);
+	printf("\n");
+
+	printf("Openning a non-existing file in write mode should work.\n");
+	fd1 = mini_file_open(fs, "file1.txt", true);
+	score(fd1 != NULL);
+
+	printf("Openning an existing file in write mode (again) should error:\n");
+	fd2 = mini_file_open(fs, "file1.txt", true);
+	score(fd2 == NULL);
+	printf("\n");
+
+	printf("Openning an existing file in read mode (again) should work.\n");
+	fd2 = mini_file_open(fs, "file1.txt", false);
+	score(fd2 != NULL);
+
+	printf("Openning an existing file in read mode (again, 2nd time) should work.\n");
+	fd3 = mini_file_open(fs, "file1.txt", false);
+	score(fd3 != NULL);
+
+	printf("Openning 2nd, non-existing file in write mode should work.\n");
+	fd4 = mini_file_open(fs, "file2.txt", true);
+	score(fd4 != NULL);
+
+	printf("Openning 2nd, non-existing file in write mode (again) should error:\n");
+	fd5 = mini_file_open(fs, "file2.txt", true);
+	score(fd5 == NULL);
+	printf("\n");
+
+	printf("Closing 2nd file should work.\n");
+	score(mini_file_close(fs, fd4));
+
+	printf("Reopenning 2nd file in write mode should work.\n");
+	fd4 = mini_file_open(fs, "file2.txt", true);
+	score(fd4 != NULL);
+
+	printf("Openning 3rd, non-existing file in write mode should work.\n");
+	fd6 = mini_file_open(fs, "file3.txt", true);
+	score(fd6 != NULL);
+
+	score(mini_file_close(fs, fd1));
+	score(mini_file_close(fs, fd2));
+	score(mini_file_close(fs, fd3));
+	score(mini_file_close(fs, fd4));
+	score(mini_file_close(fs, fd5) == false);
+	score(mini_file_close(fs, fd6));
+}
+
+void test_delete_file2(FAT_FILESYSTEM * fs) {
+	FAT_OPEN_FILE *fd1, *fd2;
+	// Deleting the second file:
+	printf("Trying to delelete 'file1.txt' should fail, as it's open:\n");
+	fd1 = mini_file_open(fs, "file1.txt", true);
+	score(fd1 != NULL);
+	score(mini_file_delete(fs, "file1.txt") == false);
+	score(mini_file_close(fs, fd1));
+	printf("\n");
+
+	printf("Trying to delete 'file2.txt' should fail, as it's open:\n");
+	fd2 = mini_file_open(fs, "file2.txt", true);
+	score(fd2 != NULL);
+	score(mini_file_delete(fs, "file2.txt") == false);
+	printf("\n");
+
+	printf("Closing handle to 'file2.txt' should work.\n");
+	score(mini_file_close(fs, fd2));
+
+	printf("Closing handle to 'file2.txt' again should fail:\n");
+	score(mini_file_close(fs, fd2) == false);
+	printf("\n");
+
+	printf("Trying to delete 'file2.txt' should now work.\n");
+	score(mini_file_delete(fs, "file2.txt"), 3);
+}
+
+
+void test_write_to_file1(FAT_FILESYSTEM * fs) {
+	FAT_OPEN_FILE *fd1;
+	// Create a long string (more than 1 block):
+	char buffer[4096] = "";
+	char num[5];
+	for (int i=0; i<50; ++i) {
+		num[0] = (i/10) + '0';
+		num[1] = (i%10) + '0';
+		num[2] = '.';
+		num[3] = ' ';
+		num[4] = 0;
+		strcat(buffer, num);
+		strcat(buffer, fox);
+	}
+
+	int written;
+
+	printf("Writing 3 chunks of 45 bytes, all should fit in 1 block.\n");
+	fd1 = mini_file_open(fs, "file1.txt", true);
+	written = mini_file_write(fs, fd1, strlen(fox), fox);
+	score(written == 45);
+	score(mini_file_size(fs, "file1.txt") == 45, 2);
+
+	written = mini_file_write(fs, fd1, strlen(fox), fox);
+	score(written == 45);
+	score(mini_file_size(fs, "file1.txt") == 45*2);
+
+	written = mini_file_write(fs, fd1, strlen(fox), fox);
+	score(written == 45);
+	score(mini_file_size(fs, "file1.txt") == 45*3);
+
+	printf("Writing 1 chunk of %d bytes, should fit in multiple block (new blocks).\n", (int)strlen(buffer));
+	written = mini_file_write(fs, fd1, strlen(buffer), buffer);
+	score(written == strlen(buffer), 3);
+	score(mini_file_size(fs, "file1.txt") == 45*3+strlen(buffer), 2);
+
+	printf("Writing another chunk of 45 bytes, should fit in the last block.\n");
+	written = mini_file_write(fs, fd1, strlen(fox), fox);
+	score(written == 45);
+	score(mini_file_size(fs, "file1.txt") == 45*4+strlen(buffer));
+
+	score(mini_file_close(fs, fd1));
+}
+
+void test_read_from_file1(FAT_FILESYSTEM * fs) {
+	FAT_OPEN_FILE *fd1, *fd2;
+	char buffer[4096];
+	int read;
+
+	printf("Reading 45 bytes from file.\n");
+
+	memset(buffer, 0, sizeof(buffer));
+	fd2 = mini_file_open(fs, "file1.txt", false);
+	read = mini_file_read(fs, fd2, 45, buffer);
+	score(read == 45);
+	score(strcmp(buffer, fox) == 0, 2);
+
+	printf("Reading another 45 bytes from file.\n");
+
+	memset(buffer, 0, sizeof(buffer));
+	read = mini_file_read(fs, fd2, 45, buffer);
+	score(read == 45);
+	score(strcmp(buffer, fox) == 0);
+	// printf("\t[%d] %s\n", read, buffer);
+
+	printf("Reading 1 byte from file.\n");
+	memset(buffer, 0, sizeof(buffer));
+	read = mini_file_read(fs, fd2, 1, buffer);
+	score(strcmp(buffer, "T") == 0);
+
+	printf("Reading the rest of the file.\n");
+	memset(buffer, 0, sizeof(buffer));
+	read = mini_file_read(fs, fd2, 4096, buffer);
+	score(read == 2539); // There's nothing more to read.
+	score(strcmp(buffer+strlen(buffer)-5, "dog.\n") == 0);
+
+
+	printf("Attempting to read from an empty file.\n");
+	fd1 = mini_file_open(fs, "file3.txt", false);
+	read = mini_file_read(fs, fd1, 10, buffer);
+	score(read == 0);
+
+	mini_file_close(fs, fd1);
+	mini_file_close(fs, fd2);
+
+}
+
+void test_seek(FAT_FILESYSTEM * fs) {
+	FAT_OPEN_FILE *fd1, *fd2;
+	char buffer[4096];
+	int read;
+	bool res;
+
+
+	fd1 = mini_file_open(fs, "file1.txt", true);
+	fd2 = mini_file_open(fs, "file1.txt", false);
+
+	printf("Reading 45 bytes from beginning file.\n");
+	memset(buffer, 0, sizeof(buffer));
+	res = mini_file_seek(fs, fd2, 0, true); // Seek to start
+	score(res);
+	read = mini_file_read(fs, fd2, 45, buffer);
+	score(read == 45);
+	score(strcmp(buffer, fox) == 0);
+
+	printf("Reading 45 bytes from beginning file again.\n");
+	memset(buffer, 0, sizeof(buffer));
+	res = mini_file_seek(fs, fd2, 0, true); // Seek to start
+	score(res);
+	read = mini_file_read(fs, fd2, 45, buffer);
+	score(read == 45);
+	score(strcmp(buffer, fox) == 0);
+
+	printf("Seeking to negative.\n");
+	memset(buffer, 0, sizeof(buffer));
+	res = mini_file_seek(fs, fd2, -10, true); // Seek to start
+	score(res == false);
+	read = mini_file_read(fs, fd2, 45, buffer);
+	score(read == 45);
+	score(strcmp(buffer, fox) == 0);
+
+	printf("Seeking to after file.\n");
+	memset(buffer, 0, sizeof(buffer));
+	res = mini_file_seek(fs, fd2, mini_file_size(fs, "file1.txt") + 1, true); // Seek to start
+	score(res == false);
+
+	printf("Seeking 45 bytes forward.\n");
+	memset(buffer, 0, sizeof(buffer));
+	// res = mini_file_seek(fs, fd2, 0, true); // Seek to start
+	res = mini_file_seek(fs, fd2, -45, false);
+	score(res == true);
+	read = mini_file_read(fs, fd2, 45, buffer);
+	printf("%s\n", buffer);
+	score(read == 45);
+	score(strcmp(buffer, fox) == 0);
+
+	printf("Relative seek to negative.\n");
+	res = mini_file_seek(fs, fd2, -90 -1, false);
+	score(res == false);
+
+	printf("Relative seek to after file.\n");
+	res = mini_file_seek(fs, fd2, mini_file_size(fs, "file1.txt") - 90 + 1, false);
+	score(res == false);
+
+	printf("Seek to middle of file and overwrite.\n");
+	res = mini_file_seek(fs, fd1, 45 + 4, true);
+	score(res);
+	int written = mini_file_write(fs ,fd1, 5, "slowy");
+	score(written = 5);
+
+	res = mini_file_seek(fs, fd1, -5, false);
+	memset(buffer, 0, sizeof(buffer));
+	read = mini_file_read(fs, fd1, 5, buffer);
+	score(read == 5);
+	score(strcmp(buffer, "slowy") == 0);
+
+	res = mini_file_seek(fs, fd2, 45, true);
+	memset(buffer, 0, sizeof(buffer));
+	read = mini_file_read(fs, fd2, 45, buffer);
+	score(strcmp(buffer, "The slowy brown fox jumps over the lazy dog.\n") == 0);
+
+	mini_file_close(fs, fd1);
+	mini_file_close(fs, fd2);
+}
+
+void test_read_view(FAT_FILESYSTEM * fs) {
+	FAT_OPEN_FILE *fd1, *fd2;
+	FAT_READ_VIEW *view;
+	char buffer[4096];
+	char joined[4096];
+	int read;
+
+	fd1 = mini_file_open(fs, "file1.txt", true);
+	fd2 = mini_file_open(fs, "file1.txt", false);
+
+	printf("Zero-copy read of the whole file should match a normal read.\n");
+	memset(buffer, 0, sizeof(buffer));
+	read = mini_file_read(fs, fd2, sizeof(buffer), buffer);
+	mini_file_seek(fs, fd2, 0, true);
+	view = mini_file_read_view(fs, fd2, sizeof(buffer));
+	score(view != NULL && view->size == read);
+	int joined_size = 0;
+	bool in_image = true;
+	for (int i=0; view != NULL && i<(int)view->spans.size(); ++i) {
+		const unsigned char * data = (const unsigned char *)view->spans[i].data;
+		in_image = in_image && data >= fs->image_map && data + view->spans[i].size <= fs->image_map + fs->image_map_size;
+		memcpy(joined + joined_size, data, view->spans[i].size);
+		joined_size += view->spans[i].size;
+	}
+	score(joined_size == read && memcmp(joined, buffer, read) == 0);
+	printf("Spans should point into the mapped image.\n");
+	score(in_image);
+
+	printf("Overwriting a pinned block should not change the view.\n");
+	mini_file_write(fs, fd1, 3, "THE");
+	score(memcmp(view->spans[0].data, "The", 3) == 0);
+	mini_file_seek(fs, fd2, 0, true);
+	memset(buffer, 0, sizeof(buffer));
+	read = mini_file_read(fs, fd2, 3, buffer);
+	score(strcmp(buffer, "THE") == 0);
+
+	printf("Releasing the view should unpin all blocks.\n");
+	score(mini_file_release_view(fs, view));
+	score(fs->block_pins.empty() && fs->pinned_blocks == 0 && fs->deferred_free.empty());
+
+	mini_file_close(fs, fd1);
+	mini_file_close(fs, fd2);
+}
+
+void test_suite(FAT_FILESYSTEM * fs) {
+	test_open_3_files(fs);
+	test_delete_file2(fs);
+
+	test_write_to_file1(fs);
+	test_read_from_file1(fs);
+
+	test_seek(fs);
+	test_read_view(fs);
+
+	printf("The volume should be consistent after all of the above.\n");
+	score(mini_fat_check(fs, false, 4, NULL));
+
+	mini_fat_dump(fs);
+}
+
+
+void test_large_offsets() {
+	// 6 GB of 4 KB blocks; the host file stays sparse.
+	const fat_off_t GB = (fat_off_t)1 << 30;
+	FAT_FILESYSTEM * fs = mini_fat_create("large.fat", 4096, 6 * GB / 4096);
+	char buffer[8192];
+
+	printf("Block helpers should reach past 4 GB.\n");
+	fat_block_t far_block = 5 * GB / 4096;
+	score(mini_fat_write_in_block(fs, far_block, 10, 45, fox) == 45);
+	memset(buffer, 0, sizeof(buffer));
+	score(mini_fat_read_in_block(fs, far_block, 10, 45, buffer) == 45 && strcmp(buffer, fox) == 0);
+	score(position_to_block_index(fs, 5 * GB + 10) == far_block && position_to_byte_index(fs, 5 * GB + 10) == 10);
+
+	printf("Files should work with blocks past 4 GB, also after save/load.\n");
+	// Pretend everything below 4.5 GB is in use, so the file lands above it.
+	for (fat_block_t i = 1; i < 9 * GB / 2 / 4096; ++i) {
+		fs->block_map[i] = FILE_DATA_BLOCK;
+	}
+	char data[8192];
+	for (int i = 0; i < (int)sizeof(data); ++i) {
+		data[i] = fox[i % 45];
+	}
+	FAT_OPEN_FILE * fd = mini_file_open(fs, "far.txt", true);
+	score(mini_file_write(fs, fd, 100, data) == 100);
+	score(mini_file_write(fs, fd, sizeof(data) - 100, data + 100) == sizeof(data) - 100);
+	score(fd->file->block_ids[0] * fs->block_size > 4 * GB);
+	mini_file_close(fs, fd);
+	score(mini_fat_save(fs));
+
+	FAT_FILESYSTEM * loaded = mini_fat_load("large.fat");
+	score(loaded->block_count == 6 * GB / 4096 && mini_file_size(loaded, "far.txt") == sizeof(data));
+	fd = mini_file_open(loaded, "far.txt", false);
+	memset(buffer, 0, sizeof(buffer));
+	score(mini_file_read(loaded, fd, sizeof(buffer), buffer) == sizeof(data) && memcmp(buffer, data, sizeof(data)) == 0);
+	mini_file_close(loaded, fd);
+	unlink("large.fat");
+}
+
+void test_load_version1() {
+	// Layout written before 64-bit support: int block_size, int block_count
+	// in block 0, then after the last block the block map and a file table
+	// with 32-bit sizes and block ids.
+	const int block_size = 128, block_count = 4;
+	FILE * f = fopen("legacy.fat", "wb");
+	fwrite(&block_size, sizeof(int), 1, f);
+	fwrite(&block_count, sizeof(int), 1, f);
+	fseek(f, 2 * block_size, SEEK_SET);
+	fwrite("hello", 1, 5, f);
+	fseek(f, block_count * block_size, SEEK_SET);
+	unsigned char map[block_count] = {METADATA_BLOCK, FILE_ENTRY_BLOCK, FILE_DATA_BLOCK, EMPTY_BLOCK};
+	fwrite(map, 1, block_count, f);
+	size_t files = 1, blocks = 1;
+	char name[MAX_FILENAME_LENGTH] = "old.txt";
+	int size = 5, metadata_block = 1, data_block = 2;
+	fwrite(&files, sizeof(size_t), 1, f);
+	fwrite(name, MAX_FILENAME_LENGTH, 1, f);
+	fwrite(&size, sizeof(int), 1, f);
+	fwrite(&metadata_block, sizeof(int), 1, f);
+	fwrite(&blocks, sizeof(size_t), 1, f);
+	fwrite(&data_block, sizeof(int), 1, f);
+	fclose(f);
+
+	printf("Loading a version 1 image should work.\n");
+	FAT_FILESYSTEM * fs = mini_fat_load("legacy.fat");
+	score(fs->block_size == block_size && fs->block_count == block_count && fs->block_map[2] == FILE_DATA_BLOCK);
+	char buffer[16];
+	memset(buffer, 0, sizeof(buffer));
+	FAT_OPEN_FILE * fd = mini_file_open(fs, "old.txt", false);
+	score(fd != NULL && mini_file_read(fs, fd, sizeof(buffer), buffer) == 5 && strcmp(buffer, "hello") == 0);
+	mini_file_close(fs, fd);
+
+	printf("Saving upgrades it to the current version.\n");
+	score(mini_fat_save(fs));
+	FAT_FILESYSTEM * upgraded = mini_fat_load("legacy.fat");
+	score(mini_file_size(upgraded, "old.txt") == 5 && upgraded->files[0]->block_ids[0] == 2);
+
+	printf("A superblock whose table does not fit the image should be refused, not allocated.\n");
+	int image = open("legacy.fat", O_WRONLY);
+	fat_off_t huge = (fat_off_t) 1 << 60;
+	score(pwrite(image, &huge, sizeof(huge), 40) == sizeof(huge));
+	close(image);
+	pid_t child = fork();
+	if (child == 0) {
+		mini_fat_load("legacy.fat");
+		_exit(0);
+	}
+	int status = 0;
+	waitpid(child, &status, 0);
+	score(WIFEXITED(status) && WEXITSTATUS(status) == 255);
+	unlink("legacy.fat");
+}
+
+void test_batch() {
+	FAT_FILESYSTEM * fs = mini_fat_create("batch.fat", 128, 64);
+	const char * names[] = {"c.txt", "a.txt", "b.txt", "a.txt", "d.txt"};
+	bool results[5];
+	fat_off_t sizes[5];
+
+	printf("Batch create should skip duplicate names.\n");
+	score(mini_file_batch_create(fs, names, 5, results) == 4);
+	score(results[0] && results[1] && results[2] && !results[3] && results[4]);
+	score(fs->files.size() == 4 && mini_file_find(fs, "d.txt") != NULL);
+	printf("Entry blocks should come from one pass, lowest first.\n");
+	score(mini_file_find(fs, "a.txt")->metadata_block_id == 1 && mini_file_find(fs, "d.txt")->metadata_block_id == 4);
+
+	printf("Batch create of existing names should fail.\n");
+	score(mini_file_batch_create(fs, names, 2, results) == 0 && !results[0] && !results[1]);
+
+	FAT_OPEN_FILE * fd = mini_file_open(fs, "b.txt", true);
+	mini_file_write(fs, fd, 45, fox);
+	printf("Batch stat should report sizes, -1 for missing files.\n");
+	const char * stat_names[] = {"b.txt", "x.txt", "a.txt"};
+	score(mini_file_batch_stat(fs, stat_names, 3, sizes) == 2 && sizes[0] == 45 && sizes[1] == -1 && sizes[2] == 0);
+
+	printf("Batch rename should keep open handles and refuse taken names.\n");
+	const char * old_names[] = {"b.txt", "c.txt"};
+	const char * new_names[] = {"e.txt", "d.txt"};
+	score(mini_file_batch_rename(fs, old_names, new_names, 2, results) == 1 && results[0] && !results[1]);
+	score(mini_file_find(fs, "b.txt") == NULL && mini_file_find(fs, "e.txt") == fd->file);
+	score(mini_file_write(fs, fd, 45, fox) == 45 && mini_file_size(fs, "e.txt") == 90);
+
+	printf("Batch delete should skip files open for writing.\n");
+	const char * delete_names[] = {"e.txt", "a.txt", "c.txt", "x.txt"};
+	score(mini_file_batch_delete(fs, delete_names, 4, results) == 2);
+	score(!results[0] && results[1] && results[2] && !results[3]);
+	mini_file_close(fs, fd);
+
+	printf("Batch operations should be saved.\n");
+	FAT_FILESYSTEM * loaded = mini_fat_load("batch.fat");
+	score(loaded->files.size() == 2 && mini_file_size(loaded, "e.txt") == 90 && mini_file_find(loaded, "d.txt") != NULL);
+	unlink("batch.fat");
+
+	printf("A batch should start in the next group, like a single new file.\n");
+	fs = mini_fat_create("batch.fat", 128, 4 * FAT_GROUP_MIN_BLOCKS);
+	mini_file_close(fs, mini_file_open(fs, "single.txt", true));
+	score(mini_file_batch_create(fs, names, 2, results) == 2);
+	score(mini_file_find(fs, "c.txt")->metadata_block_id / fs->group_blocks == 1);
+
+	printf("A batch that cannot be saved should leave the namespace alone.\n");
+	close(fs->image_fd);
+	fs->image_fd = open("batch.fat", O_RDONLY);
+	score(mini_file_batch_create(fs, delete_names, 4, results) == 0 && !results[0] && !results[3]);
+	score(fs->files.size() == 3 && mini_file_find(fs, "x.txt") == NULL && mini_fat_check(fs, false, 2, NULL));
+	unlink("batch.fat");
+}
+
+void test_check() {
+	FAT_FILESYSTEM * fs = mini_fat_create("check.fat", 128, 1000);
+	FAT_CHECK_REPORT report;
+	char text[300];
+	memset(text, 'c', sizeof(text));
+	FAT_OPEN_FILE * fd = mini_file_open(fs, "a.txt", true);
+	mini_file_write(fs, fd, sizeof(text), text); // 3 data blocks
+	mini_file_close(fs, fd);
+	fd = mini_file_open(fs, "b.txt", true);
+	mini_file_write(fs, fd, 45, fox);
+	mini_file_close(fs, fd);
+
+	printf("Deleting a file should free its entry block too.\n");
+	fd = mini_file_open(fs, "c.txt", true);
+	mini_file_close(fs, fd);
+	score(mini_file_delete(fs, "c.txt"));
+	score(mini_fat_check(fs, false, 4, &report) && report.leaked == 0);
+
+	printf("The check should find leaked, shared and mistyped blocks.\n");
+	fs->block_map[900] = FILE_DATA_BLOCK; // leaked
+	fs->block_map[901] = FILE_ENTRY_BLOCK; // leaked
+	FAT_FILE * b = mini_file_find(fs, "b.txt");
+	b->block_ids.push_back(mini_file_find(fs, "a.txt")->block_ids[0]); // shared
+	b->size += 128;
+	fs->block_map[b->block_ids[0]] = EMPTY_BLOCK; // owned, but free to allocate
+	score(!mini_fat_check(fs, false, 3, &report));
+	score(report.leaked == 2 && report.shared == 1 && report.mismatched == 1 && report.bad_sizes == 0);
+
+	printf("Repair should reclaim leaked blocks and retype owned ones.\n");
+	mini_fat_check(fs, true, 3, &report);
+	score(report.repaired == 3 && fs->block_map[900] == EMPTY_BLOCK && fs->block_map[b->block_ids[0]] == FILE_DATA_BLOCK);
+	b->block_ids.pop_back();
+	b->size -= 128;
+	score(mini_fat_check(fs, false, 1, &report));
+	unlink("check.fat");
+}
+
+static long long allocated_on_host(const char * filename) {
+	struct stat st;
+	return stat(filename, &st) == 0 ? (long long)st.st_blocks * 512 : -1;
+}
+
+void test_trim() {
+	printf("A new virtual disk should be sparse.\n");
+	FAT_FILESYSTEM * fs = mini_fat_create("trim.fat", 4096, 1024); // 4 MB
+	score(allocated_on_host("trim.fat") < 64 * 1024);
+
+	static char data[64 * 1024];
+	memset(data, 'x', sizeof(data));
+	FAT_OPEN_FILE * fd = mini_file_open(fs, "big.bin", true);
+	mini_file_write(fs, fd, sizeof(data), data);
+	mini_file_close(fs, fd);
+	fsync(fs->image_fd);
+	long long written = allocated_on_host("trim.fat");
+
+	printf("Deleting with the trimmer running should punch the freed blocks.\n");
+	fat_block_t first = mini_file_find(fs, "big.bin")->block_ids[0];
+	mini_fat_trim_start(fs, 1024 * 1024);
+	score(mini_file_delete(fs, "big.bin"));
+	score(fs->block_map[first] == TRIM_PENDING_BLOCK); // not reusable before it is punched
+	mini_fat_trim_flush(fs);
+	FAT_TRIM_STATS stats = mini_fat_trim_stats(fs);
+	score(stats.bytes_reclaimed >= (int64_t)sizeof(data) && stats.blocks_pending == 0);
+	score(allocated_on_host("trim.fat") <= written - (long long)sizeof(data));
+
+	printf("Punched blocks should be allocatable again.\n");
+	fat_block_t empty = 0;
+	for (fat_block_t i = 0; i < fs->block_count; i++) {
+		empty += fs->block_map[i] == EMPTY_BLOCK;
+	}
+	score(empty == fs->block_count - 1);
+	score(mini_fat_check(fs, false, 2, NULL));
+
+	printf("A block taken meanwhile should not be marked empty by the trimmer.\n");
+	fat_block_t taken = mini_fat_allocate_new_block(fs, FILE_DATA_BLOCK);
+	score(!mini_fat_change_block_type(fs, taken, TRIM_PENDING_BLOCK, EMPTY_BLOCK) && fs->block_map[taken] == FILE_DATA_BLOCK);
+	mini_fat_set_block_type(fs, taken, EMPTY_BLOCK);
+	mini_fat_trim_stop(fs);
+	unlink("trim.fat");
+}
+
+void test_concurrent_writes() {
+	const int THREADS = 16;
+	const int CHUNKS = 128;
+	FAT_FILESYSTEM * fs = mini_fat_create("groups.fat", 512, 16 * FAT_GROUP_MIN_BLOCKS);
+	score(fs->groups.size() == THREADS);
+
+	printf("Writers of different files should allocate in parallel, each in its own group.\n");
+	std::vector<FAT_OPEN_FILE*> handles;
+	char name[32];
+	for (int t = 0; t < THREADS; t++) {
+		snprintf(name, sizeof(name), "writer%d.bin", t);
+		handles.push_back(mini_file_open(fs, name, true));
+	}
+	std::vector<std::thread> writers;
+	for (int t = 0; t < THREADS; t++) {
+		writers.push_back(std::thread([fs, &handles, t] {
+			char chunk[512];
+			memset(chunk, 'a' + t, sizeof(chunk));
+			for (int c = 0; c < CHUNKS; c++) {
+				mini_file_write(fs, handles[t], sizeof(chunk), chunk);
+			}
+		}));
+	}
+	for (int t = 0; t < THREADS; t++) writers[t].join();
+
+	bool sizes = true, local = true, contents = true;
+	for (int t = 0; t < THREADS; t++) {
+		FAT_FILE * file = handles[t]->file;
+		sizes = sizes && file->size == CHUNKS * 512;
+		for (size_t b = 0; b < file->block_ids.size(); b++) {
+			local = local && file->block_ids[b] / fs->group_blocks == file->metadata_block_id / fs->group_blocks;
+		}
+		char chunk[512];
+		mini_file_seek(fs, handles[t], 0, true);
+		for (int c = 0; c < CHUNKS; c++) {
+			mini_file_read(fs, handles[t], sizeof(chunk), chunk);
+			contents = contents && chunk[0] == 'a' + t && chunk[511] == 'a' + t;
+		}
+		mini_file_close(fs, handles[t]);
+	}
+	score(sizes && contents);
+	score(local);
+	score(mini_fat_check(fs, false, 2, NULL));
+
+	printf("A full group should steal blocks from the next one.\n");
+	FAT_OPEN_FILE * fd = mini_file_open(fs, "writer0.bin", true);
+	mini_file_seek(fs, fd, fd->file->size, true);
+	char more[512 * 200];
+	memset(more, 'z', sizeof(more));
+	score(mini_file_write(fs, fd, sizeof(more), more) == sizeof(more));
+	score(fd->file->block_ids.back() / fs->group_blocks != fd->file->metadata_block_id / fs->group_blocks);
+	mini_file_close(fs, fd);
+	score(mini_fat_check(fs, false, 2, NULL));
+
+	printf("Threads overwriting blocks under their own read views should free them on release.\n");
+	writers.clear();
+	for (int t = 0; t < THREADS; t++) {
+		writers.push_back(std::thread([fs, t] {
+			char name[32], chunk[512];
+			snprintf(name, sizeof(name), "writer%d.bin", t);
+			FAT_OPEN_FILE * writer = mini_file_open(fs, name, true);
+			FAT_OPEN_FILE * reader = mini_file_open(fs, name, false);
+			memset(chunk, 'A' + t, sizeof(chunk));
+			for (int c = 0; c < CHUNKS; c++) {
+				mini_file_seek(fs, reader, 0, true);
+				FAT_READ_VIEW * view = mini_file_read_view(fs, reader, 4 * sizeof(chunk));
+				mini_file_seek(fs, writer, 0, true);
+				mini_file_write(fs, writer, sizeof(chunk), chunk);
+				mini_file_release_view(fs, view);
+			}
+			mini_file_close(fs, reader);
+			mini_file_close(fs, writer);
+		}));
+	}
+	for (int t = 0; t < THREADS; t++) writers[t].join();
+	score(fs->block_pins.empty() && fs->deferred_free.empty() && mini_fat_check(fs, false, 2, NULL));
+	unlink("groups.fat");
+}
+
+void test_block_kernels() {
+	const int sizes[] = {512, 4096, 65536, 1000};
+	for (int k = 0; k < 4; k++) {
+		const int block_size = sizes[k];
+		printf("Block size %d should use the %s read/write loops.\n", block_size, k < 3 ? "specialized" : "generic");
+		FAT_FILESYSTEM * fs = mini_fat_create("kernels.fat", block_size, 16);
+		score(fs->file_kernels->block_size == (k < 3 ? block_size : 0));
+		score(position_to_block_index(fs, 3 * block_size + 7) == 3 && position_to_byte_index(fs, 3 * block_size + 7) == 7);
+
+		// Odd-sized pieces cross block boundaries at every offset.
+		std::vector<char> data(block_size * 7 / 2), back(data.size());
+		for (size_t i = 0; i < data.size(); i++) data[i] = (char)(i * 7 + k);
+		FAT_OPEN_FILE * fd = mini_file_open(fs, "data.bin", true);
+		for (size_t done = 0; done < data.size(); done += 333) {
+			mini_file_write(fs, fd, std::min((size_t)333, data.size() - done), &data[done]);
+		}
+		mini_file_seek(fs, fd, 5, true);
+		score(mini_file_read(fs, fd, data.size(), &back[5]) == (fat_off_t)data.size() - 5 && memcmp(&back[5], &data[5], data.size() - 5) == 0);
+		mini_file_close(fs, fd);
+		unlink("kernels.fat");
+	}
+}
+
+void test_dedup() {
+	FAT_FILESYSTEM * fs = mini_fat_create("dedup.fat", 512, 256);
+	score(mini_fat_dedup_enable(fs));
+	char a[512], b[512], buffer[4 * 512];
+	memset(a, 'a', sizeof(a));
+	memset(b, 'b', sizeof(b));
+
+	printf("Full blocks with the same contents should be stored once.\n");
+	FAT_OPEN_FILE * fd = mini_file_open(fs, "a.bin", true);
+	const char * pattern[] = {a, b, a, a};
+	for (int i = 0; i < 4; i++) mini_file_write(fs, fd, 512, pattern[i]);
+	mini_file_close(fs, fd);
+	fd = mini_file_open(fs, "b.bin", true);
+	mini_file_write(fs, fd, 512, a);
+	mini_file_write(fs, fd, 512, a);
+	mini_file_write(fs, fd, 100, b); // partial block, not deduplicated
+	mini_file_close(fs, fd);
+	FAT_FILE * fa = mini_file_find(fs, "a.bin");
+	FAT_FILE * fb = mini_file_find(fs, "b.bin");
+	score(fa->block_ids[0] == fa->block_ids[2] && fa->block_ids[0] == fb->block_ids[1] && fa->block_ids[0] != fa->block_ids[1]);
+	FAT_DEDUP_STATS stats = mini_fat_dedup_stats(fs);
+	score(stats.unique_blocks == 2 && stats.references == 6 && stats.blocks_deduplicated == 4 && stats.ratio == 3.0);
+	score(mini_fat_check(fs, false, 2, NULL));
+
+	printf("Modifying a shared block should copy it first.\n");
+	fd = mini_file_open(fs, "a.bin", true);
+	mini_file_write(fs, fd, 10, "zzzzzzzzzz");
+	mini_file_close(fs, fd);
+	score(fa->block_ids[0] != fb->block_ids[0]);
+	fd = mini_file_open(fs, "b.bin", false);
+	score(mini_file_read(fs, fd, sizeof(buffer), buffer) == 1124 && memcmp(buffer, a, 512) == 0 && memcmp(buffer + 512, a, 512) == 0);
+	mini_file_close(fs, fd);
+
+	printf("Blocks should only be freed with their last reference.\n");
+	fat_block_t shared = fb->block_ids[0];
+	score(mini_file_delete(fs, "a.bin"));
+	score(fs->block_map[shared] == FILE_DATA_BLOCK);
+	stats = mini_fat_dedup_stats(fs);
+	score(stats.unique_blocks == 1 && stats.references == 2);
+	score(mini_fat_check(fs, false, 2, NULL));
+
+	printf("The hash index should survive save/load.\n");
+	score(mini_fat_save(fs));
+	FAT_FILESYSTEM * loaded = mini_fat_load("dedup.fat");
+	score(loaded->dedup != NULL && mini_fat_dedup_stats(loaded).references == 2);
+	fd = mini_file_open(loaded, "c.bin", true);
+	mini_file_write(loaded, fd, 512, a);
+	score(fd->file->block_ids[0] == shared);
+	mini_file_close(loaded, fd);
+
+	printf("The check should find and repair wrong reference counts.\n");
+	std::vector<FAT_DEDUP_ENTRY> entries;
+	mini_fat_dedup_entries(loaded, entries);
+	entries[0].refs = 7;
+	mini_fat_dedup_restore(loaded, entries);
+	FAT_CHECK_REPORT report;
+	score(!mini_fat_check(loaded, false, 2, &report) && report.bad_refcounts == 1);
+	mini_fat_check(loaded, true, 2, &report);
+	score(mini_fat_dedup_stats(loaded).references == 3 && mini_fat_check(loaded, false, 2, NULL));
+	unlink("dedup.fat");
+}
+
+// Highest thread number in the record chunks of a trace file, -1 if none.
+static int trace_max_thread(const char *trace_path) {
+	int fd = open(trace_path, O_RDONLY);
+	int max_thread = -1;
+	uint32_t header[2];
+	lseek(fd, 32, SEEK_SET);
+	while (read(fd, header, sizeof(header)) == sizeof(header)) {
+		std::vector<char> payload(header[1]);
+		if (read(fd, payload.data(), payload.size()) != (ssize_t)payload.size()) break;
+		for (size_t at = 0; header[0] == 1 && at + sizeof(FAT_TRACE_RECORD) <= payload.size(); at += sizeof(FAT_TRACE_RECORD)) {
+			FAT_TRACE_RECORD record;
+			memcpy(&record, &payload[at], sizeof(record));
+			max_thread = std::max(max_thread, (int)record.thread);
+		}
+	}
+	close(fd);
+	return max_thread;
+}
+
+void test_trace() {
+	FAT_FILESYSTEM * fs = mini_fat_create("traced.fat", 512, 256);
+	printf("Calls from several threads should be recorded.\n");
+	score(mini_fat_trace_start(fs, "api.trace"));
+	FAT_OPEN_FILE * handles[2] = { mini_file_open(fs, "t0.bin", true), mini_file_open(fs, "t1.bin", true) };
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 2; t++) {
+		threads.push_back(std::thread([fs, &handles, t] {
+			char buffer[700];
+			memset(buffer, 't', sizeof(buffer));
+			for (int i = 0; i < 50; i++) mini_file_write(fs, handles[t], sizeof(buffer), buffer);
+			mini_file_seek(fs, handles[t], 100, true);
+			for (int i = 0; i < 10; i++) mini_file_read(fs, handles[t], sizeof(buffer), buffer);
+		}));
+	}
+	for (int t = 0; t < 2; t++) threads[t].join();
+	mini_file_close(fs, handles[0]);
+	mini_file_close(fs, handles[1]);
+	usleep(50000);
+	mini_file_delete(fs, "t0.bin");
+	mini_file_open(fs, "missing.bin", false); // failed calls are recorded too
+	FAT_OPEN_FILE * shared = mini_file_open_shared(fs, "s.bin"); // left open, the replay closes it
+	mini_file_seek(fs, shared, 1000, true);
+	char pattern[100];
+	memset(pattern, 's', sizeof(pattern));
+	mini_file_write(fs, shared, sizeof(pattern), pattern);
+	score(mini_fat_trace_stop(fs));
+
+	printf("Replaying the trace should repeat every call with the same results.\n");
+	FAT_REPLAY_REPORT report;
+	score(mini_fat_trace_replay("api.trace", "replay.fat", false, &report));
+	score(report.records == 2 + 2 * 61 + 2 + 1 + 1 + 3 && report.mismatched == 0);
+	score(report.replayed[FAT_TRACE_WRITE].count == 101 && report.traced[FAT_TRACE_READ].count == 20);
+	score(report.replayed[FAT_TRACE_OPEN_SHARED].count == 1);
+	score(report.replayed[FAT_TRACE_WRITE].p50_us <= report.replayed[FAT_TRACE_WRITE].max_us);
+	FAT_FILESYSTEM * replayed = mini_fat_load("replay.fat");
+	score(mini_file_find(replayed, "t0.bin") == NULL && mini_file_size(replayed, "t1.bin") == 50 * 700);
+	score(mini_file_size(replayed, "s.bin") == 1100);
+
+	printf("Timed replay should keep the pauses between calls.\n");
+	score(report.seconds < 0.05);
+	score(mini_fat_trace_replay("api.trace", "replay.fat", true, &report) && report.mismatched == 0 && report.seconds >= 0.05);
+
+	printf("A thread alternating between two traced volumes should keep one ring per tracer.\n");
+	FAT_FILESYSTEM * other = mini_fat_create("replay.fat", 512, 256);
+	mini_fat_trace_start(fs, "api.trace");
+	mini_fat_trace_start(other, "other.trace");
+	for (int i = 0; i < 100; i++) {
+		mini_file_close(fs, mini_file_open(fs, "t1.bin", false));
+		mini_file_close(other, mini_file_open(other, "o.bin", true));
+	}
+	score(mini_fat_trace_stop(fs) && mini_fat_trace_stop(other));
+	score(trace_max_thread("api.trace") == 0 && trace_max_thread("other.trace") == 0);
+	mini_fat_destroy(other);
+	unlink("api.trace");
+	unlink("other.trace");
+	unlink("traced.fat");
+	unlink("replay.fat");
+}
+
+void test_direct() {
+	FAT_FILESYSTEM * fs = mini_fat_create("direct.fat", 1024, 64);
+	printf("Direct I/O should be enabled on a 1 KB block volume.\n");
+	score(mini_fat_direct_enable(fs));
+
+	printf("Unaligned writes should merge the edge blocks.\n");
+	alignas(FAT_DIRECT_ALIGN) char storage[5000 + 1];
+	char * data = storage + 1; // never aligned, so every block goes through a bounce buffer
+	for (int i = 0; i < 5000; ++i) data[i] = 'a' + i % 26;
+	FAT_OPEN_FILE * fd = mini_file_open(fs, "direct.bin", true);
+	score(mini_file_write(fs, fd, 3000, data) == 3000);
+	mini_file_seek(fs, fd, 100, true);
+	score(mini_file_write(fs, fd, 50, "0123456789012345678901234567890123456789012345678") == 50);
+	memcpy(data + 100, "0123456789012345678901234567890123456789012345678", 50);
+	FAT_DIRECT_STATS stats = mini_fat_direct_stats(fs);
+	score(stats.blocks_merged == 2 && stats.bytes_direct == 0 && stats.bytes_bounced == 3050);
+
+	printf("Aligned whole blocks should not be copied.\n");
+	void * aligned = NULL;
+	posix_memalign(&aligned, FAT_DIRECT_ALIGN, 4096);
+	memcpy(aligned, data, 4096);
+	mini_file_seek(fs, fd, 0, true);
+	score(mini_fat_write_in_blocks(fs, fd->file->block_ids[0], 1024, aligned) == 1024);
+	memset(aligned, 0, 4096);
+	score(mini_fat_read_in_blocks(fs, fd->file->block_ids[0], 1024, aligned) == 1024 && memcmp(aligned, data, 1024) == 0);
+	stats = mini_fat_direct_stats(fs);
+	score(stats.bytes_direct == 2048 && stats.blocks_merged == 2);
+
+	printf("Reads should see what was written, with and without direct I/O.\n");
+	char buffer[5000];
+	mini_file_seek(fs, fd, 0, true);
+	score(mini_file_read(fs, fd, sizeof(buffer), buffer) == 3000 && memcmp(buffer, data, 3000) == 0);
+	mini_file_close(fs, fd);
+	mini_fat_direct_disable(fs);
+	fd = mini_file_open(fs, "direct.bin", false);
+	memset(buffer, 0, sizeof(buffer));
+	score(mini_file_read(fs, fd, sizeof(buffer), buffer) == 3000 && memcmp(buffer, data, 3000) == 0);
+	mini_file_close(fs, fd);
+	free(aligned);
+	unlink("direct.fat");
+
+	printf("Block sizes below the direct I/O alignment should be refused.\n");
+	fs = mini_fat_create("direct.fat", 128, 16);
+	score(!mini_fat_direct_enable(fs) && fs->direct == NULL);
+	unlink("direct.fat");
+
+	printf("The whole suite should pass with direct I/O.\n");
+	fs = mini_fat_create("direct.fat", 1024, 10);
+	score(mini_fat_direct_enable(fs));
+	test_suite(fs);
+	unlink("direct.fat");
+}
+
+void test_share() {
+	FAT_FILESYSTEM * fs = mini_fat_create("shared.fat", 1024, 64);
+	mini_fat_save(fs);
+	FAT_FILESYSTEM * a = mini_fat_load("shared.fat");
+	FAT_FILESYSTEM * b = mini_fat_load("shared.fat");
+	printf("Two mounts of one image should share it.\n");
+	score(mini_fat_share_mount(a) && mini_fat_share_mount(b));
+
+	printf("Only one mount should write a file, and the other should see the writes.\n");
+	FAT_OPEN_FILE * fa = mini_file_open(a, "a.txt", true);
+	score(fa != NULL && mini_file_write(a, fa, strlen(fox), fox) == (fat_off_t)strlen(fox));
+	score(mini_file_open(b, "a.txt", true) == NULL && !mini_file_delete(b, "a.txt"));
+	FAT_OPEN_FILE * fb = mini_file_open(b, "a.txt", false);
+	char buffer[4096];
+	memset(buffer, 0, sizeof(buffer));
+	score(fb != NULL && mini_file_read(b, fb, sizeof(buffer), buffer) == (fat_off_t)strlen(fox) && strcmp(buffer, fox) == 0);
+	mini_file_close(b, fb);
+	mini_file_close(a, fa);
+	fb = mini_file_open(b, "a.txt", true);
+	score(fb != NULL);
+	mini_file_close(b, fb);
+
+	printf("Files created on both mounts should never share blocks.\n");
+	FAT_OPEN_FILE * ha = mini_file_open(a, "from_a.bin", true);
+	FAT_OPEN_FILE * hb = mini_file_open(b, "from_b.bin", true);
+	memset(buffer, 'x', sizeof(buffer));
+	for (int i = 0; i < 4; i++) {
+		mini_file_write(a, ha, 1500, buffer);
+		mini_file_write(b, hb, 1500, buffer);
+	}
+	mini_file_close(a, ha);
+	mini_file_close(b, hb);
+	score(mini_file_size(a, "from_a.bin") == 6000 && mini_file_size(a, "from_b.bin") == 6000);
+
+	printf("Overwriting bytes a file already has should not save the table.\n");
+	mini_fat_share_refresh(b);
+	const fat_block_t * loaded_ids = mini_file_find(b, "from_a.bin")->block_ids.data();
+	memset(buffer, 'y', 100);
+	ha = mini_file_open(a, "from_a.bin", true);
+	score(mini_file_write(a, ha, 100, buffer) == 100 && mini_file_close(a, ha));
+	//b reloads the table, and so its block lists, only after a save
+	hb = mini_file_open(b, "from_a.bin", false);
+	char head[100];
+	score(mini_file_find(b, "from_a.bin")->block_ids.data() == loaded_ids
+		&& mini_file_read(b, hb, sizeof(head), head) == sizeof(head) && memcmp(head, buffer, sizeof(head)) == 0);
+	mini_file_close(b, hb);
+	memset(buffer, 'x', sizeof(buffer));
+	mini_file_close(b, mini_file_open(b, "late.txt", true));
+	score(mini_file_find(a, "late.txt") == NULL && mini_fat_share_refresh(a) && mini_file_find(a, "late.txt") != NULL);
+	FAT_FILESYSTEM * loaded = mini_fat_load("shared.fat");
+	score(loaded->files.size() == 4 && mini_fat_check(loaded, false, 2, NULL));
+
+	printf("A file written by another process should be visible.\n");
+	pid_t child = fork();
+	if (child == 0) {
+		FAT_FILESYSTEM * c = mini_fat_load("shared.fat");
+		mini_fat_share_mount(c);
+		FAT_OPEN_FILE * fc = mini_file_open(c, "child.txt", true);
+		for (int i = 0; i < 50; i++) mini_file_write(c, fc, strlen(fox), fox);
+		mini_file_close(c, fc);
+		mini_fat_share_unmount(c);
+		_exit(0);
+	}
+	int status;
+	waitpid(child, &status, 0);
+	fa = mini_file_open(a, "child.txt", false);
+	score(fa != NULL && mini_file_read(a, fa, sizeof(buffer), buffer) == 50 * (fat_off_t)strlen(fox) && memcmp(buffer + 49 * strlen(fox), fox, strlen(fox)) == 0);
+	mini_file_close(a, fa);
+
+	printf("A process dying with the lock held should not block the others.\n");
+	child = fork();
+	if (child == 0) {
+		FAT_FILESYSTEM * c = mini_fat_load("shared.fat");
+		mini_fat_share_mount(c);
+		mini_fat_share_begin(c);
+		_exit(0);
+	}
+	waitpid(child, &status, 0);
+	score(mini_file_delete(b, "child.txt") && mini_file_find(a, "child.txt") != NULL);
+	score(mini_file_open(a, "child.txt", false) == NULL);
+
+	printf("A file read on another mount should not be deleted before its last close.\n");
+	fa = mini_file_open(a, "from_b.bin", false);
+	score(fa != NULL && !mini_file_delete(b, "from_b.bin"));
+	std::vector<char> expected(sizeof(buffer), 'x');
+	memset(buffer, 0, sizeof(buffer));
+	score(mini_file_read(a, fa, sizeof(buffer), buffer) == sizeof(buffer) && memcmp(buffer, expected.data(), sizeof(buffer)) == 0);
+	score(mini_file_close(a, fa) && mini_file_delete(b, "from_b.bin") && mini_fat_share_refresh(a) && mini_file_find(a, "from_b.bin") == NULL);
+
+	printf("The trimmer should not run on a shared mount.\n");
+	score(!mini_fat_trim_start(a, 0));
+	mini_fat_share_unmount(a);
+	mini_fat_share_unmount(b);
+	unlink("shared.fat");
+}
+
+// Blocks of a file on the fast tier.
+static int fast_blocks(const FAT_FILESYSTEM *fs, const char *name) {
+	FAT_FILE * file = mini_file_find(fs, name);
+	int count = 0;
+	for (size_t i = 0; i < file->block_ids.size(); i++) {
+		count += file->block_ids[i] >= fs->tier_boundary;
+	}
+	return count;
+}
+
+static bool read_back(FAT_FILESYSTEM *fs, const char *name, const char *data, const int size) {
+	FAT_OPEN_FILE * fd = mini_file_open(fs, name, false);
+	std::vector<char> buffer(size + 1);
+	bool ok = fd != NULL && mini_file_read(fs, fd, size + 1, buffer.data()) == size && memcmp(buffer.data(), data, size) == 0;
+	mini_file_close(fs, fd);
+	return ok;
+}
+
+void test_tier() {
+	FAT_FILESYSTEM * fs = mini_fat_create("tier.fat", 1024, 32);
+	printf("A fast tier should add its blocks after the capacity blocks.\n");
+	score(mini_fat_tier_attach(fs, "tier_fast.fat", 8) && fs->block_count == 40 && fs->tier_boundary == 32);
+
+	printf("New data should go to the fast tier, and spill over when it is full.\n");
+	char data[8000];
+	for (int i = 0; i < (int)sizeof(data); ++i) data[i] = 'a' + i % 26;
+	FAT_OPEN_FILE * fd = mini_file_open(fs, "new.bin", true);
+	mini_file_write(fs, fd, 3000, data);
+	mini_file_close(fs, fd);
+	score(fast_blocks(fs, "new.bin") == 3);
+	fd = mini_file_open(fs, "big.bin", true);
+	mini_file_write(fs, fd, 8000, data);
+	mini_file_close(fs, fd);
+	FAT_FILE * big = mini_file_find(fs, "big.bin");
+	int fast_before = fast_blocks(fs, "big.bin");
+	score(fast_before > 0 && fast_before < 8 && read_back(fs, "big.bin", data, 8000));
+
+	printf("A round should promote read-hot blocks and demote cold ones.\n");
+	for (int i = 0; i < FAT_TIER_PROMOTE_HEAT; i++) read_back(fs, "big.bin", data, 8000);
+	score(mini_fat_tier_migrate(fs) > 0);
+	FAT_TIER_STATS stats = mini_fat_tier_stats(fs);
+	score(stats.promoted > 0 && stats.demoted > 0 && stats.rounds == 1);
+	score(fast_blocks(fs, "big.bin") == 8 && fast_blocks(fs, "new.bin") == 0);
+	score(read_back(fs, "big.bin", data, 8000) && read_back(fs, "new.bin", data, 3000));
+	score(mini_fat_check(fs, false, 2, NULL));
+
+	printf("The fast tier should be reopened by load.\n");
+	std::vector<fat_block_t> moved = big->block_ids;
+	score(mini_fat_save(fs));
+	FAT_FILESYSTEM * loaded = mini_fat_load("tier.fat");
+	score(loaded->tier != NULL && loaded->tier_boundary == 32 && mini_file_find(loaded, "big.bin")->block_ids == moved);
+	score(read_back(loaded, "big.bin", data, 8000) && mini_fat_check(loaded, false, 2, NULL));
+	score(!mini_fat_direct_enable(loaded));
+	fd = mini_file_open(loaded, "big.bin", false);
+	FAT_READ_VIEW * view = mini_file_read_view(loaded, fd, 8000);
+	std::string viewed;
+	for (size_t i = 0; view != NULL && i < view->spans.size(); i++) viewed.append((const char *)view->spans[i].data, view->spans[i].size);
+	score(viewed.size() == 8000 && memcmp(viewed.data(), data, 8000) == 0);
+	mini_file_release_view(loaded, view);
+	mini_file_close(loaded, fd);
+
+	printf("The migrator thread should run rounds while files are read.\n");
+	score(mini_fat_tier_start(loaded, 1));
+	bool intact = true;
+	for (int i = 0; i < 200; i++) intact = read_back(loaded, i % 2 ? "big.bin" : "new.bin", data, i % 2 ? 8000 : 3000) && intact;
+	usleep(20000);
+	mini_fat_tier_stop(loaded);
+	score(intact && mini_fat_tier_stats(loaded).rounds > 0 && mini_fat_check(loaded, false, 2, NULL));
+	unlink("tier.fat");
+	unlink("tier_fast.fat");
+
+	printf("A moved block should stay in the dedup index under its new id.\n");
+	fs = mini_fat_create("tier.fat", 1024, 32);
+	mini_fat_dedup_enable(fs);
+	mini_fat_tier_attach(fs, "tier_fast.fat", 4);
+	fd = mini_file_open(fs, "fill.bin", true);
+	mini_file_write(fs, fd, 6144, data); // more than the fast tier holds
+	mini_file_close(fs, fd);
+	char hot[1024];
+	memset(hot, 'h', sizeof(hot));
+	fd = mini_file_open(fs, "hot.bin", true);
+	mini_file_write(fs, fd, sizeof(hot), hot);
+	mini_file_close(fs, fd);
+	for (int i = 0; i < FAT_TIER_PROMOTE_HEAT; i++) read_back(fs, "hot.bin", hot, sizeof(hot));
+	mini_fat_tier_migrate(fs);
+	score(fast_blocks(fs, "hot.bin") == 1);
+	fd = mini_file_open(fs, "copy.bin", true);
+	mini_file_write(fs, fd, sizeof(hot), hot);
+	mini_file_close(fs, fd);
+	score(mini_file_find(fs, "copy.bin")->block_ids == mini_file_find(fs, "hot.bin")->block_ids && mini_fat_check(fs, false, 2, NULL));
+	unlink("tier.fat");
+	unlink("tier_fast.fat");
+
+	printf("The whole suite should pass on a tiered volume.\n");
+	fs = mini_fat_create("tier.fat", 1024, 4);
+	score(mini_fat_tier_attach(fs, "tier_fast.fat", 6));
+	test_suite(fs);
+	unlink("tier.fat");
+	unlink("tier_fast.fat");
+}
+
+void test_range_locks() {
+	const int THREADS = 8;
+	const int REGION = 10000; // Not a multiple of the block size.
+	FAT_FILESYSTEM * fs = mini_fat_create("locks.fat", 1024, 256);
+	printf("Shared writers should exclude exclusive ones, but not each other.\n");
+	FAT_OPEN_FILE * a = mini_file_open_shared(fs, "out.bin");
+	FAT_OPEN_FILE * b = mini_file_open_shared(fs, "out.bin");
+	score(a != NULL && b != NULL && mini_file_open(fs, "out.bin", true) == NULL);
+	FAT_OPEN_FILE * exclusive = mini_file_open(fs, "other.bin", true);
+	score(mini_file_open_shared(fs, "other.bin") == NULL && !mini_file_delete(fs, "out.bin"));
+
+	printf("Overlapping locks should conflict unless both are shared.\n");
+	FAT_OPEN_FILE * reader = mini_file_open(fs, "out.bin", false);
+	score(mini_file_lock(fs, a, 0, 100, true, false) && !mini_file_lock(fs, b, 50, 100, true, false));
+	score(mini_file_lock(fs, b, 100, 100, false, false) && !mini_file_lock(fs, b, 0, 10, false, false));
+	score(mini_file_lock(fs, reader, 150, 0, false, false) && !mini_file_lock(fs, reader, 300, 10, true, false));
+	score(!mini_file_lock(fs, a, 1000, 10, true, false) && mini_file_unlock(fs, b, 100, 100));
+	score(mini_file_unlock(fs, reader, 150, 0) && mini_file_lock(fs, a, 1000, 10, true, false) && !mini_file_unlock(fs, a, 1000, 11));
+
+	printf("A blocking lock should wait for the conflicting one.\n");
+	std::atomic<bool> locked(false);
+	std::thread waiter([fs, b, &locked] {
+		mini_file_lock(fs, b, 20, 10, true, true);
+		locked = true;
+	});
+	usleep(20000);
+	bool waited = !locked;
+	mini_file_unlock(fs, a, 0, 100);
+	waiter.join();
+	score(waited && locked);
+	printf("Closing a handle should release its locks.\n");
+	mini_file_close(fs, b);
+	score(mini_file_lock(fs, a, 0, 100, true, false));
+	mini_file_close(fs, a);
+	mini_file_close(fs, reader);
+	mini_file_close(fs, exclusive);
+
+	printf("Writers of disjoint ranges should fill one file together.\n");
+	std::vector<FAT_OPEN_FILE*> handles;
+	for (int t = 0; t < THREADS; t++) handles.push_back(mini_file_open_shared(fs, "out.bin"));
+	std::vector<std::thread> writers;
+	for (int t = THREADS - 1; t >= 0; t--) {
+		writers.push_back(std::thread([fs, t, &handles] {
+			FAT_OPEN_FILE * fd = handles[t];
+			char chunk[REGION / 10];
+			memset(chunk, 'a' + t, sizeof(chunk));
+			mini_file_lock(fs, fd, (fat_off_t)t * REGION, REGION, true, true);
+			mini_file_seek(fs, fd, (fat_off_t)t * REGION, true);
+			for (int c = 0; c < 10; c++) mini_file_write(fs, fd, sizeof(chunk), chunk);
+			mini_file_unlock(fs, fd, (fat_off_t)t * REGION, REGION);
+		}));
+	}
+	for (int t = 0; t < THREADS; t++) writers[t].join();
+	for (int t = 0; t < THREADS; t++) mini_file_close(fs, handles[t]);
+	std::vector<char> data(THREADS * REGION + 1);
+	FAT_OPEN_FILE * fd = mini_file_open(fs, "out.bin", false);
+	score(mini_file_read(fs, fd, data.size(), data.data()) == THREADS * REGION);
+	bool contents = true;
+	for (int i = 0; i < THREADS * REGION; i++) contents = contents && data[i] == 'a' + i / REGION;
+	score(contents && mini_fat_check(fs, false, 2, NULL));
+	mini_file_close(fs, fd);
+
+	printf("Bytes skipped by a shared writer should read as zeros.\n");
+	fd = mini_file_open(fs, "junk.bin", true);
+	mini_file_write(fs, fd, 5000, data.data());
+	mini_file_close(fs, fd);
+	mini_file_delete(fs, "junk.bin");
+	fd = mini_file_open_shared(fs, "gap.bin");
+	mini_file_write(fs, fd, 100, data.data());
+	score(mini_file_seek(fs, fd, 4000, true) && mini_file_write(fs, fd, 100, data.data()) == 100);
+	mini_file_close(fs, fd);
+	fd = mini_file_open(fs, "gap.bin", false);
+	std::vector<char> gap(5000, 'x');
+	score(mini_file_read(fs, fd, gap.size(), gap.data()) == 4100 && std::count(gap.begin() + 100, gap.begin() + 4000, 0) == 3900);
+	score(memcmp(gap.data(), data.data(), 100) == 0 && memcmp(gap.data() + 4000, data.data(), 100) == 0);
+	mini_file_close(fs, fd);
+	unlink("locks.fat");
+
+	printf("A shared write cut short should give back the blocks it allocated.\n");
+	fs = mini_fat_create("locks.fat", 1024, 8);
+	FAT_OPEN_FILE * writer = mini_file_open_shared(fs, "full.bin");
+	mini_file_write(fs, writer, 3072, data.data());
+	fd = mini_file_open(fs, "full.bin", false);
+	FAT_READ_VIEW * view = mini_file_read_view(fs, fd, 1024); // pinned, and no free block to unshare it into
+	mini_file_seek(fs, writer, 0, true);
+	score(mini_file_write(fs, writer, 6144, data.data()) == 0 && writer->file->block_ids.size() == 3);
+	score(std::count(fs->block_map.begin(), fs->block_map.end(), EMPTY_BLOCK) == 3 && mini_fat_check(fs, false, 2, NULL));
+	mini_file_release_view(fs, view);
+	mini_file_close(fs, fd);
+	mini_file_close(fs, writer);
+	unlink("locks.fat");
+}
+
+void test_memory() {
+	struct stat st;
+	FAT_FILESYSTEM * fs = mini_fat_create("mem:memory.fat", 1024, 10);
+	printf("A memory volume should not create an image file.\n");
+	score(fs != NULL && fs->memory != NULL && fs->image_fd == -1 && stat("memory.fat", &st) != 0 && stat("mem:memory.fat", &st) != 0);
+	printf("A volume whose image cannot be created should not be returned.\n");
+	score(mini_fat_create("no_such_dir/memory.fat", 1024, 10) == NULL);
+
+	printf("The whole suite should pass on a memory volume.\n");
+	test_suite(fs);
+	score(mini_fat_save(fs) && stat("memory.fat", &st) != 0);
+	score(!mini_fat_direct_enable(fs) && !mini_fat_share_mount(fs) && !mini_fat_trim_start(fs, 0));
+	score(!mini_fat_tier_attach(fs, "memory_fast.fat", 4) && stat("memory_fast.fat", &st) != 0);
+
+	printf("A snapshot should show the volume as it was when it started.\n");
+	fs = mini_fat_create("mem:snapshot", 1024, 256);
+	std::vector<char> old_data(20000, 'a'), new_data(20000, 'b'), data(20000);
+	FAT_OPEN_FILE * fd = mini_file_open(fs, "data.bin", true);
+	mini_file_write(fs, fd, old_data.size(), old_data.data());
+	mini_file_close(fs, fd);
+	//10 blocks per tenth of a second, so most of data.bin is written after it changed
+	score(mini_fat_memory_snapshot(fs, "memory_snap.fat", 100 * 1024));
+	fd = mini_file_open(fs, "data.bin", true);
+	score(mini_file_write(fs, fd, new_data.size(), new_data.data()) == (fat_off_t)new_data.size());
+	mini_file_close(fs, fd);
+	fd = mini_file_open(fs, "late.txt", true);
+	mini_file_write(fs, fd, strlen(fox), fox);
+	mini_file_close(fs, fd);
+	score(mini_fat_memory_stats(fs).snapshot_running);
+	score(mini_fat_memory_wait(fs));
+	FAT_MEMORY_STATS stats = mini_fat_memory_stats(fs);
+	score(stats.snapshots == 1 && stats.preserved > 0 && !stats.snapshot_running && stats.bytes % FAT_MEMORY_HUGE_PAGE == 0);
+	fd = mini_file_open(fs, "data.bin", false);
+	score(mini_file_read(fs, fd, data.size(), data.data()) == (fat_off_t)data.size() && data == new_data);
+	mini_file_close(fs, fd);
+
+	printf("The snapshot should load from disk and into memory.\n");
+	const char * names[] = {"memory_snap.fat", "mem:memory_snap.fat"};
+	for (int i = 0; i < 2; i++) {
+		FAT_FILESYSTEM * loaded = mini_fat_load(names[i]);
+		fd = mini_file_open(loaded, "data.bin", false);
+		score((loaded->memory != NULL) == (i == 1) && fd != NULL && mini_file_find(loaded, "late.txt") == NULL);
+		score(fd != NULL && mini_file_read(loaded, fd, data.size(), data.data()) == (fat_off_t)data.size() && data == old_data);
+		mini_file_close(loaded, fd);
+		score(mini_fat_check(loaded, false, 2, NULL));
+	}
+	unlink("memory_snap.fat");
+}
+
+// Whether blocks [from, from + FAT_LARGE_BLOCKS) of a file form one aligned large block.
+static bool is_large_block(const FAT_FILE *file, const size_t from) {
+	if (from + FAT_LARGE_BLOCKS > file->block_ids.size() || file->block_ids[from] % FAT_LARGE_BLOCKS != 0) return false;
+	for (size_t i = 1; i < (size_t)FAT_LARGE_BLOCKS; i++) {
+		if (file->block_ids[from + i] != file->block_ids[from] + (fat_block_t)i) return false;
+	}
+	return true;
+}
+
+void test_large_blocks() {
+	FAT_FILESYSTEM * fs = mini_fat_create("large_blocks.fat", 1024, 1024);
+	std::vector<char> data(100 * 1024);
+	for (size_t i = 0; i < data.size(); i++) data[i] = 'a' + i % 23;
+	printf("A hinted file should get aligned large blocks next to an interleaved small writer.\n");
+	FAT_OPEN_FILE * big = mini_file_open(fs, "hinted.bin", true);
+	FAT_OPEN_FILE * small = mini_file_open(fs, "small.bin", true);
+	FAT_OPEN_FILE * reader = mini_file_open(fs, "small.bin", false);
+	score(mini_file_size_hint(fs, big, 80 * 1024) && !mini_file_size_hint(fs, reader, 80 * 1024));
+	mini_file_close(fs, reader);
+	for (int i = 0; i < 40; i++) {
+		mini_file_write(fs, big, 1000, &data[i * 1000]);
+		mini_file_write(fs, small, 100, &data[i * 100]);
+	}
+	FAT_FILE * hinted = mini_file_find(fs, "hinted.bin");
+	score(hinted->block_ids.size() == 40 && is_large_block(hinted, 0) && is_large_block(hinted, 16));
+	score(mini_file_find(fs, "small.bin")->block_ids.size() == 4);
+	score(std::count(fs->block_map.begin(), fs->block_map.end(), RESERVED_BLOCK) == 8 && mini_fat_check(fs, false, 2, NULL));
+
+	printf("Reserved blocks should be free in a saved image and after close.\n");
+	score(mini_fat_save(fs));
+	FAT_FILESYSTEM * loaded = mini_fat_load("large_blocks.fat");
+	score(std::count(loaded->block_map.begin(), loaded->block_map.end(), RESERVED_BLOCK) == 0 && mini_fat_check(loaded, false, 2, NULL));
+	mini_file_close(fs, big);
+	mini_file_close(fs, small);
+	score(std::count(fs->block_map.begin(), fs->block_map.end(), RESERVED_BLOCK) == 0 && mini_fat_check(fs, false, 2, NULL));
+
+	printf("A file should switch to large blocks once it has grown large.\n");
+	big = mini_file_open(fs, "grown.bin", true);
+	small = mini_file_open(fs, "small.bin", true);
+	for (int i = 0; i < 100; i++) {
+		mini_file_write(fs, big, 1024, &data[i * 1024]);
+		mini_file_write(fs, small, 100, &data[i * 100]);
+	}
+	mini_file_close(fs, big);
+	mini_file_close(fs, small);
+	FAT_FILE * grown = mini_file_find(fs, "grown.bin");
+	score(!is_large_block(grown, 0) && is_large_block(grown, FAT_LARGE_FILE_BLOCKS) && is_large_block(grown, FAT_LARGE_FILE_BLOCKS + 16));
+
+	printf("Reads and writes across mixed blocks should see the file bytes.\n");
+	big = mini_file_open(fs, "grown.bin", true);
+	score(mini_file_seek(fs, big, 500, true) && mini_file_write(fs, big, 90000, &data[500]) == 90000);
+	mini_file_close(fs, big);
+	big = mini_file_open(fs, "grown.bin", false);
+	std::vector<char> back(data.size() + 10);
+	score(mini_file_read(fs, big, back.size(), back.data()) == (fat_off_t)data.size() && memcmp(back.data(), data.data(), data.size()) == 0);
+	score(mini_file_seek(fs, big, 1000, true) && mini_file_read(fs, big, 70000, back.data()) == 70000 && memcmp(back.data(), &data[1000], 70000) == 0);
+	mini_file_close(fs, big);
+	score(mini_fat_check(fs, false, 2, NULL));
+
+	printf("A run write that fails should give back the blocks it allocated.\n");
+	close(fs->image_fd);
+	fs->image_fd = open("large_blocks.fat", O_RDONLY);
+	big = mini_file_open(fs, "failed.bin", true);
+	score(mini_file_write(fs, big, 4096, data.data()) <= 0 && big->file->block_ids.empty());
+	mini_file_close(fs, big);
+	score(mini_fat_check(fs, false, 2, NULL));
+	unlink("large_blocks.fat");
+}
+
+int main()
+{
+	printf("Creating a FAT filesystem:\n");
+	FAT_FILESYSTEM * fs = mini_fat_create("fs1.fat", 1024, 10);
+
+	test_small_filesystem(mini_fat_create("temp.fat", 128, 3)); // Only 3 blocks, 1 metadata, 2 files.
+
+	test_suite(fs);
+
+	if (current_score == total_score) {
+		// Everything is working, now test save/load:
+		printf("Saving the FAT filesystem.\n");
+		score(mini_fat_save(fs), 6);
+
+		printf("Loading the FAT filesystem.\n");
+		FAT_FILESYSTEM *loaded_fs = mini_fat_load("fs1.fat");
+		mini_fat_dump(loaded_fs);
+
+		score(mini_file_delete(loaded_fs, "file1.txt"));
+		test_suite(loaded_fs);
+	} else {
+		printf("Skipping save/load tests as other tests are not passing.\n");
+	}
+
+	test_large_offsets();
+	test_load_version1();
+	test_batch();
+	test_check();
+	test_trim();
+	test_concurrent_writes();
+	test_block_kernels();
+	test_dedup();
+	test_trace();
+	test_direct();
+	test_share();
+	test_tier();
+	test_range_locks();
+	test_memory();
+	test_large_blocks();
+
+
+	printf("Final score: %d/%d\n", current_score*100/total_score, 100);
+	return current_score == total_score ? 0 : 1;
+}
+